@@ -9,9 +9,83 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
+#include <errno.h>
 
 #include "sqlite3.h"
 
+/* deserialized databases can be mapped from files */
+#if defined(__unix__) || defined(__APPLE__)
+#define LUASQL_SQLITE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* threads of the reader pools */
+#if defined(_WIN32)
+#include <windows.h>
+typedef HANDLE luasql_thread;
+typedef CRITICAL_SECTION luasql_mutex;
+typedef CONDITION_VARIABLE luasql_cond;
+#define THREAD_RESULT DWORD WINAPI
+#define thread_start(t, f, arg) ((*(t) = CreateThread(NULL, 0, f, arg, 0, NULL)) != NULL)
+#define thread_join(t) (WaitForSingleObject(t, INFINITE), CloseHandle(t))
+#define mutex_init(m) InitializeCriticalSection(m)
+#define mutex_destroy(m) DeleteCriticalSection(m)
+#define mutex_lock(m) EnterCriticalSection(m)
+#define mutex_unlock(m) LeaveCriticalSection(m)
+#define cond_init(c) InitializeConditionVariable(c)
+#define cond_destroy(c) ((void)(c))
+#define cond_wait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#define cond_signal(c) WakeConditionVariable(c)
+#define cond_broadcast(c) WakeAllConditionVariable(c)
+#define cond_timedwait(c, m, ms) SleepConditionVariableCS(c, m, (DWORD)(ms))
+#define clock_ms() ((sqlite3_int64)GetTickCount64())
+#else
+#include <time.h>
+#include <pthread.h>
+typedef pthread_t luasql_thread;
+typedef pthread_mutex_t luasql_mutex;
+typedef pthread_cond_t luasql_cond;
+#define THREAD_RESULT void *
+#define thread_start(t, f, arg) (pthread_create(t, NULL, f, arg) == 0)
+#define thread_join(t) pthread_join(t, NULL)
+#define mutex_init(m) pthread_mutex_init(m, NULL)
+#define mutex_destroy(m) pthread_mutex_destroy(m)
+#define mutex_lock(m) pthread_mutex_lock(m)
+#define mutex_unlock(m) pthread_mutex_unlock(m)
+#define cond_init(c) pthread_cond_init(c, NULL)
+#define cond_destroy(c) pthread_cond_destroy(c)
+#define cond_wait(c, m) pthread_cond_wait(c, m)
+#define cond_signal(c) pthread_cond_signal(c)
+#define cond_broadcast(c) pthread_cond_broadcast(c)
+
+/* monotonic clock of the query deadlines, in milliseconds */
+static sqlite3_int64 clock_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (sqlite3_int64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* wait for a condition at most 'ms' milliseconds */
+static void cond_timedwait(luasql_cond *c, luasql_mutex *m, int ms)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += ms / 1000;
+  ts.tv_nsec += (long)(ms % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000)
+    {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+  pthread_cond_timedwait(c, m, &ts);
+}
+#endif
+
 #include "lua.h"
 #include "lauxlib.h"
 
@@ -20,7 +94,71 @@
 
 #define LUASQL_ENVIRONMENT_SQLITE "SQLite3 environment"
 #define LUASQL_CONNECTION_SQLITE "SQLite3 connection"
+#define LUASQL_STATEMENT_SQLITE "SQLite3 statement"
 #define LUASQL_CURSOR_SQLITE "SQLite3 cursor"
+#define LUASQL_BLOB_SQLITE "SQLite3 blob"
+#define LUASQL_ARRAY_SQLITE "SQLite3 array"
+#define LUASQL_BACKUP_SQLITE "SQLite3 backup"
+#define LUASQL_POOL_SQLITE "SQLite3 pool"
+#define LUASQL_POOLCURSOR_SQLITE "SQLite3 pool cursor"
+#define LUASQL_SHARDS_SQLITE "SQLite3 shards"
+#define LUASQL_SHARDCURSOR_SQLITE "SQLite3 shard cursor"
+#define LUASQL_SNAPSHOT_SQLITE "SQLite3 snapshot"
+#define LUASQL_SESSION_SQLITE "SQLite3 session"
+
+/* binding error caused by the caller; the message is left on the stack */
+#define LUASQL_BIND_MISUSE (-1)
+
+/* transaction control statements prepared once by each connection */
+#define LUASQL_TXN_BEGIN 0
+#define LUASQL_TXN_COMMIT 1
+#define LUASQL_TXN_ROLLBACK 2
+
+/* savepoint statements run by conn:savepoint, release and rollbackto */
+#define LUASQL_SAVEPOINT_START 0
+#define LUASQL_SAVEPOINT_RELEASE 1
+#define LUASQL_SAVEPOINT_ROLLBACK 2
+
+/* default number of statements cached by each connection */
+#define LUASQL_SQLITE_CACHE_SIZE 16
+
+/* virtual machine instructions between two checks of a query deadline */
+#define LUASQL_SQLITE_PROGRESS_OPS 1000
+
+/* error message of calls which passed their deadline */
+#define LUASQL_SQLITE_TIMEOUT "deadline exceeded"
+
+/* default and maximum number of reader threads of a pool */
+#define LUASQL_SQLITE_POOL_READERS 4
+#define LUASQL_SQLITE_POOL_MAX_READERS 64
+
+/* rows handed over at once by the readers of pools and workers of shards */
+#define LUASQL_SQLITE_BATCH 256
+
+/* batches of rows a reader of a pool or a shard keeps ahead of the Lua state */
+#define LUASQL_SQLITE_POOL_BATCHES 4
+
+/* automatic checkpoint threshold assumed when it can't be read */
+#ifdef SQLITE_DEFAULT_WAL_AUTOCHECKPOINT
+#define LUASQL_SQLITE_AUTO_FRAMES SQLITE_DEFAULT_WAL_AUTOCHECKPOINT
+#else
+#define LUASQL_SQLITE_AUTO_FRAMES 1000
+#endif
+
+/* changes can be recorded as changesets by the session extension */
+#if defined(SQLITE_ENABLE_SESSION) && defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+#define LUASQL_SQLITE_SESSION 1
+#endif
+
+/* databases can be serialized to and from memory */
+#if defined(SQLITE_DESERIALIZE_READONLY) && !defined(SQLITE_OMIT_DESERIALIZE)
+#define LUASQL_SQLITE_SERIALIZE 1
+#endif
+
+/* arrays are bound as pointers, read back by the carray() table function */
+#if SQLITE_VERSION_NUMBER >= 3020000
+#define LUASQL_SQLITE_CARRAY 1
+#endif
 
 typedef struct
 {
@@ -28,27 +166,386 @@ typedef struct
 } env_data;
 
 
+/* a prepared vm kept for reuse by conn:execute, keyed by its SQL text */
+typedef struct cache_entry
+{
+  struct cache_entry *prev, *next; /* LRU list, most recently used first */
+  sqlite3_stmt *sql_vm;
+  size_t       len;                /* length of the SQL text */
+  char         sql[1];             /* SQL text, allocated with the entry */
+} cache_entry;
+
+
+/* a row changed by a transaction, as reported by the update hook */
+typedef struct
+{
+  int           op;                /* SQLITE_INSERT, SQLITE_UPDATE or SQLITE_DELETE */
+  int           db, table;         /* indices of the names in change_log */
+  sqlite3_int64 rowid;
+} change_entry;
+
+
+/* a savepoint started by conn:savepoint */
+typedef struct
+{
+  char          *name;
+  size_t        count;             /* entries buffered when it started */
+} change_mark;
+
+
+/* changes buffered until their transaction ends */
+typedef struct
+{
+  change_entry *entries;
+  size_t       count, size;
+  size_t       committed;          /* entries of committed transactions */
+  char         **names;            /* names of databases and tables */
+  int          nnames, maxnames;
+  change_mark  *marks;             /* open savepoints, innermost last */
+  int          nmarks, maxmarks;
+  int          last;               /* index of the last name found */
+  short        lost;               /* entries of the transaction were dropped */
+  short        lost_committed;     /* entries of committed ones were dropped */
+} change_log;
+
+
+/* thread running the checkpoints of a connection in the background */
+typedef struct
+{
+  luasql_thread thread;
+  sqlite3       *db;              /* its own connection to the database */
+  luasql_mutex  lock;             /* protects the fields below */
+  luasql_cond   wake;             /* signals a large WAL or the stop */
+  short         stopping;         /* the thread must exit */
+  short         pending;          /* the WAL reached 'frames' */
+  int           interval;         /* milliseconds between two checkpoints */
+  int           frames;           /* size of the WAL which wakes the thread */
+  int           wal_frames;       /* last size reported by the WAL hook */
+  int           auto_frames;      /* automatic checkpoints to restore */
+  lua_Number    checkpoints, failures;
+} checkpointer;
+
+
+/* counters of sqlite3_stmt_status, collected when a vm is given back */
+typedef struct
+{
+  int fullscan_steps, sorts, autoindexes, vm_steps, reprepares, runs, memory;
+} stmt_stats;
+
+
 typedef struct
 {
   short        closed;
   int          env;                /* reference to environment */
   short        auto_commit;        /* 0 for manual commit */
   unsigned int cur_counter;
+  unsigned int stmt_counter;
+  unsigned int blob_counter;
+  unsigned int backup_counter;
+  unsigned int session_counter;
   sqlite3      *sql_conn;
+  lua_State    *L;                 /* state of the running call, for callbacks */
+  int          image;              /* reference to a deserialized string */
+  void         *mapping;           /* deserialized file mapping, if any */
+  size_t       mapping_size;
+  sqlite3_stmt *txn_vm[3];         /* BEGIN, COMMIT and ROLLBACK, once used */
+  int          begin_mode;         /* index in begin_modes */
+  cache_entry  *cache_head;        /* statement cache, most recent first */
+  cache_entry  *cache_tail;
+  int          cache_count;        /* number of cached statements */
+  int          cache_size;         /* maximum number of cached statements */
+  unsigned long cache_hits, cache_misses;
+  int          query_timeout;      /* time limit of each call in ms, 0 for none */
+  sqlite3_int64 deadline;          /* deadline set by setdeadline, 0 for none */
+  sqlite3_int64 call_deadline;     /* deadline of the running call, 0 for none */
+  short        timed_out;          /* the running call passed its deadline */
+  short        stepping;           /* statements being stepped, see step_vm */
+  short        yield_due;          /* the coroutine should yield */
+  int          yield_ops;          /* VM instructions between yields, 0 for none */
+  int          yield_ms;           /* milliseconds between yields, 0 for none */
+  int          yield_run;          /* VM instructions run since the last yield */
+  sqlite3_int64 yield_last;        /* time of the last yield */
+  int          progress;           /* period of the progress handler, 0 for none */
+  stmt_stats   last_stats;         /* counters of the last vm given back */
+  int          onstats;            /* reference to the stats callback */
+  short        in_onstats;         /* the stats callback is running */
+  int          onchange;           /* reference to the change callback */
+  change_log   changes;            /* changes not yet delivered to it */
+  checkpointer *ckpt;              /* background checkpoints, if any */
 } conn_data;
 
 
+typedef struct
+{
+  short        closed;
+  short        busy;               /* a cursor is reading from sql_vm */
+  int          conn;               /* reference to connection */
+  conn_data    *conn_data;         /* reference to connection for statement */
+  sqlite3_stmt *sql_vm;
+} stmt_data;
+
+
 typedef struct
 {
   short       closed;
   int         conn;               /* reference to connection */
   int         numcols;            /* number of columns */
   int         colnames, coltypes; /* reference to column information tables */
+  int         stmtref;            /* reference to statement, if any */
+  int         pending;            /* result of a step not yet fetched, or 0 */
+  int         anchors;            /* reference to values bound to sql_vm */
   conn_data   *conn_data;         /* reference to connection for cursor */
+  stmt_data   *stmt;              /* statement owning sql_vm, NULL if owned */
+  cache_entry *entry;             /* cache entry owning sql_vm, NULL if owned */
   sqlite3_stmt  *sql_vm;
+  stmt_stats  stats;              /* counters of the query, once closed */
+  int         loops;              /* reference to its scan status, once closed */
 } cur_data;
 
 
+typedef struct
+{
+  short        closed;
+  int          conn;               /* reference to connection */
+  conn_data    *conn_data;         /* reference to connection for blob */
+  sqlite3_blob *blob;
+  int          offset;             /* position of the next read or write */
+  char         *buffer;            /* reusable buffer for reads */
+  int          buffer_size;
+} blob_data;
+
+
+typedef struct
+{
+  short          closed;
+  int            src, dest;       /* references to connections, if any */
+  conn_data      *src_data;       /* connections, NULL when opened by path */
+  conn_data      *dest_data;
+  sqlite3        *owned;          /* database opened by path, if any */
+  sqlite3_backup *backup;
+  int            pages;           /* default number of pages per step */
+} backup_data;
+
+
+#ifdef LUASQL_SQLITE_SESSION
+typedef struct
+{
+  short           closed;
+  int             conn;           /* reference to connection */
+  conn_data       *conn_data;
+  sqlite3_session *session;
+} session_data;
+#endif
+
+
+struct pool_cursor;
+
+/* a read-only connection of a pool, run by its own thread */
+typedef struct
+{
+  struct pool_data *pool;
+  conn_data     conn;             /* connection and its statement cache */
+  luasql_thread thread;
+  short         started;          /* the thread is running */
+  short         busy;             /* claimed by the Lua state or running */
+  struct pool_cursor *job;        /* query to run, NULL when none */
+  luasql_cond   wake;             /* signals a new job */
+} pool_reader;
+
+
+typedef struct pool_data
+{
+  short        closed;
+  short        stopping;          /* the readers must exit */
+  short        starved;           /* the Lua state waits for a free reader */
+  int          env;               /* reference to environment */
+  int          writer;            /* reference to the writer connection */
+  conn_data    *writer_data;
+  unsigned int cur_counter;
+  int          nreaders;
+  pool_reader  *readers;
+  luasql_mutex lock;              /* protects the readers and their cursors */
+  luasql_cond  done;              /* signals a finished query or new rows */
+} pool_data;
+
+
+#ifdef SQLITE_ENABLE_SNAPSHOT
+typedef struct
+{
+  short            closed;
+  int              pool;          /* reference to pool */
+  pool_data        *pool_data;
+  sqlite3_snapshot *snapshot;
+  unsigned int     running;       /* queries using it right now */
+} snapshot_data;
+#endif
+
+
+/* a value of a row read by a reader thread */
+typedef struct
+{
+  int          type;
+  int          len;               /* length of text and blobs */
+  union {
+    sqlite3_int64 i;
+    double        d;
+    size_t        offset;         /* of text and blobs in the text buffer */
+  } v;
+} pool_value;
+
+
+/* rows copied by a thread, read back by the Lua state */
+typedef struct row_batch
+{
+  pool_value   *values;           /* numcols values per row */
+  size_t       nvalues, maxvalues;
+  char         *text;             /* text and blobs of the values */
+  size_t       textlen, maxtext;
+  size_t       next;              /* first value of the next row to fetch */
+  struct row_batch *link;         /* next batch handed over */
+} row_batch;
+
+
+/* a query sent to a reader, and its rows as they are read */
+typedef struct pool_cursor
+{
+  short        closed;
+  short        done;              /* set by the reader thread */
+  short        cancelled;         /* the remaining rows are not wanted */
+  int          pool;              /* reference to pool */
+  int          anchors;           /* reference to values bound to sql_vm */
+  int          snapref;           /* reference to the snapshot, if any */
+  int          colnames, coltypes;
+  int          numcols;
+  pool_data    *pool_data;
+  pool_reader  *reader;           /* reader owning sql_vm */
+  cache_entry  *entry;
+  sqlite3_stmt *sql_vm;
+  void         *snapshot;         /* snapshot_data, if any */
+  int          rc;                /* result of the query */
+  char         *errmsg;
+  row_batch    *head, *tail;      /* batches handed over by the reader */
+  int          queued;            /* batches in that list */
+  row_batch    *reading;          /* batch read by the Lua state */
+} pool_cursor;
+
+
+struct shard_cursor;
+
+/* the query of a cursor on one shard, run by any of the workers */
+typedef struct shard_task
+{
+  struct shard_cursor *cur;
+  conn_data    *conn;             /* connection of the shard */
+  cache_entry  *entry;
+  sqlite3_stmt *sql_vm;
+  short        done;              /* set by the worker */
+  int          rc;                /* result of the query */
+  char         *errmsg;
+  lua_Number   changes;           /* rows changed by a statement without rows */
+  row_batch    *head, *tail;      /* batches handed over by the worker */
+  int          queued;            /* batches in that list */
+  row_batch    *reading;          /* batch read by the Lua state */
+  struct shard_task *link;        /* next task waiting for a worker */
+} shard_task;
+
+
+/* a set of database files queried together by a pool of worker threads */
+typedef struct
+{
+  short         closed;
+  short         stopping;         /* the workers must exit */
+  short         starved;          /* the Lua state waits for the workers */
+  int           env;              /* reference to environment */
+  int           nshards;
+  conn_data     *shards;          /* connections, shared by the workers */
+  int           nworkers;         /* workers started */
+  luasql_thread *workers;
+  unsigned int  cur_counter;
+  shard_task    *queue, *queue_tail; /* tasks waiting for a worker */
+  luasql_mutex  lock;             /* protects the queue and the tasks */
+  luasql_cond   work;             /* signals a new task */
+  luasql_cond   changed;          /* signals a new batch or a finished task */
+  luasql_cond   room;             /* signals a batch read or a starved Lua state */
+} shards_data;
+
+
+/* the rows of a query on all the shards, in arrival order or merged */
+typedef struct shard_cursor
+{
+  short        closed;
+  short        cancelled;         /* the remaining rows are not wanted */
+  int          shards;            /* reference to the shards */
+  int          anchors;           /* reference to values bound to the vms */
+  int          colnames, coltypes;
+  int          numcols;
+  shards_data  *shards_data;
+  int          ntasks;
+  shard_task   *tasks;            /* one per shard */
+  int          running;           /* tasks not done yet */
+  int          failed;            /* 1 + index of a failed task, or 0 */
+  int          last;              /* task of the last row, in arrival order */
+  int          nkeys;             /* merge keys, 0 in arrival order */
+  int          *keys;             /* 1 + column, negative if descending */
+  int          *heap;             /* tasks ordered by their next row */
+  int          nheap;             /* -1 until the merge starts */
+  short        advance;           /* the row of heap[0] was fetched */
+} shard_cursor;
+
+
+/* element types of an array */
+enum { ARRAY_INT32, ARRAY_INT64, ARRAY_DOUBLE, ARRAY_TEXT };
+
+typedef struct
+{
+  const char  *s;
+  int         len;
+} array_text;
+
+/* a list of values bound as one parameter; the values follow the header */
+typedef struct
+{
+  int         type;
+  int         count;
+  void        *values;
+} array_data;
+
+
+/*
+** Process-wide memory configuration, given to the first environment
+** created before SQLite is initialized, see configure_memory.
+*/
+static int mem_configured = 0;
+static lua_Alloc mem_allocf = NULL;
+static void *mem_ud = NULL;
+static luasql_mutex mem_lock;
+static int mem_lock_ready = 0;
+static int mem_closed = 0;
+static void *mem_pagecache = NULL;
+
+
+/*
+** Check that SQLite may be used here. The allocator of a Lua state is
+** not thread-safe, as the state calls it without any lock: SQLite is then
+** only used by that state, on its own thread, so neither other states
+** nor the threads of pools, shards and checkpointers may share it.
+** Return NULL or an error message.
+*/
+static const char *mem_check(lua_State *L, int threads)
+{
+  int owner;
+  if (mem_allocf == NULL)
+    return NULL;
+  if (threads)
+    return "threads are not available with the Lua allocator";
+  lua_pushlightuserdata(L, (void *)&mem_allocf);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+  owner = !lua_isnil(L, -1);
+  lua_pop(L, 1);
+  return owner ? NULL : "SQLite uses the allocator of another Lua state";
+}
+
+
 /*
 ** Check for valid environment.
 */
@@ -61,645 +558,7149 @@ static env_data *getenvironment(lua_State *L) {
 
 
 /*
-** Check for valid connection.
+** Progress handler of connections with a deadline or yielding:
+** interrupts the running statement once the deadline of the call has
+** passed and records when the running coroutine should yield.
 */
-static conn_data *getconnection(lua_State *L) {
-  conn_data *conn = (conn_data *)luaL_checkudata (L, 1, LUASQL_CONNECTION_SQLITE);
-  luaL_argcheck(L, conn != NULL, 1, LUASQL_PREFIX"connection expected");
-  luaL_argcheck(L, !conn->closed, 1, LUASQL_PREFIX"connection is closed");
-  return conn;
+static int progress_handler(void *data)
+{
+  conn_data *conn = (conn_data *)data;
+  sqlite3_int64 now;
+
+  conn->yield_run += conn->progress;
+  if (conn->yield_ops > 0 && conn->yield_run >= conn->yield_ops)
+    conn->yield_due = 1;
+  if (conn->call_deadline != 0 || conn->yield_ms > 0)
+    {
+      now = clock_ms();
+      if (conn->call_deadline != 0 && now >= conn->call_deadline)
+        {
+          conn->timed_out = 1;
+          return 1;
+        }
+      if (conn->yield_ms > 0 && now - conn->yield_last >= conn->yield_ms)
+        conn->yield_due = 1;
+    }
+  return 0;
 }
 
 
 /*
-** Check for valid cursor.
+** Compute the deadline of a new call on a connection, the earliest of its
+** query timeout and of the deadline set by the caller. A call made while
+** a statement runs, e.g. by a function called by SQL, is part of the
+** call running it and keeps its deadline.
+** The progress handler is only installed while there is a deadline or
+** yielding is on; it runs often enough for both.
 */
-static cur_data *getcursor(lua_State *L) {
-  cur_data *cur = (cur_data *)luaL_checkudata (L, 1, LUASQL_CURSOR_SQLITE);
-  luaL_argcheck(L, cur != NULL, 1, LUASQL_PREFIX"cursor expected");
-  luaL_argcheck(L, !cur->closed, 1, LUASQL_PREFIX"cursor is closed");
-  return cur;
+static void start_call(conn_data *conn)
+{
+  sqlite3_int64 deadline = conn->deadline;
+  int period = 0;
+
+  if (conn->stepping > 0)
+    return;
+  conn->timed_out = 0;
+  if (conn->query_timeout > 0)
+    {
+      sqlite3_int64 limit = clock_ms() + conn->query_timeout;
+      if (deadline == 0 || limit < deadline)
+        deadline = limit;
+    }
+  conn->call_deadline = deadline;
+  if (deadline != 0 || conn->yield_ms > 0)
+    period = LUASQL_SQLITE_PROGRESS_OPS;
+  if (conn->yield_ops > 0 && (period == 0 || conn->yield_ops < period))
+    period = conn->yield_ops;
+  if (period != conn->progress)
+    {
+      conn->progress = period;
+      if (period != 0)
+        sqlite3_progress_handler(conn->sql_conn, period, progress_handler, conn);
+      else
+        sqlite3_progress_handler(conn->sql_conn, 0, NULL, NULL);
+    }
 }
 
+
 /*
-** Closes the cursor and nullify all structure fields.
+** Check whether the deadline of the running call has already passed, so
+** that no statement is started.
 */
-static void cur_nullify(lua_State *L, cur_data *cur)
+static int call_expired(conn_data *conn)
 {
-  conn_data *conn;
+  if (conn->call_deadline != 0 && clock_ms() >= conn->call_deadline)
+    conn->timed_out = 1;
+  return conn->timed_out;
+}
 
-  /* Nullify structure fields. */
-  cur->closed = 1;
-  cur->sql_vm = NULL;
-  /* Decrement cursor counter on connection object */
-  lua_rawgeti (L, LUA_REGISTRYINDEX, cur->conn);
-  conn = lua_touserdata (L, -1);
-  conn->cur_counter--;
 
-  luaL_unref(L, LUA_REGISTRYINDEX, cur->conn);
-  luaL_unref(L, LUA_REGISTRYINDEX, cur->colnames);
-  luaL_unref(L, LUA_REGISTRYINDEX, cur->coltypes);
+/*
+** Error message of the last failure of a connection.
+*/
+static const char *conn_errmsg(conn_data *conn)
+{
+  if (conn->timed_out)
+    return LUASQL_SQLITE_TIMEOUT;
+  return sqlite3_errmsg(conn->sql_conn);
 }
 
 
+#if LUA_VERSION_NUM >= 503
 /*
-** Finalizes the vm
-** Return nil + errmsg or nil in case of success
+** Continuation of a call which yielded: drops the values given to resume
+** and returns the results kept below them.
 */
-static int finalize(lua_State *L, cur_data *cur) {
-  const char *errmsg;
-  if (sqlite3_finalize(cur->sql_vm) != SQLITE_OK)
+static int results_k(lua_State *L, int status, lua_KContext ctx)
+{
+  int nresults = (int)lua_tointeger(L, (int)ctx);
+  (void)status;
+  lua_settop(L, (int)ctx - 1);
+  return nresults;
+}
+#endif
+
+
+/*
+** Find or add a name of a database or table in a change log.
+** Return its index, or -1 when out of memory.
+*/
+static int change_name(change_log *log, const char *name)
+{
+  int i;
+  char *copy;
+  if (log->last < log->nnames && strcmp(log->names[log->last], name) == 0)
+    return log->last;
+  for (i = 0; i < log->nnames; i++)
+    if (strcmp(log->names[i], name) == 0)
+      return log->last = i;
+  if (log->nnames == log->maxnames)
     {
-      errmsg = sqlite3_errmsg(cur->conn_data->sql_conn);
-      cur_nullify(L, cur);
-      return luasql_faildirect(L, errmsg);
+      int size = log->maxnames ? 2 * log->maxnames : 8;
+      char **names = (char **)realloc(log->names, size * sizeof(char *));
+      if (names == NULL)
+        return -1;
+      log->names = names;
+      log->maxnames = size;
     }
-  cur_nullify(L, cur);
-  lua_pushnil(L);
-  return 1;
+  copy = (char *)malloc(strlen(name) + 1);
+  if (copy == NULL)
+    return -1;
+  strcpy(copy, name);
+  log->names[log->nnames] = copy;
+  return log->last = log->nnames++;
 }
 
 
-static void push_column(lua_State *L, sqlite3_stmt *vm, int column) {
-  switch (sqlite3_column_type(vm, column)) {
-  case SQLITE_INTEGER:
-#if LUA_VERSION_NUM >= 503
-    lua_pushinteger(L, sqlite3_column_int64(vm, column));
-#else
-    // Preserves precision of integers up to 2^53.
-    lua_pushnumber(L, sqlite3_column_int64(vm, column));
-#endif
-    break;
-  case SQLITE_FLOAT:
-    lua_pushnumber(L, sqlite3_column_double(vm, column));
-    break;
-  case SQLITE_TEXT:
-    lua_pushlstring(L, (const char *)sqlite3_column_text(vm, column),
-		    (size_t)sqlite3_column_bytes(vm, column));
-    break;
-  case SQLITE_BLOB:
-    lua_pushlstring(L, sqlite3_column_blob(vm, column),
-		    (size_t)sqlite3_column_bytes(vm, column));
-    break;
-  case SQLITE_NULL:
-    lua_pushnil(L);
-    break;
-  default:
-    luaL_error(L, LUASQL_PREFIX"Unrecognized column type");
-    break;
-  }
+/*
+** Update hook: buffer a changed row until its transaction ends.
+*/
+static void change_hook(void *data, int op, const char *db, const char *table,
+                        sqlite3_int64 rowid)
+{
+  change_log *log = &((conn_data *)data)->changes;
+  change_entry *e;
+  if (log->count == log->size)
+    {
+      size_t size = log->size ? 2 * log->size : 64;
+      change_entry *entries = (change_entry *)realloc(log->entries,
+                                                      size * sizeof(change_entry));
+      if (entries == NULL)
+        {
+          log->lost = 1;
+          return;
+        }
+      log->entries = entries;
+      log->size = size;
+    }
+  e = &log->entries[log->count];
+  e->op = op;
+  e->db = change_name(log, db);
+  e->table = change_name(log, table);
+  e->rowid = rowid;
+  if (e->db < 0 || e->table < 0)
+    log->lost = 1;
+  else
+    log->count++;
 }
 
 
 /*
-** Get another row of the given cursor.
+** Forget the savepoints from index 'from' on.
 */
-static int cur_fetch (lua_State *L) {
-  cur_data *cur = getcursor(L);
-  sqlite3_stmt *vm = cur->sql_vm;
-  int res;
+static void change_unmark(change_log *log, int from)
+{
+  while (log->nmarks > from)
+    free(log->marks[--log->nmarks].name);
+}
 
-  if (vm == NULL)
-    return 0;
 
-  res = sqlite3_step(vm);
+/*
+** Commit hook: the buffered changes are delivered once the call ends.
+*/
+static int commit_hook(void *data)
+{
+  change_log *log = &((conn_data *)data)->changes;
+  change_unmark(log, 0);
+  log->committed = log->count;
+  if (log->lost)
+    log->lost_committed = 1;
+  log->lost = 0;
+  return 0;
+}
 
-  /* no more results? */
-  if (res == SQLITE_DONE)
-    return finalize(L, cur);
 
-  if (res != SQLITE_ROW)
-    return finalize(L, cur);
+/*
+** Rollback hook: drop the changes of the transaction.
+*/
+static void rollback_hook(void *data)
+{
+  change_log *log = &((conn_data *)data)->changes;
+  change_unmark(log, 0);
+  log->count = log->committed;
+  log->lost = 0;
+}
 
-  if (lua_istable (L, 2))
-    {
-      int i;
-      const char *opts = luaL_optstring(L, 3, "n");
 
-      if (strchr(opts, 'n') != NULL)
-        {
+/*
+** Follow a savepoint statement which succeeded: SAVEPOINT records how
+** many changes are buffered, RELEASE forgets the savepoint and the ones
+** nested in it, ROLLBACK TO drops the changes made since the savepoint,
+** as the rollback hook is not called for it. Savepoints started by
+** other means are not known, and rolling back to them keeps the changes.
+*/
+static void change_savepoint(change_log *log, int which, const char *name,
+                             size_t start)
+{
+  int i;
+  if (which == LUASQL_SAVEPOINT_START)
+    {
+      change_mark *m;
+      if (log->nmarks == log->maxmarks)
+        {
+          int size = log->maxmarks ? 2 * log->maxmarks : 8;
+          change_mark *marks = (change_mark *)realloc(log->marks,
+                                                      size * sizeof(change_mark));
+          if (marks == NULL)
+            {
+              log->lost = 1;
+              return;
+            }
+          log->marks = marks;
+          log->maxmarks = size;
+        }
+      m = &log->marks[log->nmarks];
+      m->name = (char *)malloc(strlen(name) + 1);
+      if (m->name == NULL)
+        {
+          log->lost = 1;
+          return;
+        }
+      strcpy(m->name, name);
+      m->count = start;
+      log->nmarks++;
+      return;
+    }
+  for (i = log->nmarks - 1; i >= 0; i--)
+    if (sqlite3_stricmp(log->marks[i].name, name) == 0)
+      break;
+  if (i < 0)
+    return;
+  if (which == LUASQL_SAVEPOINT_RELEASE)
+    change_unmark(log, i);
+  else
+    {
+      if (log->count > log->marks[i].count)
+        log->count = log->marks[i].count;
+      change_unmark(log, i + 1);
+    }
+}
+
+
+/*
+** Free the buffers of a change log.
+*/
+static void change_free(change_log *log)
+{
+  int i;
+  change_unmark(log, 0);
+  free(log->marks);
+  for (i = 0; i < log->nnames; i++)
+    free(log->names[i]);
+  free(log->names);
+  free(log->entries);
+  memset(log, 0, sizeof(change_log));
+}
+
+
+/*
+** Pass the changes of committed transactions to the change callback as
+** one list of {op, db, table, rowid} tables.
+*/
+static void deliver_changes(lua_State *L, conn_data *conn)
+{
+  change_log *log = &conn->changes;
+  size_t i, n = log->committed;
+  if (n == 0 && !log->lost_committed)
+    return;
+  if (conn->onchange == LUA_NOREF)
+    return;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, conn->onchange);
+  lua_createtable(L, (int)n, 1);
+  for (i = 0; i < n; i++)
+    {
+      change_entry *e = &log->entries[i];
+      lua_createtable(L, 0, 4);
+      lua_pushstring(L, e->op == SQLITE_INSERT ? "insert" :
+                        e->op == SQLITE_DELETE ? "delete" : "update");
+      lua_setfield(L, -2, "op");
+      lua_pushstring(L, log->names[e->db]);
+      lua_setfield(L, -2, "db");
+      lua_pushstring(L, log->names[e->table]);
+      lua_setfield(L, -2, "table");
+      lua_pushinteger(L, (lua_Integer)e->rowid);
+      lua_setfield(L, -2, "rowid");
+      lua_rawseti(L, -2, (int)i + 1);
+    }
+  if (log->lost_committed)
+    {
+      lua_pushboolean(L, 1);
+      lua_setfield(L, -2, "lost");
+    }
+  /* the callback may start new transactions */
+  memmove(log->entries, log->entries + n, (log->count - n) * sizeof(change_entry));
+  log->count -= n;
+  for (i = 0; i < (size_t)log->nmarks; i++)
+    log->marks[i].count = log->marks[i].count > n ? log->marks[i].count - n : 0;
+  log->committed = 0;
+  log->lost_committed = 0;
+  /* the changes are committed: the callback can not fail the call anymore */
+  if (lua_pcall(L, 1, 0, 0) != 0)
+    lua_pop(L, 1);
+}
+
+
+/*
+** Finish a call on a connection returning the results on top of the
+** stack: deliver the changes it committed and, if the progress handler
+** found that the running coroutine used its share of work, yield first.
+** Yields carry no values; the main thread never yields.
+*/
+static int finish_call(lua_State *L, conn_data *conn, int nresults)
+{
+  deliver_changes(L, conn);
+  if (!conn->yield_due)
+    return nresults;
+  conn->yield_due = 0;
+  conn->yield_run = 0;
+  if (conn->yield_ms > 0)
+    conn->yield_last = clock_ms();
+#if LUA_VERSION_NUM >= 503
+  if (lua_isyieldable(L))
+    {
+      lua_pushinteger(L, nresults);
+      return lua_yieldk(L, 0, (lua_KContext)lua_gettop(L), results_k);
+    }
+#endif
+  return nresults;
+}
+
+
+/*
+** Check for valid connection.
+*/
+static conn_data *getconnection(lua_State *L) {
+  conn_data *conn = (conn_data *)luaL_checkudata (L, 1, LUASQL_CONNECTION_SQLITE);
+  luaL_argcheck(L, conn != NULL, 1, LUASQL_PREFIX"connection expected");
+  luaL_argcheck(L, !conn->closed, 1, LUASQL_PREFIX"connection is closed");
+  conn->L = L;
+  start_call(conn);
+  return conn;
+}
+
+
+/*
+** Check for valid statement.
+*/
+static stmt_data *getstatement(lua_State *L) {
+  stmt_data *stmt = (stmt_data *)luaL_checkudata (L, 1, LUASQL_STATEMENT_SQLITE);
+  luaL_argcheck(L, stmt != NULL, 1, LUASQL_PREFIX"statement expected");
+  luaL_argcheck(L, !stmt->closed, 1, LUASQL_PREFIX"statement is closed");
+  stmt->conn_data->L = L;
+  start_call(stmt->conn_data);
+  return stmt;
+}
+
+
+/*
+** Check for valid blob.
+*/
+static blob_data *getblob(lua_State *L) {
+  blob_data *blob = (blob_data *)luaL_checkudata (L, 1, LUASQL_BLOB_SQLITE);
+  luaL_argcheck(L, blob != NULL, 1, LUASQL_PREFIX"blob expected");
+  luaL_argcheck(L, !blob->closed, 1, LUASQL_PREFIX"blob is closed");
+  return blob;
+}
+
+
+/*
+** Check for valid backup.
+*/
+static backup_data *getbackup(lua_State *L) {
+  backup_data *bk = (backup_data *)luaL_checkudata (L, 1, LUASQL_BACKUP_SQLITE);
+  luaL_argcheck(L, bk != NULL, 1, LUASQL_PREFIX"backup expected");
+  luaL_argcheck(L, !bk->closed, 1, LUASQL_PREFIX"backup is closed");
+  return bk;
+}
+
+
+/*
+** Check for valid cursor.
+*/
+static cur_data *getcursor(lua_State *L) {
+  cur_data *cur = (cur_data *)luaL_checkudata (L, 1, LUASQL_CURSOR_SQLITE);
+  luaL_argcheck(L, cur != NULL, 1, LUASQL_PREFIX"cursor expected");
+  luaL_argcheck(L, !cur->closed, 1, LUASQL_PREFIX"cursor is closed");
+  cur->conn_data->L = L;
+  start_call(cur->conn_data);
+  return cur;
+}
+
+/*
+** Compile an SQL statement.
+** Statements expected to be reused are flagged as persistent.
+*/
+static int prepare_vm(conn_data *conn, const char *sql, int persistent,
+		      sqlite3_stmt **vm)
+{
+  const char *tail;
+#if SQLITE_VERSION_NUMBER >= 3020000
+  return sqlite3_prepare_v3(conn->sql_conn, sql, -1,
+			    persistent ? SQLITE_PREPARE_PERSISTENT : 0, vm, &tail);
+#elif SQLITE_VERSION_NUMBER > 3006013
+  (void)persistent;
+  return sqlite3_prepare_v2(conn->sql_conn, sql, -1, vm, &tail);
+#else
+  (void)persistent;
+  return sqlite3_prepare(conn->sql_conn, sql, -1, vm, &tail);
+#endif
+}
+
+
+/*
+** Unlink an entry from the statement cache of a connection.
+*/
+static void cache_unlink(conn_data *conn, cache_entry *entry)
+{
+  if (entry->prev != NULL)
+    entry->prev->next = entry->next;
+  else
+    conn->cache_head = entry->next;
+  if (entry->next != NULL)
+    entry->next->prev = entry->prev;
+  else
+    conn->cache_tail = entry->prev;
+  entry->prev = entry->next = NULL;
+  conn->cache_count--;
+}
+
+
+/*
+** Finalize the vm of a cache entry and free it.
+*/
+static void cache_free(cache_entry *entry)
+{
+  sqlite3_finalize(entry->sql_vm);
+  free(entry);
+}
+
+
+/*
+** Drop the least recently used statements until at most 'size' are left.
+*/
+static void cache_trim(conn_data *conn, int size)
+{
+  while (conn->cache_count > size)
+    {
+      cache_entry *entry = conn->cache_tail;
+      cache_unlink(conn, entry);
+      cache_free(entry);
+    }
+}
+
+
+/*
+** Take the cached vm of an SQL statement out of the cache.
+** The entry belongs to the caller until it is handed back by cache_put.
+** Return NULL if the statement is not cached.
+*/
+static cache_entry *cache_take(conn_data *conn, const char *sql, size_t len)
+{
+  cache_entry *entry;
+  for (entry = conn->cache_head; entry != NULL; entry = entry->next)
+    {
+      if (entry->len == len && memcmp(entry->sql, sql, len) == 0)
+        {
+          cache_unlink(conn, entry);
+          conn->cache_hits++;
+          return entry;
+        }
+    }
+  conn->cache_misses++;
+  return NULL;
+}
+
+
+/*
+** Create an entry for a freshly prepared vm, if the cache is enabled.
+*/
+static cache_entry *cache_new(conn_data *conn, const char *sql, size_t len,
+			      sqlite3_stmt *vm)
+{
+  cache_entry *entry;
+  if (conn->cache_size <= 0)
+    return NULL;
+  entry = (cache_entry *)malloc(sizeof(cache_entry) + len);
+  if (entry == NULL)
+    return NULL;
+  entry->prev = entry->next = NULL;
+  entry->sql_vm = vm;
+  entry->len = len;
+  memcpy(entry->sql, sql, len);
+  entry->sql[len] = '\0';
+  return entry;
+}
+
+
+/*
+** Hand a reset vm back to the cache as its most recently used entry.
+*/
+static void cache_put(conn_data *conn, cache_entry *entry)
+{
+  cache_entry *old;
+
+  if (conn->cache_size <= 0)
+    {
+      cache_free(entry);
+      return;
+    }
+  /* two cursors may have run the same SQL text: keep only one vm */
+  for (old = conn->cache_head; old != NULL; old = old->next)
+    {
+      if (old->len == entry->len && memcmp(old->sql, entry->sql, entry->len) == 0)
+        {
+          cache_unlink(conn, old);
+          cache_free(old);
+          break;
+        }
+    }
+  entry->next = conn->cache_head;
+  if (conn->cache_head != NULL)
+    conn->cache_head->prev = entry;
+  else
+    conn->cache_tail = entry;
+  conn->cache_head = entry;
+  conn->cache_count++;
+  cache_trim(conn, conn->cache_size);
+}
+
+
+/*
+** Get a vm for an SQL statement, reusing a cached one when possible.
+** Return SQLITE_OK or the error code of the compilation.
+*/
+static int acquire_vm(conn_data *conn, const char *sql, size_t len,
+		      sqlite3_stmt **vm, cache_entry **entry)
+{
+  int res;
+  *entry = cache_take(conn, sql, len);
+  if (*entry != NULL)
+    {
+      *vm = (*entry)->sql_vm;
+      return SQLITE_OK;
+    }
+  res = prepare_vm(conn, sql, conn->cache_size > 0, vm);
+  if (res == SQLITE_OK)
+    *entry = cache_new(conn, sql, len, *vm);
+  return res;
+}
+
+
+/*
+** Read the counters of a vm, optionally resetting them.
+*/
+static void read_stats(sqlite3_stmt *vm, stmt_stats *stats, int reset)
+{
+  memset(stats, 0, sizeof(stmt_stats));
+  stats->fullscan_steps = sqlite3_stmt_status(vm, SQLITE_STMTSTATUS_FULLSCAN_STEP, reset);
+  stats->sorts = sqlite3_stmt_status(vm, SQLITE_STMTSTATUS_SORT, reset);
+#ifdef SQLITE_STMTSTATUS_AUTOINDEX
+  stats->autoindexes = sqlite3_stmt_status(vm, SQLITE_STMTSTATUS_AUTOINDEX, reset);
+#endif
+#ifdef SQLITE_STMTSTATUS_VM_STEP
+  stats->vm_steps = sqlite3_stmt_status(vm, SQLITE_STMTSTATUS_VM_STEP, reset);
+#endif
+#ifdef SQLITE_STMTSTATUS_REPREPARE
+  stats->reprepares = sqlite3_stmt_status(vm, SQLITE_STMTSTATUS_REPREPARE, reset);
+  stats->runs = sqlite3_stmt_status(vm, SQLITE_STMTSTATUS_RUN, reset);
+  stats->memory = sqlite3_stmt_status(vm, SQLITE_STMTSTATUS_MEMUSED, 0);
+#endif
+}
+
+
+/*
+** Push a table with the counters of a vm.
+*/
+static void push_stats(lua_State *L, const stmt_stats *stats)
+{
+  lua_newtable(L);
+  lua_pushinteger(L, stats->fullscan_steps);
+  lua_setfield(L, -2, "fullscan_steps");
+  lua_pushinteger(L, stats->sorts);
+  lua_setfield(L, -2, "sorts");
+  lua_pushinteger(L, stats->autoindexes);
+  lua_setfield(L, -2, "autoindexes");
+  lua_pushinteger(L, stats->vm_steps);
+  lua_setfield(L, -2, "vm_steps");
+  lua_pushinteger(L, stats->reprepares);
+  lua_setfield(L, -2, "reprepares");
+  lua_pushinteger(L, stats->runs);
+  lua_setfield(L, -2, "runs");
+  lua_pushinteger(L, stats->memory);
+  lua_setfield(L, -2, "memory");
+}
+
+
+#ifdef SQLITE_ENABLE_STMT_SCANSTATUS
+/*
+** Push a list with the status of each loop of a vm: its description
+** in EXPLAIN QUERY PLAN, its table or index, the number of times it ran
+** and of rows it visited, and the rows estimated by the planner.
+*/
+static void push_loops(lua_State *L, sqlite3_stmt *vm)
+{
+  int i;
+  lua_newtable(L);
+  for (i = 0; ; i++)
+    {
+      sqlite3_int64 nloop, nvisit;
+      double est;
+      const char *name, *explain;
+      int selectid;
+      if (sqlite3_stmt_scanstatus(vm, i, SQLITE_SCANSTAT_NLOOP, &nloop) != 0)
+        break;
+      sqlite3_stmt_scanstatus(vm, i, SQLITE_SCANSTAT_NVISIT, &nvisit);
+      sqlite3_stmt_scanstatus(vm, i, SQLITE_SCANSTAT_EST, &est);
+      sqlite3_stmt_scanstatus(vm, i, SQLITE_SCANSTAT_NAME, &name);
+      sqlite3_stmt_scanstatus(vm, i, SQLITE_SCANSTAT_EXPLAIN, &explain);
+      sqlite3_stmt_scanstatus(vm, i, SQLITE_SCANSTAT_SELECTID, &selectid);
+      lua_newtable(L);
+      lua_pushstring(L, name);
+      lua_setfield(L, -2, "name");
+      lua_pushstring(L, explain);
+      lua_setfield(L, -2, "explain");
+      lua_pushinteger(L, (lua_Integer)nloop);
+      lua_setfield(L, -2, "loops");
+      lua_pushinteger(L, (lua_Integer)nvisit);
+      lua_setfield(L, -2, "visits");
+      lua_pushnumber(L, est);
+      lua_setfield(L, -2, "estimate");
+      lua_pushinteger(L, selectid);
+      lua_setfield(L, -2, "selectid");
+      lua_rawseti(L, -2, i + 1);
+    }
+}
+#endif
+
+
+/*
+** Collect the counters of a vm whose run is over, resetting them for the
+** next run, and pass them to the stats callback of the connection.
+** Errors of the callback are ignored: it runs while the vm is given back.
+*/
+static void collect_stats(conn_data *conn, sqlite3_stmt *vm)
+{
+  lua_State *L = conn->L;
+
+  read_stats(vm, &conn->last_stats, 1);
+  if (conn->onstats != LUA_NOREF && !conn->in_onstats)
+    {
+      conn->in_onstats = 1;
+      lua_rawgeti(L, LUA_REGISTRYINDEX, conn->onstats);
+      push_stats(L, &conn->last_stats);
+      lua_pushstring(L, sqlite3_sql(vm));
+      lua_setfield(L, -2, "sql");
+#ifdef SQLITE_ENABLE_STMT_SCANSTATUS
+      push_loops(L, vm);
+      lua_setfield(L, -2, "scans");
+#endif
+      if (lua_pcall(L, 1, 0, 0) != 0)
+        lua_pop(L, 1);
+      conn->in_onstats = 0;
+    }
+#ifdef SQLITE_ENABLE_STMT_SCANSTATUS
+  sqlite3_stmt_scanstatus_reset(vm);
+#endif
+}
+
+
+/*
+** Give back a vm after use.
+** A vm borrowed from a statement object is reset and handed back to it,
+** a cached vm is reset and returned to the connection cache and any other
+** vm is finalized.
+*/
+static int release_vm(conn_data *conn, sqlite3_stmt *vm, stmt_data *stmt,
+		      cache_entry *entry)
+{
+  int res;
+  collect_stats(conn, vm);
+  if (stmt == NULL && entry == NULL)
+    return sqlite3_finalize(vm);
+  res = sqlite3_reset(vm);
+  sqlite3_clear_bindings(vm);
+  if (stmt != NULL)
+    stmt->busy = 0;
+  else
+    cache_put(conn, entry);
+  return res;
+}
+
+
+/* modes of the BEGIN statements of connections */
+static const char *const begin_modes[] = {"DEFERRED", "IMMEDIATE", "EXCLUSIVE", NULL};
+
+
+/*
+** Run one of the transaction control statements of a connection,
+** preparing it on first use.
+** Return SQLITE_OK or the error code, with the message left in the
+** connection.
+*/
+static int run_txn(conn_data *conn, int which)
+{
+  sqlite3_stmt **vm = &conn->txn_vm[which];
+  int res;
+
+  if (*vm == NULL)
+    {
+      char sql[32];
+      if (which == LUASQL_TXN_BEGIN)
+        sprintf(sql, "BEGIN %s", begin_modes[conn->begin_mode]);
+      else
+        strcpy(sql, which == LUASQL_TXN_COMMIT ? "COMMIT" : "ROLLBACK");
+      res = prepare_vm(conn, sql, 1, vm);
+      if (res != SQLITE_OK)
+        return res;
+    }
+  res = sqlite3_step(*vm);
+  sqlite3_reset(*vm);
+  return res == SQLITE_DONE ? SQLITE_OK : res;
+}
+
+
+/*
+** Step a vm of the connection. A statement failing inside a transaction
+** is undone alone, without calling the rollback hook, so the changes it
+** buffered are dropped here.
+*/
+static int step_vm(conn_data *conn, sqlite3_stmt *vm)
+{
+  size_t start = conn->changes.count;
+  int res;
+  conn->stepping++;
+  res = sqlite3_step(vm);
+  conn->stepping--;
+  if (res != SQLITE_ROW && res != SQLITE_DONE && conn->changes.count > start)
+    conn->changes.count = start;
+  return res;
+}
+
+
+/*
+** Finalize the transaction control statements of a connection.
+*/
+static void txn_free(conn_data *conn)
+{
+  int i;
+  for (i = 0; i < 3; i++)
+    {
+      sqlite3_finalize(conn->txn_vm[i]);
+      conn->txn_vm[i] = NULL;
+    }
+}
+
+
+/*
+** Closes the cursor and nullify all structure fields.
+*/
+static void cur_nullify(lua_State *L, cur_data *cur)
+{
+  conn_data *conn;
+
+  /* Nullify structure fields. */
+  cur->closed = 1;
+  cur->sql_vm = NULL;
+  /* Decrement cursor counter on connection object */
+  lua_rawgeti (L, LUA_REGISTRYINDEX, cur->conn);
+  conn = lua_touserdata (L, -1);
+  conn->cur_counter--;
+
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->conn);
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->colnames);
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->coltypes);
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->stmtref);
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->anchors);
+}
+
+
+/*
+** Releases the vm of a cursor.
+*/
+static int cur_release(cur_data *cur) {
+  int res;
+#ifdef SQLITE_ENABLE_STMT_SCANSTATUS
+  lua_State *L = cur->conn_data->L;
+  push_loops(L, cur->sql_vm);
+  cur->loops = luaL_ref(L, LUA_REGISTRYINDEX);
+#endif
+  res = release_vm(cur->conn_data, cur->sql_vm, cur->stmt, cur->entry);
+  cur->stats = cur->conn_data->last_stats;
+  return res;
+}
+
+
+/*
+** Finalizes the vm
+** Return nil + errmsg or nil in case of success
+*/
+static int finalize(lua_State *L, cur_data *cur) {
+  const char *errmsg;
+  if (cur_release(cur) != SQLITE_OK || cur->conn_data->timed_out)
+    {
+      errmsg = conn_errmsg(cur->conn_data);
+      cur_nullify(L, cur);
+      return luasql_faildirect(L, errmsg);
+    }
+  cur_nullify(L, cur);
+  lua_pushnil(L);
+  return 1;
+}
+
+
+static void push_column(lua_State *L, sqlite3_stmt *vm, int column) {
+  switch (sqlite3_column_type(vm, column)) {
+  case SQLITE_INTEGER:
+#if LUA_VERSION_NUM >= 503
+    lua_pushinteger(L, sqlite3_column_int64(vm, column));
+#else
+    // Preserves precision of integers up to 2^53.
+    lua_pushnumber(L, sqlite3_column_int64(vm, column));
+#endif
+    break;
+  case SQLITE_FLOAT:
+    lua_pushnumber(L, sqlite3_column_double(vm, column));
+    break;
+  case SQLITE_TEXT:
+    lua_pushlstring(L, (const char *)sqlite3_column_text(vm, column),
+		    (size_t)sqlite3_column_bytes(vm, column));
+    break;
+  case SQLITE_BLOB:
+    lua_pushlstring(L, sqlite3_column_blob(vm, column),
+		    (size_t)sqlite3_column_bytes(vm, column));
+    break;
+  case SQLITE_NULL:
+    lua_pushnil(L);
+    break;
+  default:
+    luaL_error(L, LUASQL_PREFIX"Unrecognized column type");
+    break;
+  }
+}
+
+
+/*
+** Push an SQL value (e.g. an argument of a function) with the same type
+** mapping as push_column.
+*/
+static void push_value(lua_State *L, sqlite3_value *value) {
+  switch (sqlite3_value_type(value)) {
+  case SQLITE_INTEGER:
+#if LUA_VERSION_NUM >= 503
+    lua_pushinteger(L, sqlite3_value_int64(value));
+#else
+    lua_pushnumber(L, sqlite3_value_int64(value));
+#endif
+    break;
+  case SQLITE_FLOAT:
+    lua_pushnumber(L, sqlite3_value_double(value));
+    break;
+  case SQLITE_TEXT:
+    lua_pushlstring(L, (const char *)sqlite3_value_text(value),
+		    (size_t)sqlite3_value_bytes(value));
+    break;
+  case SQLITE_BLOB:
+    lua_pushlstring(L, sqlite3_value_blob(value),
+		    (size_t)sqlite3_value_bytes(value));
+    break;
+  default:
+    lua_pushnil(L);
+    break;
+  }
+}
+
+
+/*
+** Get another row of the given cursor.
+*/
+static int cur_fetch (lua_State *L) {
+  cur_data *cur = getcursor(L);
+  sqlite3_stmt *vm = cur->sql_vm;
+  int res;
+
+  if (vm == NULL)
+    return 0;
+
+  /* the cursor is closed when its deadline passed */
+  if (call_expired(cur->conn_data))
+    return finalize(L, cur);
+
+  /* the first step was already taken by execute */
+  if (cur->pending != 0)
+    {
+      res = cur->pending;
+      cur->pending = 0;
+    }
+  else
+    res = step_vm(cur->conn_data, vm);
+
+  /* no more results? */
+  if (res != SQLITE_ROW)
+    {
+      /* the statement may have committed: keep the connection for the callback */
+      conn_data *conn = cur->conn_data;
+      lua_rawgeti(L, LUA_REGISTRYINDEX, cur->conn);
+      res = finalize(L, cur);
+      deliver_changes(L, conn);
+      return res;
+    }
+
+  if (lua_istable (L, 2))
+    {
+      int i;
+      const char *opts = luaL_optstring(L, 3, "n");
+
+      if (strchr(opts, 'n') != NULL)
+        {
         /* Copy values to numerical indices */
           for (i = 0; i < cur->numcols;)
             {
-              push_column(L, vm, i);
+              push_column(L, vm, i);
+              lua_rawseti(L, 2, ++i);
+            }
+        }
+      if (strchr(opts, 'a') != NULL)
+        {
+          /* Copy values to alphanumerical indices */
+          lua_rawgeti(L, LUA_REGISTRYINDEX, cur->colnames);
+
+          for (i = 0; i < cur->numcols; i++)
+            {
+              lua_rawgeti(L, -1, i+1);
+              push_column(L, vm, i);
+              lua_rawset (L, 2);
+            }
+        }
+      lua_pushvalue(L, 2);
+      return finish_call(L, cur->conn_data, 1); /* return table */
+    }
+  else
+    {
+      int i;
+      luaL_checkstack (L, cur->numcols, LUASQL_PREFIX"too many columns");
+      for (i = 0; i < cur->numcols; ++i)
+        push_column(L, vm, i);
+      /* return #numcols values */
+      return finish_call(L, cur->conn_data, cur->numcols);
+    }
+}
+
+
+/*
+** Cursor object collector function
+*/
+static int cur_gc(lua_State *L)
+{
+  cur_data *cur = (cur_data *)luaL_checkudata(L, 1, LUASQL_CURSOR_SQLITE);
+  if (cur != NULL && !(cur->closed))
+    {
+      cur->conn_data->L = L;
+      cur_release(cur);
+      cur_nullify(L, cur);
+    }
+#ifdef SQLITE_ENABLE_STMT_SCANSTATUS
+  if (cur != NULL)
+    {
+      luaL_unref(L, LUA_REGISTRYINDEX, cur->loops);
+      cur->loops = LUA_NOREF;
+    }
+#endif
+  return 0;
+}
+
+
+/*
+** Close the cursor on top of the stack.
+** Return 1
+*/
+static int cur_close(lua_State *L)
+{
+  cur_data *cur = (cur_data *)luaL_checkudata(L, 1, LUASQL_CURSOR_SQLITE);
+  luaL_argcheck(L, cur != NULL, 1, LUASQL_PREFIX"cursor expected");
+  if (cur->closed) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  cur->conn_data->L = L;
+  cur_release(cur);
+  cur_nullify(L, cur);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Return the counters of the query of a cursor: live while it is open,
+** as they were when it was closed afterwards.
+*/
+static int cur_stats(lua_State *L)
+{
+  cur_data *cur = (cur_data *)luaL_checkudata(L, 1, LUASQL_CURSOR_SQLITE);
+  stmt_stats live;
+  if (cur->closed)
+    push_stats(L, &cur->stats);
+  else
+    {
+      read_stats(cur->sql_vm, &live, 0);
+      push_stats(L, &live);
+    }
+#ifdef SQLITE_ENABLE_STMT_SCANSTATUS
+  if (cur->closed)
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cur->loops);
+  else
+    push_loops(L, cur->sql_vm);
+  lua_setfield(L, -2, "scans");
+#endif
+  return 1;
+}
+
+
+/*
+** Return the list of field names.
+*/
+static int cur_getcolnames(lua_State *L)
+{
+  cur_data *cur = getcursor(L);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, cur->colnames);
+  return 1;
+}
+
+
+/*
+** Return the list of field types.
+*/
+static int cur_getcoltypes(lua_State *L)
+{
+  cur_data *cur = getcursor(L);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, cur->coltypes);
+  return 1;
+}
+
+
+/*
+** Create a new Cursor object and push it on top of the stack.
+*/
+/* static int create_cursor(lua_State *L, int conn, sqlite3_stmt *sql_vm,
+   int numcols, const char **row, const char **col_info)*/
+/*
+** Create a table with the column names or types of a vm.
+** Return a reference to the table.
+*/
+static int column_info(lua_State *L, sqlite3_stmt *vm, int numcols,
+		       const char *(*info)(sqlite3_stmt *, int))
+{
+  int i;
+  lua_newtable(L);
+  for (i = 0; i < numcols;)
+    {
+      lua_pushstring(L, info(vm, i));
+      lua_rawseti(L, -2, ++i);
+    }
+  return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+
+static int create_cursor(lua_State *L, int o, conn_data *conn,
+			 sqlite3_stmt *sql_vm, int numcols, int s, stmt_data *stmt,
+			 cache_entry *entry, int pending, int anchors)
+{
+  cur_data *cur = (cur_data*)lua_newuserdata(L, sizeof(cur_data));
+  luasql_setmeta (L, LUASQL_CURSOR_SQLITE);
+
+  /* increment cursor count for the connection creating this cursor */
+  conn->cur_counter++;
+
+  /* fill in structure */
+  cur->closed = 0;
+  cur->conn = LUA_NOREF;
+  cur->numcols = numcols;
+  cur->colnames = LUA_NOREF;
+  cur->coltypes = LUA_NOREF;
+  cur->stmtref = LUA_NOREF;
+  cur->pending = pending;
+  cur->anchors = anchors;
+  cur->sql_vm = sql_vm;
+  cur->conn_data = conn;
+  cur->stmt = stmt;
+  cur->entry = entry;
+  memset(&cur->stats, 0, sizeof(stmt_stats));
+  cur->loops = LUA_NOREF;
+
+  lua_pushvalue(L, o);
+  cur->conn = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  /* keep the statement alive while the cursor borrows its vm */
+  if (stmt != NULL)
+    {
+      stmt->busy = 1;
+      lua_pushvalue(L, s);
+      cur->stmtref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+  cur->colnames = column_info(L, sql_vm, numcols, sqlite3_column_name);
+  cur->coltypes = column_info(L, sql_vm, numcols, sqlite3_column_decltype);
+  return 1;
+}
+
+
+/*
+** WAL hook of connections with a checkpointer: records the size of the
+** WAL after each commit and wakes the thread once it is large enough.
+*/
+static int checkpointer_hook(void *ud, sqlite3 *db, const char *dbname, int frames)
+{
+  checkpointer *ck = (checkpointer *)ud;
+  (void)db; (void)dbname;
+  mutex_lock(&ck->lock);
+  ck->wal_frames = frames;
+  if (frames >= ck->frames && !ck->pending)
+    {
+      ck->pending = 1;
+      cond_signal(&ck->wake);
+    }
+  mutex_unlock(&ck->lock);
+  return SQLITE_OK;
+}
+
+
+/*
+** Main function of the checkpointer threads: PASSIVE checkpoints from
+** their own connection, which neither wait for the writers nor make them
+** wait, every 'interval' or as soon as the WAL reaches 'frames'.
+*/
+static THREAD_RESULT checkpointer_main(void *arg)
+{
+  checkpointer *ck = (checkpointer *)arg;
+  int rc, log, done;
+
+  mutex_lock(&ck->lock);
+  for (;;)
+    {
+      if (!ck->pending && !ck->stopping)
+        cond_timedwait(&ck->wake, &ck->lock, ck->interval);
+      if (ck->stopping)
+        break;
+      ck->pending = 0;
+      mutex_unlock(&ck->lock);
+      rc = sqlite3_wal_checkpoint_v2(ck->db, NULL, SQLITE_CHECKPOINT_PASSIVE, &log, &done);
+      mutex_lock(&ck->lock);
+      if (rc == SQLITE_OK)
+        ck->checkpoints++;
+      else
+        ck->failures++;
+    }
+  mutex_unlock(&ck->lock);
+  return 0;
+}
+
+
+/*
+** Stop the checkpointer of a connection, if any, and give the automatic
+** checkpoints back to the connection.
+*/
+static void checkpointer_stop(conn_data *conn)
+{
+  checkpointer *ck = conn->ckpt;
+  if (ck == NULL)
+    return;
+  mutex_lock(&ck->lock);
+  ck->stopping = 1;
+  cond_signal(&ck->wake);
+  mutex_unlock(&ck->lock);
+  thread_join(ck->thread);
+  sqlite3_close(ck->db);
+  sqlite3_wal_autocheckpoint(conn->sql_conn, ck->auto_frames);
+  mutex_destroy(&ck->lock);
+  cond_destroy(&ck->wake);
+  free(ck);
+  conn->ckpt = NULL;
+}
+
+
+/*
+** Connection object collector function
+*/
+static int conn_gc(lua_State *L)
+{
+  conn_data *conn = (conn_data *)luaL_checkudata(L, 1, LUASQL_CONNECTION_SQLITE);
+  if (conn != NULL && !(conn->closed))
+    {
+      if (conn->cur_counter > 0)
+        return luaL_error (L, LUASQL_PREFIX"there are open cursors");
+      if (conn->stmt_counter > 0)
+        return luaL_error (L, LUASQL_PREFIX"there are open statements");
+      if (conn->blob_counter > 0)
+        return luaL_error (L, LUASQL_PREFIX"there are open blobs");
+      if (conn->backup_counter > 0)
+        return luaL_error (L, LUASQL_PREFIX"there are open backups");
+      if (conn->session_counter > 0)
+        return luaL_error (L, LUASQL_PREFIX"there are open sessions");
+
+      /* Nullify structure fields. */
+      conn->closed = 1;
+      conn->L = L;
+      luaL_unref(L, LUA_REGISTRYINDEX, conn->env);
+      luaL_unref(L, LUA_REGISTRYINDEX, conn->onstats);
+      conn->onstats = LUA_NOREF;
+      luaL_unref(L, LUA_REGISTRYINDEX, conn->onchange);
+      conn->onchange = LUA_NOREF;
+      checkpointer_stop(conn);
+      txn_free(conn);
+      cache_trim(conn, 0);
+      if (sqlite3_close(conn->sql_conn) == SQLITE_OK)
+        {
+          change_free(&conn->changes);
+          /* the database is no longer reading from its image */
+          luaL_unref(L, LUA_REGISTRYINDEX, conn->image);
+#ifdef LUASQL_SQLITE_MMAP
+          if (conn->mapping != NULL)
+            munmap(conn->mapping, conn->mapping_size);
+#endif
+        }
+    }
+  return 0;
+}
+
+
+/*
+** Close a Connection object.
+*/
+static int conn_close(lua_State *L)
+{
+  conn_data *conn = (conn_data *)luaL_checkudata(L, 1, LUASQL_CONNECTION_SQLITE);
+  luaL_argcheck (L, conn != NULL, 1, LUASQL_PREFIX"connection expected");
+  if (conn->closed)
+    {
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+  conn_gc(L);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static int conn_escape(lua_State *L)
+{
+  const char *from = luaL_checklstring (L, 2, 0);
+  char *escaped = sqlite3_mprintf("%q", from);
+  if (escaped == NULL)
+    {
+      lua_pushnil(L);
+    }
+  else
+    {
+      lua_pushstring(L, escaped);
+      sqlite3_free(escaped);
+    }
+  return 1;
+}
+
+
+/*
+** Bind one parameter.
+** Supported are the data types nil, string, boolean, number.
+** Return SQLITE_OK, an SQLite error code or LUASQL_BIND_MISUSE.
+*/
+static int set_param(lua_State *L, sqlite3_stmt *vm, int param_nr, int arg)
+{
+  int tt = lua_type(L, arg);
+  int rc = 0;
+
+  switch (tt) {
+    case LUA_TNIL:
+    rc = sqlite3_bind_null(vm, param_nr);
+    break;
+
+    case LUA_TSTRING: {
+    /* not copied: the caller keeps the string alive while it is bound */
+    size_t s_len;
+    const char *s = lua_tolstring(L, arg, &s_len);
+    rc = sqlite3_bind_text(vm, param_nr, s, s_len, SQLITE_STATIC);
+    break;
+    }
+
+    case LUA_TBOOLEAN: {
+      int val = lua_tointeger(L, arg);
+      rc = sqlite3_bind_int(vm, param_nr, val);
+    }
+    break;
+
+    case LUA_TNUMBER:
+    if (lua_isinteger(L, arg)) {
+      lua_Integer val = lua_tointeger(L, arg);
+      rc = sqlite3_bind_int64(vm, param_nr, val);
+    } else {
+      double val = lua_tonumber(L, arg);
+      rc = sqlite3_bind_double(vm, param_nr, val);
+    }
+    break;
+
+    default:
+#ifdef LUASQL_SQLITE_CARRAY
+    if (luaL_testudata(L, arg, LUASQL_ARRAY_SQLITE) != NULL) {
+      /* not copied either: anchored by the caller like strings */
+      rc = sqlite3_bind_pointer(vm, param_nr, lua_touserdata(L, arg), "carray", NULL);
+      break;
+    }
+#endif
+    lua_pushfstring(L, LUASQL_PREFIX"unhandled data type %s in parameter binding",
+      lua_typename(L, tt));
+    rc = LUASQL_BIND_MISUSE;
+  }
+
+  return rc;
+}
+
+/*
+** Set the result of an SQL function from a Lua value, with the same type
+** mapping as set_param.
+*/
+static void set_result(lua_State *L, sqlite3_context *ctx, int arg)
+{
+  int tt = lua_type(L, arg);
+
+  switch (tt) {
+    case LUA_TNONE:
+    case LUA_TNIL:
+    sqlite3_result_null(ctx);
+    break;
+
+    case LUA_TSTRING: {
+    size_t s_len;
+    const char *s = lua_tolstring(L, arg, &s_len);
+    sqlite3_result_text(ctx, s, s_len, SQLITE_TRANSIENT);
+    break;
+    }
+
+    case LUA_TBOOLEAN:
+    sqlite3_result_int(ctx, lua_toboolean(L, arg));
+    break;
+
+    case LUA_TNUMBER:
+    if (lua_isinteger(L, arg))
+      sqlite3_result_int64(ctx, lua_tointeger(L, arg));
+    else
+      sqlite3_result_double(ctx, lua_tonumber(L, arg));
+    break;
+
+    default:
+    lua_pushfstring(L, LUASQL_PREFIX"unhandled data type %s in function result",
+      lua_typename(L, tt));
+    sqlite3_result_error(ctx, lua_tostring(L, -1), -1);
+    lua_pop(L, 1);
+  }
+}
+
+static int raw_readparams_args(lua_State *L, sqlite3_stmt *vm, int arg, int ltop)
+{
+  int param_count, param_nr, rc = 0;
+
+  param_count = sqlite3_bind_parameter_count(vm);
+  if (ltop - arg + 1 != param_count) {
+    lua_pushfstring(L, LUASQL_PREFIX"wrong number of parameters: expected=%d, given=%d",
+      param_count, ltop - arg + 1);
+    return LUASQL_BIND_MISUSE;
+  }
+
+  for (param_nr=1; param_nr <= param_count; param_nr ++, arg ++) {
+    rc = set_param(L, vm, param_nr, arg);
+    if (rc)
+      break;
+  }
+
+  return rc;
+}
+
+/*
+** Bind all parameters from the given table.
+** The table indices can be integers or strings.
+** Unbound parameters, or duplicate bindings are not detected.
+*/
+static int raw_readparams_table(lua_State *L, sqlite3_stmt *vm, int arg)
+{
+  int param_nr, rc = 0, tt;
+
+  lua_pushnil(L);
+
+  while (lua_next(L, arg)) {		// [arg]=table, [-2]=key, [-1]=val
+    tt = lua_type(L, -2);
+    if (tt == LUA_TNUMBER && lua_isinteger(L, -2)) {
+      param_nr = lua_tointeger(L, -2);
+    } else {
+      const char *param_name = lua_tostring(L, -2);
+      param_nr = sqlite3_bind_parameter_index(vm, param_name);
+      if (param_nr == 0) {
+        lua_pushfstring(L, LUASQL_PREFIX"binding to invalid parameter name %s\n",
+          param_name);
+        return LUASQL_BIND_MISUSE;
+      }
+    }
+    rc = set_param(L, vm, param_nr, -1);
+    if (rc)
+      return rc;
+    lua_pop(L, 1);
+  }
+
+  return rc;
+}
+
+/*
+** Bind the parameters given from stack index 'arg' up to the top.
+** They are either one table (positional and/or named) or positional values.
+** Return SQLITE_OK or the error code of the failed binding.
+*/
+static int raw_readparams(lua_State *L, sqlite3_stmt *vm, int arg)
+{
+  int ltop = lua_gettop(L);
+  if (ltop < arg)
+    return SQLITE_OK;
+  if (ltop == arg && lua_type(L, arg) == LUA_TTABLE)
+    return raw_readparams_table(L, vm, arg);
+  return raw_readparams_args(L, vm, arg, ltop);
+}
+
+
+/*
+** Strings and arrays are bound without being copied, so they must outlive
+** the binding. Parameters on the stack (from index 'arg' up to the top) are
+** alive while the call that binds them runs, but a cursor keeps stepping
+** the vm after that: it anchors the bound values until its vm is reset.
+** Return a reference to a table with the values, or LUA_NOREF if none.
+*/
+static int anchor_params(lua_State *L, int arg)
+{
+  int ltop = lua_gettop(L);
+  int anchors = 0, n = 0, i;
+
+  if (ltop < arg)
+    return LUA_NOREF;
+  if (ltop == arg && lua_type(L, arg) == LUA_TTABLE)
+    {
+      /* the table itself may change while the cursor is open */
+      lua_pushnil(L);
+      while (lua_next(L, arg))
+        {
+          if (lua_type(L, -1) == LUA_TSTRING || lua_type(L, -1) == LUA_TUSERDATA)
+            {
+              if (anchors == 0)
+                {
+                  lua_newtable(L);
+                  lua_insert(L, -3);
+                  anchors = lua_gettop(L) - 2;
+                }
+              lua_rawseti(L, anchors, ++n);
+            }
+          else
+            lua_pop(L, 1);
+        }
+    }
+  else
+    {
+      for (i = arg; i <= ltop; i++)
+        {
+          if (lua_type(L, i) != LUA_TSTRING && lua_type(L, i) != LUA_TUSERDATA)
+            continue;
+          if (anchors == 0)
+            {
+              lua_newtable(L);
+              anchors = lua_gettop(L);
+            }
+          lua_pushvalue(L, i);
+          lua_rawseti(L, anchors, ++n);
+        }
+    }
+  if (anchors == 0)
+    return LUA_NOREF;
+  return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+
+/*
+** Report a failed binding once the vm was released.
+** Misuse raises the message left by the binding functions, while errors
+** from SQLite return nil plus the message pushed before the release.
+*/
+static int bind_failed(lua_State *L, int res)
+{
+  if (res == LUASQL_BIND_MISUSE)
+    return lua_error(L);
+  return 2;
+}
+
+
+/*
+** Run a prepared vm whose parameters are already bound.
+** Return a Cursor object if the statement is a query, otherwise
+** return the number of tuples affected by the statement.
+** The vm of a statement object ('stmt' at stack index 's') or of the
+** statement cache ('entry') is given back when done, see release_vm.
+** The bound parameters are at stack index 'params' and above.
+*/
+static int raw_execute(lua_State *L, int o, conn_data *conn, sqlite3_stmt *vm,
+		       int s, stmt_data *stmt, cache_entry *entry, int params)
+{
+  int res;
+  int numcols;
+  const char *errmsg;
+
+  /* process first result to retrieve query information and type */
+  res = step_vm(conn, vm);
+  numcols = sqlite3_column_count(vm);
+
+  /* real query? if empty, must have numcols!=0 */
+  /* the cursor takes the stepped result, so the first row is not computed twice */
+  if ((res == SQLITE_ROW) || ((res == SQLITE_DONE) && numcols))
+    return create_cursor(L, o, conn, vm, numcols, s, stmt, entry, res,
+			 anchor_params(L, params));
+
+  if (res == SQLITE_DONE) /* and numcols==0, INSERT,UPDATE,DELETE statement */
+    {
+      /* return number of columns changed, read before the stats callback */
+      lua_pushnumber(L, sqlite3_changes(conn->sql_conn));
+      release_vm(conn, vm, stmt, entry);
+      return 1;
+    }
+
+  /* error: push the message before the vm is released */
+  errmsg = conn_errmsg(conn);
+  luasql_faildirect(L, errmsg);
+  release_vm(conn, vm, stmt, entry);
+  return 2;
+}
+
+
+/*
+** Execute an SQL statement.
+** Return a Cursor object if the statement is a query, otherwise
+** return the number of tuples affected by the statement.
+*/
+static int conn_execute(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  size_t len;
+  const char *statement = luaL_checklstring(L, 2, &len);
+  int res;
+  sqlite3_stmt *vm;
+  cache_entry *entry;
+  const char *errmsg;
+
+  if (call_expired(conn))
+    return luasql_faildirect(L, LUASQL_SQLITE_TIMEOUT);
+  res = acquire_vm(conn, statement, len, &vm, &entry);
+  if (res != SQLITE_OK)
+    {
+      errmsg = sqlite3_errmsg(conn->sql_conn);
+      return luasql_faildirect(L, errmsg);
+    }
+
+  /* Bind parameters (if any) */
+  res = raw_readparams(L, vm, 3);
+  if (res != SQLITE_OK)
+    {
+      if (res != LUASQL_BIND_MISUSE)
+        luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+      release_vm(conn, vm, NULL, entry);
+      return bind_failed(L, res);
+    }
+
+  return finish_call(L, conn, raw_execute(L, 1, conn, vm, 0, NULL, entry, 3));
+}
+
+
+/*
+** Execute an SQL statement once for each set of parameters in a list.
+** The statement is compiled once and, in auto commit mode, all rows are
+** written in a single transaction.
+** Return the total number of tuples affected by the statement.
+*/
+static int conn_executemany(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  size_t len;
+  const char *statement = luaL_checklstring(L, 2, &len);
+  int res, base, own_txn;
+  sqlite3_stmt *vm;
+  cache_entry *entry;
+  lua_Integer i, nrows;
+  lua_Number changes = 0;
+
+  luaL_checktype(L, 3, LUA_TTABLE);
+  lua_settop(L, 3);
+  base = lua_gettop(L);
+  nrows = (lua_Integer)lua_rawlen(L, 3);
+
+  if (call_expired(conn))
+    return luasql_faildirect(L, LUASQL_SQLITE_TIMEOUT);
+  res = acquire_vm(conn, statement, len, &vm, &entry);
+  if (res != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+
+  /* one transaction instead of one per row, unless one is already open */
+  own_txn = conn->auto_commit && sqlite3_get_autocommit(conn->sql_conn);
+  if (own_txn)
+    {
+      res = run_txn(conn, LUASQL_TXN_BEGIN);
+      if (res != SQLITE_OK)
+        {
+          luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+          release_vm(conn, vm, NULL, entry);
+          return 2;
+        }
+    }
+
+  for (i = 1; i <= nrows; i++)
+    {
+      lua_rawgeti(L, 3, i);
+      if (lua_type(L, -1) != LUA_TTABLE)
+        {
+          lua_pushfstring(L, LUASQL_PREFIX"parameter table expected in row %d",
+                          (int)i);
+          res = LUASQL_BIND_MISUSE;
+          break;
+        }
+      /* the bound strings stay anchored by the list of rows */
+      res = raw_readparams_table(L, vm, base + 1);
+      if (res != SQLITE_OK)
+        break;
+      lua_settop(L, base);
+
+      while ((res = step_vm(conn, vm)) == SQLITE_ROW)
+        ;
+      if (res != SQLITE_DONE)
+        break;
+      res = SQLITE_OK;
+      changes += sqlite3_changes(conn->sql_conn);
+      sqlite3_reset(vm);
+      sqlite3_clear_bindings(vm);
+    }
+
+  if (res != SQLITE_OK)
+    {
+      if (res != LUASQL_BIND_MISUSE)
+        luasql_faildirect(L, conn_errmsg(conn));
+      release_vm(conn, vm, NULL, entry);
+      if (own_txn)
+        (void) run_txn(conn, LUASQL_TXN_ROLLBACK);
+      return bind_failed(L, res);
+    }
+
+  release_vm(conn, vm, NULL, entry);
+  if (own_txn)
+    {
+      res = run_txn(conn, LUASQL_TXN_COMMIT);
+      if (res != SQLITE_OK)
+        {
+          luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+          (void) run_txn(conn, LUASQL_TXN_ROLLBACK);
+          return 2;
+        }
+    }
+
+  lua_pushnumber(L, changes);
+  return finish_call(L, conn, 1);
+}
+
+
+/*
+** Skip the white space, comments and empty statements between the
+** statements of a script.
+*/
+static const char *skip_blank(const char *sql, const char *end)
+{
+  while (sql < end)
+    {
+      if (*sql == ';' || isspace((unsigned char)*sql))
+        sql++;
+      else if (sql + 1 < end && sql[0] == '-' && sql[1] == '-')
+        {
+          while (sql < end && *sql != '\n')
+            sql++;
+        }
+      else if (sql + 1 < end && sql[0] == '/' && sql[1] == '*')
+        {
+          sql += 2;
+          while (sql + 1 < end && !(sql[0] == '*' && sql[1] == '/'))
+            sql++;
+          sql = (sql + 1 < end) ? sql + 2 : end;
+        }
+      else
+        break;
+    }
+  return sql;
+}
+
+
+/*
+** Bind the parameters of one statement of a script from the table at
+** stack index 'arg'. Unlike raw_readparams_table, names and positions the
+** statement does not use are skipped, since they belong to other statements.
+*/
+static int bind_script_params(lua_State *L, sqlite3_stmt *vm, int arg)
+{
+  int param_count = sqlite3_bind_parameter_count(vm);
+  int param_nr, rc;
+
+  if (param_count == 0)
+    return SQLITE_OK;
+  lua_pushnil(L);
+  while (lua_next(L, arg))
+    {
+      if (lua_type(L, -2) == LUA_TNUMBER && lua_isinteger(L, -2))
+        {
+          lua_Integer i = lua_tointeger(L, -2);
+          param_nr = (i >= 1 && i <= param_count) ? (int)i : 0;
+        }
+      else if (lua_type(L, -2) == LUA_TSTRING)
+        param_nr = sqlite3_bind_parameter_index(vm, lua_tostring(L, -2));
+      else
+        param_nr = 0;
+      if (param_nr != 0)
+        {
+          rc = set_param(L, vm, param_nr, -1);
+          if (rc != SQLITE_OK)
+            return rc;
+        }
+      lua_pop(L, 1);
+    }
+  return SQLITE_OK;
+}
+
+
+/*
+** Execute a script of SQL statements, one after the other, following the
+** tail left by the compilation of each. The optional table of parameters
+** is bound to every statement using them; if 'transaction' is true and no
+** transaction is open, the whole script runs in a single one.
+** Return a list with the number of tuples affected by each statement and,
+** if the last statement is a query, a Cursor object over its result.
+** On failure, return nil, the message and the index of the failed statement.
+*/
+static int conn_executescript(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  size_t len;
+  const char *sql = luaL_checklstring(L, 2, &len);
+  const char *end = sql + len;
+  const char *tail;
+  int res = SQLITE_OK, own_txn, numcols, last, n = 0;
+  int has_params = !lua_isnoneornil(L, 3);
+  sqlite3_stmt *vm;
+  lua_Number before;
+
+  if (has_params)
+    luaL_checktype(L, 3, LUA_TTABLE);
+  own_txn = lua_toboolean(L, 4) && sqlite3_get_autocommit(conn->sql_conn);
+  lua_settop(L, 4);
+  lua_newtable(L);  /* counts, at index 5 */
+
+  if (call_expired(conn))
+    return luasql_faildirect(L, LUASQL_SQLITE_TIMEOUT);
+  if (own_txn)
+    {
+      res = run_txn(conn, LUASQL_TXN_BEGIN);
+      if (res != SQLITE_OK)
+        return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+    }
+
+  sql = skip_blank(sql, end);
+  while (sql < end)
+    {
+#if SQLITE_VERSION_NUMBER > 3006013
+      res = sqlite3_prepare_v2(conn->sql_conn, sql, (int)(end - sql), &vm, &tail);
+#else
+      res = sqlite3_prepare(conn->sql_conn, sql, (int)(end - sql), &vm, &tail);
+#endif
+      if (res != SQLITE_OK)
+        {
+          n++;
+          luasql_faildirect(L, conn_errmsg(conn));
+          break;
+        }
+      sql = skip_blank(tail, end);
+      if (vm == NULL)  /* nothing but a comment */
+        continue;
+      n++;
+
+      if (has_params)
+        {
+          res = bind_script_params(L, vm, 3);
+          if (res != SQLITE_OK)
+            {
+              if (res != LUASQL_BIND_MISUSE)
+                luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+              release_vm(conn, vm, NULL, NULL);
+              break;
+            }
+        }
+
+      before = (lua_Number)sqlite3_total_changes(conn->sql_conn);
+      res = step_vm(conn, vm);
+      numcols = sqlite3_column_count(vm);
+      last = (sql >= end);
+
+      /* the last query is left to a cursor, with its first row stepped */
+      if (last && ((res == SQLITE_ROW) || ((res == SQLITE_DONE) && numcols)))
+        {
+          int anchors = LUA_NOREF;
+          if (has_params)
+            {
+              lua_pushvalue(L, 3);
+              anchors = anchor_params(L, lua_gettop(L));
+              lua_pop(L, 1);
+            }
+          lua_pushnumber(L, 0);
+          lua_rawseti(L, 5, n);
+          create_cursor(L, 1, conn, vm, numcols, 0, NULL, NULL, res, anchors);
+          res = SQLITE_OK;
+          break;
+        }
+
+      while (res == SQLITE_ROW)
+        res = step_vm(conn, vm);
+      if (res != SQLITE_DONE)
+        {
+          luasql_faildirect(L, conn_errmsg(conn));
+          release_vm(conn, vm, NULL, NULL);
+          break;
+        }
+      res = SQLITE_OK;
+      /* sqlite3_changes is left over from the last DML statement */
+      if ((lua_Number)sqlite3_total_changes(conn->sql_conn) != before)
+        lua_pushnumber(L, sqlite3_changes(conn->sql_conn));
+      else
+        lua_pushnumber(L, 0);
+      lua_rawseti(L, 5, n);
+      release_vm(conn, vm, NULL, NULL);
+    }
+
+  if (res != SQLITE_OK)
+    {
+      if (own_txn)
+        (void) run_txn(conn, LUASQL_TXN_ROLLBACK);
+      if (res == LUASQL_BIND_MISUSE)
+        return lua_error(L);
+      lua_pushinteger(L, n);
+      return finish_call(L, conn, 3);
+    }
+
+  if (own_txn)
+    {
+      res = run_txn(conn, LUASQL_TXN_COMMIT);
+      if (res != SQLITE_OK)
+        {
+          luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+          (void) run_txn(conn, LUASQL_TXN_ROLLBACK);
+          return 2;
+        }
+    }
+
+  lua_pushvalue(L, 5);
+  if (lua_gettop(L) == 7)  /* a cursor is below the list */
+    {
+      lua_insert(L, 6);
+      return finish_call(L, conn, 2);
+    }
+  return finish_call(L, conn, 1);
+}
+
+
+/*
+** Prepare an SQL statement for repeated execution.
+** Return a Statement object.
+*/
+static int conn_prepare(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *statement = luaL_checkstring(L, 2);
+  int res;
+  sqlite3_stmt *vm;
+  stmt_data *stmt;
+
+  res = prepare_vm(conn, statement, 1, &vm);
+  if (res != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+
+  stmt = (stmt_data *)lua_newuserdata(L, sizeof(stmt_data));
+  luasql_setmeta(L, LUASQL_STATEMENT_SQLITE);
+
+  /* increment statement count for the connection creating this statement */
+  conn->stmt_counter++;
+
+  /* fill in structure */
+  stmt->closed = 0;
+  stmt->busy = 0;
+  stmt->conn_data = conn;
+  stmt->sql_vm = vm;
+  lua_pushvalue(L, 1);
+  stmt->conn = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+
+/*
+** Execute a prepared statement with a new set of parameters.
+** Return a Cursor object if the statement is a query, otherwise
+** return the number of tuples affected by the statement.
+*/
+static int stmt_execute(lua_State *L)
+{
+  stmt_data *stmt = getstatement(L);
+  int res;
+  luaL_argcheck(L, !stmt->busy, 1, LUASQL_PREFIX"there are open cursors");
+
+  if (call_expired(stmt->conn_data))
+    return luasql_faildirect(L, LUASQL_SQLITE_TIMEOUT);
+  sqlite3_reset(stmt->sql_vm);
+  sqlite3_clear_bindings(stmt->sql_vm);
+  res = raw_readparams(L, stmt->sql_vm, 2);
+  if (res != SQLITE_OK)
+    {
+      if (res != LUASQL_BIND_MISUSE)
+        luasql_faildirect(L, sqlite3_errmsg(stmt->conn_data->sql_conn));
+      sqlite3_clear_bindings(stmt->sql_vm);
+      return bind_failed(L, res);
+    }
+
+  /* the connection goes below the parameters */
+  lua_rawgeti(L, LUA_REGISTRYINDEX, stmt->conn);
+  lua_insert(L, 2);
+  return finish_call(L, stmt->conn_data,
+                       raw_execute(L, 2, stmt->conn_data, stmt->sql_vm, 1,
+                                   stmt, NULL, 3));
+}
+
+
+/*
+** Statement object collector function
+*/
+static int stmt_gc(lua_State *L)
+{
+  stmt_data *stmt = (stmt_data *)luaL_checkudata(L, 1, LUASQL_STATEMENT_SQLITE);
+  if (stmt != NULL && !(stmt->closed))
+    {
+      /* Nullify structure fields. */
+      stmt->closed = 1;
+      stmt->conn_data->L = L;
+      sqlite3_finalize(stmt->sql_vm);
+      stmt->sql_vm = NULL;
+      stmt->conn_data->stmt_counter--;
+      luaL_unref(L, LUA_REGISTRYINDEX, stmt->conn);
+    }
+  return 0;
+}
+
+
+/*
+** Close a Statement object.
+*/
+static int stmt_close(lua_State *L)
+{
+  stmt_data *stmt = (stmt_data *)luaL_checkudata(L, 1, LUASQL_STATEMENT_SQLITE);
+  luaL_argcheck(L, stmt != NULL, 1, LUASQL_PREFIX"statement expected");
+  if (stmt->closed)
+    {
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+  luaL_argcheck(L, !stmt->busy, 1, LUASQL_PREFIX"there are open cursors");
+  stmt_gc(L);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** End the current transaction with COMMIT or ROLLBACK. In manual commit
+** mode a new transaction is started, also when ending the previous one
+** failed and SQLite closed it.
+*/
+static int end_txn(lua_State *L, conn_data *conn, int which)
+{
+  int res = run_txn(conn, which);
+
+  if (res != SQLITE_OK)
+    luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  if (conn->auto_commit == 0 && sqlite3_get_autocommit(conn->sql_conn))
+    {
+      int begun = run_txn(conn, LUASQL_TXN_BEGIN);
+      if (res == SQLITE_OK && begun != SQLITE_OK)
+        {
+          res = begun;
+          luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+        }
+    }
+  deliver_changes(L, conn);
+  if (res != SQLITE_OK)
+    return 2;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Commit the current transaction.
+*/
+static int conn_commit(lua_State *L)
+{
+  return end_txn(L, getconnection(L), LUASQL_TXN_COMMIT);
+}
+
+
+/*
+** Rollback the current transaction.
+*/
+static int conn_rollback(lua_State *L)
+{
+  return end_txn(L, getconnection(L), LUASQL_TXN_ROLLBACK);
+}
+
+
+/*
+** Run a statement on a savepoint through the statement cache.
+*/
+static int run_savepoint(lua_State *L, conn_data *conn, int which)
+{
+  static const char *const formats[] = {
+    "SAVEPOINT \"%w\"", "RELEASE \"%w\"", "ROLLBACK TO \"%w\""
+  };
+  const char *name = luaL_optstring(L, 2, "luasql");
+  char *sql = sqlite3_mprintf(formats[which], name);
+  size_t start = conn->changes.count;
+  sqlite3_stmt *vm;
+  cache_entry *entry;
+  int res;
+
+  if (sql == NULL)
+    return luaL_error(L, LUASQL_PREFIX"not enough memory");
+  res = acquire_vm(conn, sql, strlen(sql), &vm, &entry);
+  sqlite3_free(sql);
+  if (res != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  res = step_vm(conn, vm);
+  if (res != SQLITE_DONE)
+    luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  else if (conn->onchange != LUA_NOREF)
+    change_savepoint(&conn->changes, which, name, start);
+  release_vm(conn, vm, NULL, entry);
+  deliver_changes(L, conn);
+  if (res != SQLITE_DONE)
+    return 2;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Start a savepoint, a unit of work nested in the current transaction,
+** or starting one.
+** Lua Input: [name]
+**   name: name of the savepoint, "luasql" by default
+*/
+static int conn_savepoint(lua_State *L)
+{
+  return run_savepoint(L, getconnection(L), LUASQL_SAVEPOINT_START);
+}
+
+
+/*
+** Release the most recent savepoint with the name, keeping its changes;
+** releasing the outermost one commits them.
+*/
+static int conn_release(lua_State *L)
+{
+  return run_savepoint(L, getconnection(L), LUASQL_SAVEPOINT_RELEASE);
+}
+
+
+/*
+** Undo the changes made since the most recent savepoint with the name,
+** which stays open.
+*/
+static int conn_rollbackto(lua_State *L)
+{
+  return run_savepoint(L, getconnection(L), LUASQL_SAVEPOINT_ROLLBACK);
+}
+
+
+/*
+** Set the mode of the transactions started by the connection.
+** Lua Input: mode
+**   mode: "DEFERRED", "IMMEDIATE" or "EXCLUSIVE"
+*/
+static int conn_setbeginmode(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *name = luaL_checkstring(L, 2);
+  int mode;
+  for (mode = 0; begin_modes[mode] != NULL; mode++)
+    if (sqlite3_stricmp(name, begin_modes[mode]) == 0)
+      break;
+  luaL_argcheck(L, begin_modes[mode] != NULL, 2,
+                lua_pushfstring(L, LUASQL_PREFIX"invalid mode '%s'", name));
+  if (mode != conn->begin_mode)
+    {
+      sqlite3_finalize(conn->txn_vm[LUASQL_TXN_BEGIN]);
+      conn->txn_vm[LUASQL_TXN_BEGIN] = NULL;
+      conn->begin_mode = mode;
+    }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static int conn_getlastautoid(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  lua_pushnumber(L, sqlite3_last_insert_rowid(conn->sql_conn));
+  return 1;
+}
+
+
+/*
+** Get a boolean field of the options table, or 'def' if it is absent.
+*/
+static int opt_boolean(lua_State *L, int t, const char *name, int def)
+{
+  int res = def;
+  lua_getfield(L, t, name);
+  if (!lua_isnil(L, -1))
+    res = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  return res;
+}
+
+
+/*
+** Get an integer field of the options table.
+** Return 0 if it is absent.
+*/
+static int opt_integer(lua_State *L, int t, const char *name, lua_Integer *val)
+{
+  int found = 0;
+  lua_getfield(L, t, name);
+  if (!lua_isnil(L, -1))
+    {
+      if (!lua_isnumber(L, -1))
+        luaL_error(L, LUASQL_PREFIX"option '%s' must be a number", name);
+      *val = (lua_Integer)lua_tonumber(L, -1);
+      found = 1;
+    }
+  lua_pop(L, 1);
+  return found;
+}
+
+
+/*
+** Get a field of the options table that must be one of the given names.
+** The pragmas are built from these names, never from the user's string.
+** Return NULL if it is absent.
+*/
+static const char *opt_choice(lua_State *L, int t, const char *name,
+			      const char *const choices[])
+{
+  const char *val;
+  int i;
+  lua_getfield(L, t, name);
+  if (lua_isnil(L, -1))
+    {
+      lua_pop(L, 1);
+      return NULL;
+    }
+  val = lua_tostring(L, -1);
+  for (i = 0; val != NULL && choices[i] != NULL; i++)
+    {
+      if (sqlite3_stricmp(val, choices[i]) == 0)
+        {
+          lua_pop(L, 1);
+          return choices[i];
+        }
+    }
+  luaL_error(L, LUASQL_PREFIX"invalid value for option '%s'", name);
+  return NULL;
+}
+
+
+/*
+** Lua functions registered as SQL functions of a connection.
+*/
+typedef struct
+{
+  conn_data   *conn;              /* connection running the callbacks */
+  int         fn;                 /* scalar function or aggregate step */
+  int         final;              /* aggregate final, inverse and value */
+  int         inverse;
+  int         value;
+  int         states;             /* aggregate states by context */
+} func_data;
+
+
+/*
+** Allocate a function whose Lua references are all unset.
+*/
+static func_data *new_function(lua_State *L, conn_data *conn)
+{
+  func_data *func = (func_data *)malloc(sizeof(func_data));
+  if (func == NULL)
+    luaL_error(L, LUASQL_PREFIX"not enough memory");
+  func->conn = conn;
+  func->fn = func->final = func->inverse = func->value = LUA_NOREF;
+  func->states = LUA_NOREF;
+  return func;
+}
+
+
+/*
+** Reference the function at the given stack index, which may be nil.
+*/
+static int ref_function(lua_State *L, int arg)
+{
+  if (lua_isnoneornil(L, arg))
+    return LUA_NOREF;
+  lua_pushvalue(L, arg);
+  return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+
+/*
+** Call the Lua function on top of the stack with the SQL arguments.
+** The Lua error message, if any, is reported as the SQL error.
+** Return 1 with the result on the stack, or 0 on error.
+*/
+static int call_function(lua_State *L, sqlite3_context *ctx, int nargs,
+			 int argc, sqlite3_value **argv)
+{
+  int i;
+  if (!lua_checkstack(L, argc + 1))
+    {
+      lua_pop(L, nargs + 1);
+      sqlite3_result_error_nomem(ctx);
+      return 0;
+    }
+  for (i = 0; i < argc; i++)
+    push_value(L, argv[i]);
+  if (lua_pcall(L, nargs + argc, 1, 0) != 0)
+    {
+      const char *errmsg = lua_tostring(L, -1);
+      sqlite3_result_error(ctx, errmsg ? errmsg : LUASQL_PREFIX"error in Lua function", -1);
+      lua_pop(L, 1);
+      return 0;
+    }
+  return 1;
+}
+
+
+/*
+** Entry point of a scalar function.
+*/
+static void func_scalar(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+  func_data *func = (func_data *)sqlite3_user_data(ctx);
+  lua_State *L = func->conn->L;
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, func->fn);
+  if (call_function(L, ctx, 0, argc, argv))
+    {
+      set_result(L, ctx, -1);
+      lua_pop(L, 1);
+    }
+}
+
+
+/*
+** Entry points of an aggregate. Each group has its own state, kept in
+** the states table under the address of its aggregate context: it starts
+** as nil and is replaced by the result of every call to step (or
+** inverse). Final (and value, for window functions) turn it into the
+** result.
+*/
+static void agg_update(sqlite3_context *ctx, int fn, int argc, sqlite3_value **argv)
+{
+  func_data *func = (func_data *)sqlite3_user_data(ctx);
+  lua_State *L = func->conn->L;
+  void *key = sqlite3_aggregate_context(ctx, 1);
+
+  if (key == NULL)
+    {
+      sqlite3_result_error_nomem(ctx);
+      return;
+    }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, func->states);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, fn);
+  lua_rawgetp(L, -2, key);
+  if (call_function(L, ctx, 1, argc, argv))
+    lua_rawsetp(L, -2, key);
+  lua_pop(L, 1);
+}
+
+
+static void agg_result(sqlite3_context *ctx, int fn, int done)
+{
+  func_data *func = (func_data *)sqlite3_user_data(ctx);
+  lua_State *L = func->conn->L;
+  /* no context when the group has no rows */
+  void *key = sqlite3_aggregate_context(ctx, 0);
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, func->states);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, fn);
+  if (key != NULL)
+    lua_rawgetp(L, -2, key);
+  else
+    lua_pushnil(L);
+  if (call_function(L, ctx, 1, 0, NULL))
+    {
+      set_result(L, ctx, -1);
+      lua_pop(L, 1);
+    }
+  if (done && key != NULL)
+    {
+      lua_pushnil(L);
+      lua_rawsetp(L, -2, key);
+    }
+  lua_pop(L, 1);
+}
+
+
+static void agg_step(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+  agg_update(ctx, ((func_data *)sqlite3_user_data(ctx))->fn, argc, argv);
+}
+
+
+static void agg_final(sqlite3_context *ctx)
+{
+  agg_result(ctx, ((func_data *)sqlite3_user_data(ctx))->final, 1);
+}
+
+
+#if SQLITE_VERSION_NUMBER >= 3025000
+static void agg_inverse(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+  agg_update(ctx, ((func_data *)sqlite3_user_data(ctx))->inverse, argc, argv);
+}
+
+
+static void agg_value(sqlite3_context *ctx)
+{
+  agg_result(ctx, ((func_data *)sqlite3_user_data(ctx))->value, 0);
+}
+#endif
+
+
+/*
+** Release a function when it is replaced or its connection is closed.
+*/
+static void func_destroy(void *data)
+{
+  func_data *func = (func_data *)data;
+  lua_State *L = func->conn->L;
+  luaL_unref(L, LUA_REGISTRYINDEX, func->fn);
+  luaL_unref(L, LUA_REGISTRYINDEX, func->final);
+  luaL_unref(L, LUA_REGISTRYINDEX, func->inverse);
+  luaL_unref(L, LUA_REGISTRYINDEX, func->value);
+  luaL_unref(L, LUA_REGISTRYINDEX, func->states);
+  free(func);
+}
+
+
+/*
+** Get the text representation flags of a function from the options table.
+*/
+static int function_flags(lua_State *L, int t)
+{
+  int flags = SQLITE_UTF8;
+  int deterministic = 1;
+  if (lua_istable(L, t))
+    {
+      deterministic = opt_boolean(L, t, "deterministic", 1);
+#ifdef SQLITE_DIRECTONLY
+      if (opt_boolean(L, t, "directonly", 0))
+        flags |= SQLITE_DIRECTONLY;
+      if (opt_boolean(L, t, "innocuous", 0))
+        flags |= SQLITE_INNOCUOUS;
+#endif
+    }
+  else if (!lua_isnoneornil(L, t))
+    luaL_argerror(L, t, LUASQL_PREFIX"table of flags expected");
+#ifdef SQLITE_DETERMINISTIC
+  if (deterministic)
+    flags |= SQLITE_DETERMINISTIC;
+#else
+  (void)deterministic;
+#endif
+  return flags;
+}
+
+
+/*
+** Register a Lua function as an SQL scalar function.
+** Lua Input: name, nargs, fn [, flags]
+**   nargs: number of arguments, -1 for any
+**   fn: the function, or nil to remove a previous one
+**   flags: table with the booleans deterministic (default), directonly
+**     and innocuous
+** Return true, or nil and an error message.
+*/
+static int conn_createfunction(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *name = luaL_checkstring(L, 2);
+  int nargs = (int)luaL_checkinteger(L, 3);
+  int flags = function_flags(L, 5);
+  func_data *func = NULL;
+  int res;
+
+  if (!lua_isnil(L, 4))
+    {
+      luaL_checktype(L, 4, LUA_TFUNCTION);
+      func = new_function(L, conn);
+      func->fn = ref_function(L, 4);
+    }
+
+  /* on failure, SQLite calls func_destroy itself */
+  res = sqlite3_create_function_v2(conn->sql_conn, name, nargs, flags, func,
+                                   func ? func_scalar : NULL, NULL, NULL,
+                                   func ? func_destroy : NULL);
+  if (res != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Register Lua functions as an SQL aggregate function, which is also
+** usable as a window function when inverse and value are given.
+** Lua Input: name, nargs, step, final [, inverse, value [, flags]]
+**   step(state, ...): returns the new state of the group, which is nil
+**     before the first row
+**   final(state): returns the result of the group
+**   inverse(state, ...): removes a row from the state of a window
+**   value(state): returns the current result of a window
+**   A nil step removes a previous function; flags are as in createfunction.
+** Return true, or nil and an error message.
+*/
+static int conn_createaggregate(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *name = luaL_checkstring(L, 2);
+  int nargs = (int)luaL_checkinteger(L, 3);
+  int window = !lua_isnoneornil(L, 6) || !lua_isnoneornil(L, 7);
+  int flags = function_flags(L, 8);
+  func_data *func = NULL;
+  int res;
+
+  if (!lua_isnil(L, 4))
+    {
+      luaL_checktype(L, 4, LUA_TFUNCTION);
+      luaL_checktype(L, 5, LUA_TFUNCTION);
+      if (window)
+        {
+          luaL_checktype(L, 6, LUA_TFUNCTION);
+          luaL_checktype(L, 7, LUA_TFUNCTION);
+        }
+#if SQLITE_VERSION_NUMBER < 3025000
+      luaL_argcheck(L, !window, 6, LUASQL_PREFIX"window functions are not supported");
+#endif
+      func = new_function(L, conn);
+      func->fn = ref_function(L, 4);
+      func->final = ref_function(L, 5);
+      func->inverse = ref_function(L, 6);
+      func->value = ref_function(L, 7);
+      lua_newtable(L);
+      func->states = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+  /* on failure, SQLite calls func_destroy itself */
+#if SQLITE_VERSION_NUMBER >= 3025000
+  res = sqlite3_create_window_function(conn->sql_conn, name, nargs, flags, func,
+                                       func ? agg_step : NULL,
+                                       func ? agg_final : NULL,
+                                       func && window ? agg_value : NULL,
+                                       func && window ? agg_inverse : NULL,
+                                       func ? func_destroy : NULL);
+#else
+  res = sqlite3_create_function_v2(conn->sql_conn, name, nargs, flags, func,
+                                   NULL, func ? agg_step : NULL,
+                                   func ? agg_final : NULL,
+                                   func ? func_destroy : NULL);
+#endif
+  if (res != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Open a BLOB for incremental I/O.
+** Lua Input: table, column, rowid [, writable [, dbname]]
+** Return a Blob object.
+*/
+static int conn_openblob(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *table = luaL_checkstring(L, 2);
+  const char *column = luaL_checkstring(L, 3);
+  sqlite3_int64 rowid = (sqlite3_int64)luaL_checkinteger(L, 4);
+  int writable = lua_toboolean(L, 5);
+  const char *dbname = luaL_optstring(L, 6, "main");
+  sqlite3_blob *handle;
+  blob_data *blob;
+
+  if (sqlite3_blob_open(conn->sql_conn, dbname, table, column, rowid,
+                        writable, &handle) != SQLITE_OK)
+    {
+      luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+      sqlite3_blob_close(handle);
+      return 2;
+    }
+
+  blob = (blob_data *)lua_newuserdata(L, sizeof(blob_data));
+  luasql_setmeta(L, LUASQL_BLOB_SQLITE);
+
+  /* increment blob count for the connection opening this blob */
+  conn->blob_counter++;
+
+  /* fill in structure */
+  blob->closed = 0;
+  blob->conn_data = conn;
+  blob->blob = handle;
+  blob->offset = 0;
+  blob->buffer = NULL;
+  blob->buffer_size = 0;
+  lua_pushvalue(L, 1);
+  blob->conn = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+
+/*
+** Set the maximum number of statements kept by the statement cache.
+** Zero disables the cache.
+*/
+static int conn_setcachesize(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  int size = (int)luaL_checkinteger(L, 2);
+  luaL_argcheck(L, size >= 0, 2, LUASQL_PREFIX"cache size must not be negative");
+  conn->cache_size = size;
+  cache_trim(conn, size);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Return a table with the statement cache counters.
+*/
+static int conn_getcachestats(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  lua_newtable(L);
+  lua_pushinteger(L, conn->cache_size);
+  lua_setfield(L, -2, "size");
+  lua_pushinteger(L, conn->cache_count);
+  lua_setfield(L, -2, "count");
+  lua_pushinteger(L, (lua_Integer)conn->cache_hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushinteger(L, (lua_Integer)conn->cache_misses);
+  lua_setfield(L, -2, "misses");
+  return 1;
+}
+
+
+/*
+** Set a field of the table on top of the stack to an integer.
+*/
+static void set_integer(lua_State *L, const char *name, sqlite3_int64 value)
+{
+  lua_pushinteger(L, (lua_Integer)value);
+  lua_setfield(L, -2, name);
+}
+
+
+/*
+** Set the fields of one sqlite3_db_status counter: the current value
+** as 'name' and, if given, the highest one as 'max'.
+*/
+static void db_status(lua_State *L, sqlite3 *db, int op, int reset,
+                      const char *name, const char *max)
+{
+  int cur = 0, hi = 0;
+  if (sqlite3_db_status(db, op, &cur, &hi, reset) != SQLITE_OK)
+    return;
+  if (name != NULL)
+    set_integer(L, name, cur);
+  if (max != NULL)
+    set_integer(L, max, hi);
+}
+
+
+/*
+** Set the fields of one counter of the whole process.
+*/
+static void process_status(lua_State *L, int op, int reset,
+                           const char *name, const char *max)
+{
+#if SQLITE_VERSION_NUMBER >= 3010000
+  sqlite3_int64 cur = 0, hi = 0;
+  if (sqlite3_status64(op, &cur, &hi, reset) != SQLITE_OK)
+    return;
+#else
+  int cur = 0, hi = 0;
+  if (sqlite3_status(op, &cur, &hi, reset) != SQLITE_OK)
+    return;
+#endif
+  if (name != NULL)
+    set_integer(L, name, cur);
+  if (max != NULL)
+    set_integer(L, max, hi);
+}
+
+
+/*
+** Push a table with the memory and page cache counters of the process.
+*/
+static void push_process_status(lua_State *L, int reset)
+{
+  lua_newtable(L);
+  process_status(L, SQLITE_STATUS_MEMORY_USED, reset,
+                 "memory_used", "memory_used_max");
+#ifdef SQLITE_STATUS_MALLOC_COUNT
+  process_status(L, SQLITE_STATUS_MALLOC_COUNT, reset,
+                 "malloc_count", "malloc_count_max");
+#endif
+  process_status(L, SQLITE_STATUS_MALLOC_SIZE, reset, NULL, "malloc_size_max");
+  process_status(L, SQLITE_STATUS_PAGECACHE_USED, reset,
+                 "pagecache_used", "pagecache_used_max");
+  process_status(L, SQLITE_STATUS_PAGECACHE_OVERFLOW, reset,
+                 "pagecache_overflow", "pagecache_overflow_max");
+  process_status(L, SQLITE_STATUS_PAGECACHE_SIZE, reset,
+                 NULL, "pagecache_size_max");
+}
+
+
+/*
+** Return the memory and page cache counters of the connection, with
+** the counters of the whole process in the field 'process'.
+** Lua Input: [reset]
+**   reset: reset the cache counters and the highest values
+*/
+static int conn_status(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  sqlite3 *db = conn->sql_conn;
+  int reset = lua_toboolean(L, 2);
+
+  lua_newtable(L);
+  db_status(L, db, SQLITE_DBSTATUS_CACHE_USED, 0, "cache_used", NULL);
+#ifdef SQLITE_DBSTATUS_CACHE_USED_SHARED
+  db_status(L, db, SQLITE_DBSTATUS_CACHE_USED_SHARED, 0, "cache_used_shared", NULL);
+#endif
+#ifdef SQLITE_DBSTATUS_CACHE_HIT
+  db_status(L, db, SQLITE_DBSTATUS_CACHE_HIT, reset, "cache_hits", NULL);
+  db_status(L, db, SQLITE_DBSTATUS_CACHE_MISS, reset, "cache_misses", NULL);
+#endif
+#ifdef SQLITE_DBSTATUS_CACHE_WRITE
+  db_status(L, db, SQLITE_DBSTATUS_CACHE_WRITE, reset, "cache_writes", NULL);
+#endif
+#ifdef SQLITE_DBSTATUS_CACHE_SPILL
+  db_status(L, db, SQLITE_DBSTATUS_CACHE_SPILL, reset, "cache_spills", NULL);
+#endif
+  db_status(L, db, SQLITE_DBSTATUS_SCHEMA_USED, 0, "schema_used", NULL);
+  db_status(L, db, SQLITE_DBSTATUS_STMT_USED, 0, "stmt_used", NULL);
+  db_status(L, db, SQLITE_DBSTATUS_LOOKASIDE_USED, reset,
+            "lookaside_used", "lookaside_used_max");
+#ifdef SQLITE_DBSTATUS_LOOKASIDE_HIT
+  db_status(L, db, SQLITE_DBSTATUS_LOOKASIDE_HIT, reset, NULL, "lookaside_hits");
+  db_status(L, db, SQLITE_DBSTATUS_LOOKASIDE_MISS_SIZE, reset,
+            NULL, "lookaside_misses_size");
+  db_status(L, db, SQLITE_DBSTATUS_LOOKASIDE_MISS_FULL, reset,
+            NULL, "lookaside_misses_full");
+#endif
+#ifdef SQLITE_DBSTATUS_DEFERRED_FKS
+  db_status(L, db, SQLITE_DBSTATUS_DEFERRED_FKS, 0, "deferred_fks", NULL);
+#endif
+
+  if (conn->ckpt != NULL)
+    {
+      mutex_lock(&conn->ckpt->lock);
+      set_integer(L, "wal_frames", conn->ckpt->wal_frames);
+      lua_pushnumber(L, conn->ckpt->checkpoints);
+      lua_setfield(L, -2, "checkpoints");
+      lua_pushnumber(L, conn->ckpt->failures);
+      lua_setfield(L, -2, "checkpoint_failures");
+      mutex_unlock(&conn->ckpt->lock);
+    }
+
+  push_process_status(L, reset);
+  lua_setfield(L, -2, "process");
+  return 1;
+}
+
+
+/*
+** Copy the frames of the WAL back into the database.
+** Lua Input: [mode [, dbname]]
+**   mode: "PASSIVE" (default), "FULL", "RESTART" or "TRUNCATE"
+**   dbname: the attached database, all of them by default
+** Return the number of frames in the WAL and of those checkpointed, or
+** nil and an error message.
+*/
+static int conn_checkpoint(lua_State *L)
+{
+  static const char *const names[] = {"PASSIVE", "FULL", "RESTART",
+#ifdef SQLITE_CHECKPOINT_TRUNCATE
+                                      "TRUNCATE",
+#endif
+                                      NULL};
+  static const int modes[] = {SQLITE_CHECKPOINT_PASSIVE, SQLITE_CHECKPOINT_FULL,
+#ifdef SQLITE_CHECKPOINT_TRUNCATE
+                              SQLITE_CHECKPOINT_RESTART, SQLITE_CHECKPOINT_TRUNCATE};
+#else
+                              SQLITE_CHECKPOINT_RESTART};
+#endif
+  conn_data *conn = getconnection(L);
+  const char *name = luaL_optstring(L, 2, "PASSIVE");
+  const char *dbname = luaL_optstring(L, 3, NULL);
+  int mode, res, log = 0, done = 0;
+
+  for (mode = 0; names[mode] != NULL; mode++)
+    if (sqlite3_stricmp(name, names[mode]) == 0)
+      break;
+  luaL_argcheck(L, names[mode] != NULL, 2,
+                lua_pushfstring(L, LUASQL_PREFIX"invalid mode '%s'", name));
+  res = sqlite3_wal_checkpoint_v2(conn->sql_conn, dbname, modes[mode], &log, &done);
+  if (res != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  lua_pushinteger(L, log);
+  lua_pushinteger(L, done);
+  return 2;
+}
+
+
+/*
+** Run the checkpoints of the connection in a background thread, in
+** place of the automatic checkpoints of the commits.
+** Lua Input: [interval [, frames]]
+**   interval: milliseconds between two checkpoints; zero or nil stops the
+**     thread and restores the automatic checkpoints
+**   frames: size of the WAL, in pages, which starts a checkpoint right
+**     away (1000 by default)
+** Return true, or nil and an error message.
+*/
+static int conn_setcheckpointer(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  lua_Integer interval = luaL_optinteger(L, 2, 0);
+  lua_Integer frames = luaL_optinteger(L, 3, 1000);
+  const char *path;
+  checkpointer *ck;
+  sqlite3_stmt *vm;
+  const char *errmsg;
+  int res;
+
+  luaL_argcheck(L, interval >= 0 && interval <= INT_MAX, 2,
+                LUASQL_PREFIX"interval out of range");
+  luaL_argcheck(L, frames > 0 && frames <= INT_MAX, 3,
+                LUASQL_PREFIX"frames out of range");
+  checkpointer_stop(conn);
+  if (interval == 0)
+    {
+      lua_pushboolean(L, 1);
+      return 1;
+    }
+  errmsg = mem_check(L, 1);
+  if (errmsg != NULL)
+    return luasql_faildirect(L, errmsg);
+  path = sqlite3_db_filename(conn->sql_conn, "main");
+  if (path == NULL || *path == '\0')
+    return luasql_faildirect(L, "checkpoints need a database file");
+
+  ck = (checkpointer *)calloc(1, sizeof(checkpointer));
+  if (ck == NULL)
+    return luaL_error(L, LUASQL_PREFIX"not enough memory");
+  ck->interval = (int)interval;
+  ck->frames = (int)frames;
+  /* the automatic checkpoints come back when the thread stops */
+  ck->auto_frames = LUASQL_SQLITE_AUTO_FRAMES;
+  if (prepare_vm(conn, "PRAGMA wal_autocheckpoint", 0, &vm) == SQLITE_OK)
+    {
+      if (sqlite3_step(vm) == SQLITE_ROW)
+        ck->auto_frames = sqlite3_column_int(vm, 0);
+      sqlite3_finalize(vm);
+    }
+  res = sqlite3_open_v2(path, &ck->db, SQLITE_OPEN_READWRITE, NULL);
+  if (res != SQLITE_OK)
+    {
+      luasql_faildirect(L, sqlite3_errmsg(ck->db));
+      sqlite3_close(ck->db);
+      free(ck);
+      return 2;
+    }
+  mutex_init(&ck->lock);
+  cond_init(&ck->wake);
+  if (!thread_start(&ck->thread, checkpointer_main, ck))
+    {
+      sqlite3_close(ck->db);
+      mutex_destroy(&ck->lock);
+      cond_destroy(&ck->wake);
+      free(ck);
+      return luasql_faildirect(L, "could not start checkpointer thread");
+    }
+  conn->ckpt = ck;
+  /* this also turns off the automatic checkpoints */
+  sqlite3_wal_hook(conn->sql_conn, checkpointer_hook, ck);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Set the time limit of each call on the connection, in milliseconds.
+** Zero or nil removes it.
+*/
+static int conn_setquerytimeout(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  lua_Integer ms = luaL_optinteger(L, 2, 0);
+  luaL_argcheck(L, ms >= 0 && ms <= INT_MAX, 2,
+                LUASQL_PREFIX"timeout out of range");
+  conn->query_timeout = (int)ms;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Set a deadline, in milliseconds from now, shared by all the following
+** calls on the connection until it is changed.
+** Nil removes it.
+*/
+static int conn_setdeadline(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  if (lua_isnoneornil(L, 2))
+    conn->deadline = 0;
+  else
+    {
+      lua_Integer ms = luaL_checkinteger(L, 2);
+      luaL_argcheck(L, ms >= 0, 2, LUASQL_PREFIX"deadline must not be negative");
+      conn->deadline = clock_ms() + ms;
+      if (conn->deadline == 0)
+        conn->deadline = 1;
+    }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Make the calls on the connection yield the running coroutine after
+** 'ops' VM instructions or 'ms' milliseconds; no arguments turn it off.
+*/
+static int conn_setyield(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  lua_Integer ops = luaL_optinteger(L, 2, 0);
+  lua_Integer ms = luaL_optinteger(L, 3, 0);
+  luaL_argcheck(L, ops >= 0 && ops <= INT_MAX, 2,
+                LUASQL_PREFIX"instruction count out of range");
+  luaL_argcheck(L, ms >= 0 && ms <= INT_MAX, 3,
+                LUASQL_PREFIX"interval out of range");
+#if LUA_VERSION_NUM >= 503
+  conn->yield_ops = (int)ops;
+  conn->yield_ms = (int)ms;
+  conn->yield_due = 0;
+  conn->yield_run = 0;
+  conn->yield_last = clock_ms();
+  start_call(conn);
+  lua_pushboolean(L, 1);
+  return 1;
+#else
+  if (ops == 0 && ms == 0)
+    {
+      lua_pushboolean(L, 1);
+      return 1;
+    }
+  return luasql_faildirect(L, "yielding needs Lua 5.3 or later");
+#endif
+}
+
+
+/*
+** Set the function called with the counters of each statement whose run
+** is over, or remove it with nil.
+*/
+static int conn_onstats(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  if (!lua_isnoneornil(L, 2))
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+  lua_settop(L, 2);
+  luaL_unref(L, LUA_REGISTRYINDEX, conn->onstats);
+  conn->onstats = lua_isnil(L, 2) ? LUA_NOREF : luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Set the function called with the rows changed by each committed
+** transaction, or remove it with nil.
+*/
+static int conn_onchange(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  sqlite3 *db = conn->sql_conn;
+  if (!lua_isnoneornil(L, 2))
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+  lua_settop(L, 2);
+  luaL_unref(L, LUA_REGISTRYINDEX, conn->onchange);
+  if (lua_isnil(L, 2))
+    {
+      conn->onchange = LUA_NOREF;
+      sqlite3_update_hook(db, NULL, NULL);
+      sqlite3_commit_hook(db, NULL, NULL);
+      sqlite3_rollback_hook(db, NULL, NULL);
+      change_free(&conn->changes);
+    }
+  else
+    {
+      conn->onchange = luaL_ref(L, LUA_REGISTRYINDEX);
+      sqlite3_update_hook(db, change_hook, conn);
+      sqlite3_commit_hook(db, commit_hook, conn);
+      sqlite3_rollback_hook(db, rollback_hook, conn);
+    }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Interrupt the statements running on the connection, e.g. from a
+** function called by SQL; open cursors fail on their next fetch.
+*/
+static int conn_interrupt(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  sqlite3_interrupt(conn->sql_conn);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Set "auto commit" property of the connection.
+** If 'true', then rollback current transaction.
+** If 'false', then start a new transaction.
+*/
+static int conn_setautocommit(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  if (lua_toboolean(L, 2))
+    {
+      conn->auto_commit = 1;
+      /* undo active transaction - ignore errors */
+      (void) run_txn(conn, LUASQL_TXN_ROLLBACK);
+    }
+  else
+    {
+      conn->auto_commit = 0;
+      if (run_txn(conn, LUASQL_TXN_BEGIN) != SQLITE_OK)
+        return luaL_error(L, LUASQL_PREFIX"%s", sqlite3_errmsg(conn->sql_conn));
+    }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Read the next chunk of a blob, at most 'n' bytes (all remaining bytes
+** by default), through the blob buffer.
+** Return the chunk, or nil at the end of the blob.
+*/
+static int blob_read(lua_State *L)
+{
+  blob_data *blob = getblob(L);
+  int size = sqlite3_blob_bytes(blob->blob);
+  lua_Integer want = luaL_optinteger(L, 2, size - blob->offset);
+  int n;
+
+  luaL_argcheck(L, want >= 0, 2, LUASQL_PREFIX"invalid number of bytes");
+  /* no blob is larger than INT_MAX bytes */
+  n = want > INT_MAX ? INT_MAX : (int)want;
+  if (blob->offset >= size)
+    {
+      lua_pushnil(L);
+      return 1;
+    }
+  if (n > size - blob->offset)
+    n = size - blob->offset;
+  if (n > blob->buffer_size)
+    {
+      char *buffer = (char *)realloc(blob->buffer, n);
+      if (buffer == NULL)
+        return luaL_error(L, LUASQL_PREFIX"not enough memory");
+      blob->buffer = buffer;
+      blob->buffer_size = n;
+    }
+  if (sqlite3_blob_read(blob->blob, blob->buffer, n, blob->offset) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(blob->conn_data->sql_conn));
+  blob->offset += n;
+  lua_pushlstring(L, blob->buffer, n);
+  return 1;
+}
+
+
+/*
+** Write a string into a blob at the current position, or at the given one.
+** A blob can not change its size.
+*/
+static int blob_write(lua_State *L)
+{
+  blob_data *blob = getblob(L);
+  size_t len;
+  const char *data = luaL_checklstring(L, 2, &len);
+  lua_Integer offset = luaL_optinteger(L, 3, blob->offset);
+
+  luaL_argcheck(L, offset >= 0 && offset <= INT_MAX, 3, LUASQL_PREFIX"invalid offset");
+  luaL_argcheck(L, len <= (size_t)(INT_MAX - offset), 2, LUASQL_PREFIX"data too large");
+  if (sqlite3_blob_write(blob->blob, data, (int)len, (int)offset) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(blob->conn_data->sql_conn));
+  blob->offset = (int)offset + (int)len;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Set the position of the next read or write, if given.
+** Return the current position.
+*/
+static int blob_seek(lua_State *L)
+{
+  blob_data *blob = getblob(L);
+  if (!lua_isnoneornil(L, 2))
+    {
+      lua_Integer offset = luaL_checkinteger(L, 2);
+      luaL_argcheck(L, offset >= 0 && offset <= sqlite3_blob_bytes(blob->blob),
+                    2, LUASQL_PREFIX"invalid offset");
+      blob->offset = (int)offset;
+    }
+  lua_pushinteger(L, blob->offset);
+  return 1;
+}
+
+
+/*
+** Return the size of a blob in bytes.
+*/
+static int blob_size(lua_State *L)
+{
+  blob_data *blob = getblob(L);
+  lua_pushinteger(L, sqlite3_blob_bytes(blob->blob));
+  return 1;
+}
+
+
+/*
+** Point a blob to the same column of another row, and rewind it.
+*/
+static int blob_reopen(lua_State *L)
+{
+  blob_data *blob = getblob(L);
+  sqlite3_int64 rowid = (sqlite3_int64)luaL_checkinteger(L, 2);
+  if (sqlite3_blob_reopen(blob->blob, rowid) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(blob->conn_data->sql_conn));
+  blob->offset = 0;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Blob object collector function
+*/
+static int blob_gc(lua_State *L)
+{
+  blob_data *blob = (blob_data *)luaL_checkudata(L, 1, LUASQL_BLOB_SQLITE);
+  if (blob != NULL && !(blob->closed))
+    {
+      /* Nullify structure fields. */
+      blob->closed = 1;
+      sqlite3_blob_close(blob->blob);
+      blob->blob = NULL;
+      free(blob->buffer);
+      blob->buffer = NULL;
+      blob->conn_data->blob_counter--;
+      luaL_unref(L, LUA_REGISTRYINDEX, blob->conn);
+    }
+  return 0;
+}
+
+
+/*
+** Close a Blob object.
+*/
+static int blob_close(lua_State *L)
+{
+  blob_data *blob = (blob_data *)luaL_checkudata(L, 1, LUASQL_BLOB_SQLITE);
+  luaL_argcheck(L, blob != NULL, 1, LUASQL_PREFIX"blob expected");
+  if (blob->closed)
+    {
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+  blob_gc(L);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Get the database at the given index: a connection, or the path of a
+** database that is opened with the given flags and must be closed by
+** the caller. On failure, push nil and an error message.
+*/
+static sqlite3 *backup_peer(lua_State *L, int arg, int flags,
+                            conn_data **peer, sqlite3 **owned)
+{
+  *peer = NULL;
+  *owned = NULL;
+  if (lua_type(L, arg) == LUA_TSTRING)
+    {
+      if (sqlite3_open_v2(lua_tostring(L, arg), owned, flags, NULL) != SQLITE_OK)
+        {
+          luasql_faildirect(L, sqlite3_errmsg(*owned));
+          sqlite3_close(*owned);
+          *owned = NULL;
+          return NULL;
+        }
+      return *owned;
+    }
+  *peer = (conn_data *)luaL_checkudata(L, arg, LUASQL_CONNECTION_SQLITE);
+  luaL_argcheck(L, !(*peer)->closed, arg, LUASQL_PREFIX"connection is closed");
+  return (*peer)->sql_conn;
+}
+
+
+/*
+** Start an online backup of the connection to another database, copied
+** a number of pages at a time by the returned Backup object while the
+** source stays usable between the steps.
+** Lua Input: dest [, pages [, name [, destname]]]
+**   dest: connection or path of the destination database
+**   pages: pages copied by each step, all of them by default (-1)
+**   name, destname: names of the databases, "main" by default
+** Return a Backup object, or nil and an error message.
+*/
+static int conn_backup(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  int pages = (int)luaL_optinteger(L, 3, -1);
+  const char *name = luaL_optstring(L, 4, "main");
+  const char *destname = luaL_optstring(L, 5, "main");
+  conn_data *dest;
+  sqlite3 *owned, *db;
+  sqlite3_backup *handle;
+  backup_data *bk;
+
+  db = backup_peer(L, 2, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, &dest, &owned);
+  if (db == NULL)
+    return 2;
+  luaL_argcheck(L, db != conn->sql_conn, 2, LUASQL_PREFIX"can not back up a connection to itself");
+  handle = sqlite3_backup_init(db, destname, conn->sql_conn, name);
+  if (handle == NULL)
+    {
+      luasql_faildirect(L, sqlite3_errmsg(db));
+      sqlite3_close(owned);
+      return 2;
+    }
+
+  bk = (backup_data *)lua_newuserdata(L, sizeof(backup_data));
+  luasql_setmeta(L, LUASQL_BACKUP_SQLITE);
+
+  /* both connections stay open while the backup is */
+  conn->backup_counter++;
+  if (dest != NULL)
+    dest->backup_counter++;
+
+  /* fill in structure */
+  bk->closed = 0;
+  bk->src_data = conn;
+  bk->dest_data = dest;
+  bk->owned = owned;
+  bk->backup = handle;
+  bk->pages = pages;
+  lua_pushvalue(L, 1);
+  bk->src = luaL_ref(L, LUA_REGISTRYINDEX);
+  bk->dest = LUA_NOREF;
+  if (dest != NULL)
+    {
+      lua_pushvalue(L, 2);
+      bk->dest = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+  return 1;
+}
+
+
+/*
+** Replace the content of the connection with a copy of another database,
+** e.g. to load a file into an in-memory database.
+** Lua Input: source [, name [, srcname]]
+**   source: connection or path of the source database
+**   name, srcname: names of the databases, "main" by default
+** Return true, or nil and an error message.
+*/
+static int conn_restore(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *name = luaL_optstring(L, 3, "main");
+  const char *srcname = luaL_optstring(L, 4, "main");
+  conn_data *src;
+  sqlite3 *owned, *db;
+  sqlite3_backup *handle;
+  int rc, step;
+
+  db = backup_peer(L, 2, SQLITE_OPEN_READONLY, &src, &owned);
+  if (db == NULL)
+    return 2;
+  luaL_argcheck(L, db != conn->sql_conn, 2, LUASQL_PREFIX"can not restore a connection from itself");
+  handle = sqlite3_backup_init(conn->sql_conn, name, db, srcname);
+  if (handle == NULL)
+    {
+      luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+      sqlite3_close(owned);
+      return 2;
+    }
+  /* finish reports SQLITE_OK after a busy or locked step */
+  step = sqlite3_backup_step(handle, -1);
+  rc = sqlite3_backup_finish(handle);
+  sqlite3_close(owned);
+  if (step != SQLITE_DONE)
+    return luasql_faildirect(L, sqlite3_errstr(step));
+  if (rc != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Copy the next pages of a backup.
+** Lua Input: [pages]
+**   pages: number of pages to copy, the default of the backup if absent
+** Return true when the backup is complete, false if there are pages left
+** (also when the databases are busy: try again later), or nil and an
+** error message.
+*/
+static int backup_step(lua_State *L)
+{
+  backup_data *bk = getbackup(L);
+  int pages = (int)luaL_optinteger(L, 2, bk->pages);
+  int rc = sqlite3_backup_step(bk->backup, pages);
+
+  switch (rc) {
+    case SQLITE_DONE:
+      lua_pushboolean(L, 1);
+      return 1;
+    case SQLITE_OK:
+    case SQLITE_BUSY:
+    case SQLITE_LOCKED:
+      lua_pushboolean(L, 0);
+      return 1;
+    default:
+      return luasql_faildirect(L, sqlite3_errstr(rc));
+  }
+}
+
+
+/*
+** Return the number of pages still to be copied, as of the last step.
+*/
+static int backup_remaining(lua_State *L)
+{
+  backup_data *bk = getbackup(L);
+  lua_pushinteger(L, sqlite3_backup_remaining(bk->backup));
+  return 1;
+}
+
+
+/*
+** Return the number of pages of the source, as of the last step.
+*/
+static int backup_pagecount(lua_State *L)
+{
+  backup_data *bk = getbackup(L);
+  lua_pushinteger(L, sqlite3_backup_pagecount(bk->backup));
+  return 1;
+}
+
+
+/*
+** Release the backup, closing the destination if it was given by path.
+** Return the result code of sqlite3_backup_finish.
+*/
+static int backup_release(lua_State *L, backup_data *bk)
+{
+  int rc;
+  bk->closed = 1;
+  rc = sqlite3_backup_finish(bk->backup);
+  bk->backup = NULL;
+  sqlite3_close(bk->owned);
+  bk->owned = NULL;
+  bk->src_data->backup_counter--;
+  if (bk->dest_data != NULL)
+    bk->dest_data->backup_counter--;
+  luaL_unref(L, LUA_REGISTRYINDEX, bk->src);
+  luaL_unref(L, LUA_REGISTRYINDEX, bk->dest);
+  return rc;
+}
+
+
+/*
+** Backup object collector function
+*/
+static int backup_gc(lua_State *L)
+{
+  backup_data *bk = (backup_data *)luaL_checkudata(L, 1, LUASQL_BACKUP_SQLITE);
+  if (bk != NULL && !(bk->closed))
+    backup_release(L, bk);
+  return 0;
+}
+
+
+/*
+** Finish a backup, whether it is complete or not.
+** Return true, or nil and an error message if the backup failed.
+*/
+static int backup_finish(lua_State *L)
+{
+  backup_data *bk = (backup_data *)luaL_checkudata(L, 1, LUASQL_BACKUP_SQLITE);
+  int rc;
+  luaL_argcheck(L, bk != NULL, 1, LUASQL_PREFIX"backup expected");
+  if (bk->closed)
+    {
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+  rc = backup_release(L, bk);
+  if (rc != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errstr(rc));
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+#ifdef LUASQL_SQLITE_CARRAY
+/*
+** Size of the elements of an array.
+*/
+static size_t array_elemsize(int type)
+{
+  switch (type) {
+    case ARRAY_INT32: return sizeof(int);
+    case ARRAY_INT64: return sizeof(sqlite3_int64);
+    case ARRAY_DOUBLE: return sizeof(double);
+    default: return sizeof(array_text);
+  }
+}
+
+
+/*
+** Push a new array with room for count values and 'extra' bytes of text.
+*/
+static array_data *new_array(lua_State *L, int type, int count, size_t extra)
+{
+  size_t size = sizeof(array_data) + (size_t)count * array_elemsize(type) + extra;
+  array_data *arr = (array_data *)lua_newuserdata(L, size);
+  luasql_setmeta(L, LUASQL_ARRAY_SQLITE);
+  arr->type = type;
+  arr->count = count;
+  arr->values = arr + 1;
+  return arr;
+}
+
+
+/*
+** Create an array from a string with packed native values.
+*/
+static int array_packed(lua_State *L, int type)
+{
+  size_t len;
+  const char *data = lua_tolstring(L, 2, &len);
+  size_t elemsize = array_elemsize(type);
+  array_data *arr;
+
+  luaL_argcheck(L, type != ARRAY_TEXT, 3, LUASQL_PREFIX"numeric type expected for packed values");
+  luaL_argcheck(L, len % elemsize == 0 && len / elemsize <= INT_MAX, 2,
+                LUASQL_PREFIX"invalid size of packed values");
+  arr = new_array(L, type, (int)(len / elemsize), 0);
+  memcpy(arr->values, data, len);
+  return 1;
+}
+
+
+/*
+** Create an array from the sequence of values in a table.
+*/
+static int array_table(lua_State *L, int type)
+{
+  lua_Integer n = (lua_Integer)lua_rawlen(L, 2), i;
+  size_t extra = 0;
+  array_data *arr;
+  char *text;
+
+  luaL_argcheck(L, n <= INT_MAX, 2, LUASQL_PREFIX"too many values");
+  /* check the values and find out their type, given by the first one */
+  if (type == -1 && n > 0 && lua_rawgeti(L, 2, 1) == LUA_TSTRING)
+    type = ARRAY_TEXT;
+  lua_settop(L, 3);
+  for (i = 1; i <= n; i++)
+    {
+      int tt;
+      lua_rawgeti(L, 2, i);
+      tt = lua_type(L, -1);
+      if (tt == LUA_TSTRING && type == ARRAY_TEXT)
+        {
+          extra += lua_rawlen(L, -1) + 1;
+        }
+      else if (tt == LUA_TNUMBER && type == -1)
+        {
+          if (!lua_isinteger(L, -1))
+            type = ARRAY_DOUBLE;
+        }
+      else if (tt == LUA_TNUMBER && type == ARRAY_DOUBLE)
+        ;
+      else if (tt == LUA_TNUMBER && type != ARRAY_TEXT && lua_isinteger(L, -1) &&
+               (type == ARRAY_INT64 || (lua_tointeger(L, -1) >= INT_MIN &&
+                                        lua_tointeger(L, -1) <= INT_MAX)))
+        ;
+      else
+        return luaL_error(L, LUASQL_PREFIX"invalid value at index %d of array", (int)i);
+      lua_pop(L, 1);
+    }
+  if (type == -1)
+    type = ARRAY_INT64;
+
+  arr = new_array(L, type, (int)n, extra);
+  text = (char *)arr->values + n * array_elemsize(type);
+  for (i = 0; i < n; i++)
+    {
+      lua_rawgeti(L, 2, i + 1);
+      switch (type) {
+        case ARRAY_INT32:
+          ((int *)arr->values)[i] = (int)lua_tointeger(L, -1);
+          break;
+        case ARRAY_INT64:
+          ((sqlite3_int64 *)arr->values)[i] = (sqlite3_int64)lua_tointeger(L, -1);
+          break;
+        case ARRAY_DOUBLE:
+          ((double *)arr->values)[i] = lua_tonumber(L, -1);
+          break;
+        default: {
+          size_t len;
+          const char *s = lua_tolstring(L, -1, &len);
+          array_text *t = &((array_text *)arr->values)[i];
+          memcpy(text, s, len + 1);
+          t->s = text;
+          t->len = (int)len;
+          text += len + 1;
+        }
+      }
+      lua_pop(L, 1);
+    }
+  return 1;
+}
+
+
+/*
+** Create an array to be bound as a single parameter and read in SQL
+** through the carray() table-valued function, e.g. "x IN carray(?)".
+** Lua Input: values [, type]
+**   values: a sequence of numbers or strings, or a string of packed
+**     native values
+**   type: "int32", "int64", "double" or "text"; guessed from a sequence,
+**     required for packed values
+** Return an array.
+*/
+static int conn_array(lua_State *L)
+{
+  static const char *const types[] = {"int32", "int64", "double", "text", NULL};
+  int type;
+
+  getconnection(L);
+  if (lua_type(L, 2) == LUA_TSTRING)
+    return array_packed(L, luaL_checkoption(L, 3, NULL, types));
+  luaL_checktype(L, 2, LUA_TTABLE);
+  type = lua_isnoneornil(L, 3) ? -1 : luaL_checkoption(L, 3, NULL, types);
+  return array_table(L, type);
+}
+#endif
+
+
+/*
+** Return the number of values of an array.
+*/
+static int array_len(lua_State *L)
+{
+  array_data *arr = (array_data *)luaL_checkudata(L, 1, LUASQL_ARRAY_SQLITE);
+  lua_pushinteger(L, arr->count);
+  return 1;
+}
+
+
+#ifdef LUASQL_SQLITE_CARRAY
+/*
+** The carray() eponymous virtual table: "SELECT value FROM carray(?)"
+** returns one row for each value of the array bound to the parameter.
+*/
+typedef struct
+{
+  sqlite3_vtab_cursor base;
+  array_data  *arr;
+  sqlite3_int64 i;
+} carray_cursor;
+
+#define CARRAY_COLUMN_VALUE   0
+#define CARRAY_COLUMN_POINTER 1
+
+
+static int carray_connect(sqlite3 *db, void *aux, int argc,
+                          const char *const *argv, sqlite3_vtab **vtab, char **err)
+{
+  int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(value, pointer hidden)");
+  (void)aux; (void)argc; (void)argv; (void)err;
+  if (rc != SQLITE_OK)
+    return rc;
+  *vtab = (sqlite3_vtab *)sqlite3_malloc(sizeof(sqlite3_vtab));
+  if (*vtab == NULL)
+    return SQLITE_NOMEM;
+  memset(*vtab, 0, sizeof(sqlite3_vtab));
+  return SQLITE_OK;
+}
+
+
+static int carray_disconnect(sqlite3_vtab *vtab)
+{
+  sqlite3_free(vtab);
+  return SQLITE_OK;
+}
+
+
+/*
+** Only the plan with the array bound to the hidden column is useful;
+** without it the table is empty.
+*/
+static int carray_bestindex(sqlite3_vtab *vtab, sqlite3_index_info *info)
+{
+  int i;
+  (void)vtab;
+  for (i = 0; i < info->nConstraint; i++)
+    {
+      const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+      if (c->usable && c->iColumn == CARRAY_COLUMN_POINTER &&
+          c->op == SQLITE_INDEX_CONSTRAINT_EQ)
+        {
+          info->aConstraintUsage[i].argvIndex = 1;
+          info->aConstraintUsage[i].omit = 1;
+          info->estimatedCost = 1;
+          info->idxNum = 1;
+          return SQLITE_OK;
+        }
+    }
+  info->estimatedCost = 2147483647;
+  info->idxNum = 0;
+  return SQLITE_OK;
+}
+
+
+static int carray_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor)
+{
+  carray_cursor *cur = (carray_cursor *)sqlite3_malloc(sizeof(carray_cursor));
+  (void)vtab;
+  if (cur == NULL)
+    return SQLITE_NOMEM;
+  memset(cur, 0, sizeof(carray_cursor));
+  *cursor = &cur->base;
+  return SQLITE_OK;
+}
+
+
+static int carray_close(sqlite3_vtab_cursor *cursor)
+{
+  sqlite3_free(cursor);
+  return SQLITE_OK;
+}
+
+
+static int carray_filter(sqlite3_vtab_cursor *cursor, int idxnum, const char *idxstr,
+                         int argc, sqlite3_value **argv)
+{
+  carray_cursor *cur = (carray_cursor *)cursor;
+  (void)idxstr;
+  cur->arr = NULL;
+  if (idxnum == 1 && argc == 1)
+    cur->arr = (array_data *)sqlite3_value_pointer(argv[0], "carray");
+  cur->i = 0;
+  return SQLITE_OK;
+}
+
+
+static int carray_next(sqlite3_vtab_cursor *cursor)
+{
+  ((carray_cursor *)cursor)->i++;
+  return SQLITE_OK;
+}
+
+
+static int carray_eof(sqlite3_vtab_cursor *cursor)
+{
+  carray_cursor *cur = (carray_cursor *)cursor;
+  return cur->arr == NULL || cur->i >= cur->arr->count;
+}
+
+
+static int carray_column(sqlite3_vtab_cursor *cursor, sqlite3_context *ctx, int column)
+{
+  carray_cursor *cur = (carray_cursor *)cursor;
+  array_data *arr = cur->arr;
+  if (column != CARRAY_COLUMN_VALUE)
+    return SQLITE_OK;
+  switch (arr->type) {
+    case ARRAY_INT32:
+      sqlite3_result_int(ctx, ((int *)arr->values)[cur->i]);
+      break;
+    case ARRAY_INT64:
+      sqlite3_result_int64(ctx, ((sqlite3_int64 *)arr->values)[cur->i]);
+      break;
+    case ARRAY_DOUBLE:
+      sqlite3_result_double(ctx, ((double *)arr->values)[cur->i]);
+      break;
+    default: {
+      array_text *t = &((array_text *)arr->values)[cur->i];
+      sqlite3_result_text(ctx, t->s, t->len, SQLITE_STATIC);
+    }
+  }
+  return SQLITE_OK;
+}
+
+
+static int carray_rowid(sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid)
+{
+  *rowid = ((carray_cursor *)cursor)->i + 1;
+  return SQLITE_OK;
+}
+
+
+/* no xCreate: the table is eponymous only */
+static sqlite3_module carray_module = {
+  .xConnect = carray_connect,
+  .xBestIndex = carray_bestindex,
+  .xDisconnect = carray_disconnect,
+  .xOpen = carray_open,
+  .xClose = carray_close,
+  .xFilter = carray_filter,
+  .xNext = carray_next,
+  .xEof = carray_eof,
+  .xColumn = carray_column,
+  .xRowid = carray_rowid,
+};
+#endif
+
+
+/*
+** Virtual tables reading from Lua tables, given either as a list of rows
+** (each one keyed by column name or by position) or as a table of columns
+** (each one a list of values, keyed by column name).
+*/
+typedef struct
+{
+  conn_data   *conn;              /* connection running the callbacks */
+  int         columns;            /* reference to the list of column names */
+  int         ncols;
+  int         source;             /* reference to the source table */
+  short       columnar;           /* source is a table of columns */
+  char        *schema;            /* declaration of the table */
+} vtab_data;
+
+typedef struct
+{
+  sqlite3_vtab base;
+  vtab_data   *data;
+} lua_vtab;
+
+typedef struct
+{
+  sqlite3_vtab_cursor base;
+  vtab_data   *data;
+  int         indexes;            /* reference to the column indexes built */
+  int         rowids;             /* reference to the rowids of a lookup */
+  lua_Integer i, last;            /* current and last row, or lookup entry */
+} lua_vtab_cursor;
+
+/* plans of xBestIndex: full scan, rowid lookup, column lookup (+ column) */
+#define VTAB_SCAN   0
+#define VTAB_ROWID  1
+#define VTAB_COLUMN 2
+
+
+/*
+** Return the number of rows of the source.
+*/
+static lua_Integer vtab_count(lua_State *L, vtab_data *data)
+{
+  lua_Integer n;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, data->source);
+  if (data->columnar)
+    {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, data->columns);
+      lua_rawgeti(L, -1, 1);
+      lua_rawget(L, -3);
+      n = lua_istable(L, -1) ? (lua_Integer)lua_rawlen(L, -1) : 0;
+      lua_pop(L, 3);
+    }
+  else
+    {
+      n = (lua_Integer)lua_rawlen(L, -1);
+      lua_pop(L, 1);
+    }
+  return n;
+}
+
+
+/*
+** Push the value of a column (0 based) in a row (1 based) of the source.
+*/
+static void vtab_push(lua_State *L, vtab_data *data, lua_Integer row, int column)
+{
+  lua_rawgeti(L, LUA_REGISTRYINDEX, data->source);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, data->columns);
+  lua_rawgeti(L, -1, column + 1);         /* source, columns, name */
+  if (data->columnar)
+    {
+      lua_rawget(L, -3);
+      if (lua_istable(L, -1))
+        lua_rawgeti(L, -1, row);
+      else
+        lua_pushnil(L);
+    }
+  else
+    {
+      lua_rawgeti(L, -3, row);
+      if (lua_istable(L, -1))
+        {
+          lua_insert(L, -2);
+          lua_rawget(L, -2);                /* row[name] */
+          if (lua_isnil(L, -1))
+            {
+              lua_pop(L, 1);
+              lua_rawgeti(L, -1, column + 1); /* row[position] */
+            }
+        }
+      else
+        {
+          lua_pop(L, 1);
+          lua_pushnil(L);
+        }
+    }
+  lua_replace(L, -4);
+  lua_pop(L, 2);
+}
+
+
+static int vtab_connect(sqlite3 *db, void *aux, int argc,
+                        const char *const *argv, sqlite3_vtab **vtab, char **err)
+{
+  vtab_data *data = (vtab_data *)aux;
+  lua_vtab *vt;
+  int rc = sqlite3_declare_vtab(db, data->schema);
+  (void)argc; (void)argv; (void)err;
+  if (rc != SQLITE_OK)
+    return rc;
+  vt = (lua_vtab *)sqlite3_malloc(sizeof(lua_vtab));
+  if (vt == NULL)
+    return SQLITE_NOMEM;
+  memset(vt, 0, sizeof(lua_vtab));
+  vt->data = data;
+  *vtab = &vt->base;
+  return SQLITE_OK;
+}
+
+
+static int vtab_disconnect(sqlite3_vtab *vtab)
+{
+  sqlite3_free(vtab);
+  return SQLITE_OK;
+}
+
+
+/*
+** Prefer a rowid lookup, then an equality on a column, served by an index
+** built in Lua on the first lookup of each statement. SQLite checks the
+** equality again, so the index only has to return candidates.
+*/
+static int vtab_bestindex(sqlite3_vtab *vtab, sqlite3_index_info *info)
+{
+  vtab_data *data = ((lua_vtab *)vtab)->data;
+  double rows = (double)vtab_count(data->conn->L, data);
+  int i, best = -1;
+
+  for (i = 0; i < info->nConstraint; i++)
+    {
+      const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+      if (!c->usable || c->op != SQLITE_INDEX_CONSTRAINT_EQ)
+        continue;
+      if (c->iColumn < 0)
+        {
+          best = i;
+          break;
+        }
+      if (best == -1)
+        best = i;
+    }
+  if (best == -1)
+    {
+      info->idxNum = VTAB_SCAN;
+      info->estimatedCost = rows;
+      return SQLITE_OK;
+    }
+  info->aConstraintUsage[best].argvIndex = 1;
+  if (info->aConstraint[best].iColumn < 0)
+    {
+      info->aConstraintUsage[best].omit = 1;
+      info->idxNum = VTAB_ROWID;
+      info->estimatedCost = 1;
+#if SQLITE_VERSION_NUMBER >= 3008002
+      info->estimatedRows = 1;
+      info->idxFlags = SQLITE_INDEX_SCAN_UNIQUE;
+#endif
+    }
+  else
+    {
+      /* a hash lookup, once the index is built */
+      info->idxNum = VTAB_COLUMN + info->aConstraint[best].iColumn;
+      info->estimatedCost = 2;
+#if SQLITE_VERSION_NUMBER >= 3008002
+      info->estimatedRows = rows < 10 ? 1 + (sqlite3_int64)rows / 2 : 10;
+#endif
+    }
+  return SQLITE_OK;
+}
+
+
+static int vtab_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor)
+{
+  lua_vtab_cursor *cur = (lua_vtab_cursor *)sqlite3_malloc(sizeof(lua_vtab_cursor));
+  if (cur == NULL)
+    return SQLITE_NOMEM;
+  memset(cur, 0, sizeof(lua_vtab_cursor));
+  cur->data = ((lua_vtab *)vtab)->data;
+  cur->indexes = cur->rowids = LUA_NOREF;
+  *cursor = &cur->base;
+  return SQLITE_OK;
+}
+
+
+static int vtab_close(sqlite3_vtab_cursor *cursor)
+{
+  lua_vtab_cursor *cur = (lua_vtab_cursor *)cursor;
+  lua_State *L = cur->data->conn->L;
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->indexes);
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->rowids);
+  sqlite3_free(cur);
+  return SQLITE_OK;
+}
+
+
+/*
+** Push the index of a column, a table mapping each value to the list of
+** its rowids, building it if needed.
+*/
+static void vtab_pushindex(lua_State *L, lua_vtab_cursor *cur, int column)
+{
+  vtab_data *data = cur->data;
+  lua_Integer n, row;
+
+  if (cur->indexes == LUA_NOREF)
+    {
+      lua_newtable(L);
+      cur->indexes = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, cur->indexes);
+  if (lua_rawgeti(L, -1, column) == LUA_TTABLE)
+    {
+      lua_remove(L, -2);
+      return;
+    }
+  lua_pop(L, 1);
+  lua_newtable(L);
+  n = vtab_count(L, data);
+  for (row = 1; row <= n; row++)
+    {
+      vtab_push(L, data, row, column);
+      if (lua_isnil(L, -1) || (lua_type(L, -1) == LUA_TNUMBER &&
+                               lua_tonumber(L, -1) != lua_tonumber(L, -1)))
+        {
+          lua_pop(L, 1);
+          continue;
+        }
+      if (lua_isboolean(L, -1))
+        {
+          /* booleans are stored as integers */
+          int b = lua_toboolean(L, -1);
+          lua_pop(L, 1);
+          lua_pushinteger(L, b);
+        }
+      lua_pushvalue(L, -1);
+      if (lua_rawget(L, -3) != LUA_TTABLE)
+        {
+          lua_pop(L, 1);
+          lua_newtable(L);
+          lua_pushvalue(L, -2);
+          lua_pushvalue(L, -2);
+          lua_rawset(L, -5);                /* index[value] = {} */
+        }
+      lua_pushinteger(L, row);
+      lua_rawseti(L, -2, (lua_Integer)lua_rawlen(L, -2) + 1);
+      lua_pop(L, 2);
+    }
+  lua_pushvalue(L, -1);
+  lua_rawseti(L, -3, column);
+  lua_remove(L, -2);
+}
+
+
+static int vtab_filter(sqlite3_vtab_cursor *cursor, int idxnum, const char *idxstr,
+                       int argc, sqlite3_value **argv)
+{
+  lua_vtab_cursor *cur = (lua_vtab_cursor *)cursor;
+  lua_State *L = cur->data->conn->L;
+  lua_Integer n = vtab_count(L, cur->data);
+  (void)idxstr;
+
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->rowids);
+  cur->rowids = LUA_NOREF;
+  cur->i = 1;
+  cur->last = n;
+  if (idxnum == VTAB_ROWID && argc == 1)
+    {
+      sqlite3_int64 rowid = sqlite3_value_int64(argv[0]);
+      if (sqlite3_value_numeric_type(argv[0]) != SQLITE_INTEGER || rowid < 1 || rowid > n)
+        cur->last = 0;
+      else
+        cur->i = cur->last = rowid;
+    }
+  else if (idxnum >= VTAB_COLUMN && argc == 1)
+    {
+      vtab_pushindex(L, cur, idxnum - VTAB_COLUMN);
+      push_value(L, argv[0]);
+      if (!lua_isnil(L, -1) && lua_rawget(L, -2) == LUA_TTABLE)
+        {
+          cur->last = (lua_Integer)lua_rawlen(L, -1);
+          cur->rowids = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+      else
+        {
+          cur->last = 0;
+          lua_pop(L, 1);
+        }
+      lua_pop(L, 1);
+    }
+  return SQLITE_OK;
+}
+
+
+static int vtab_next(sqlite3_vtab_cursor *cursor)
+{
+  ((lua_vtab_cursor *)cursor)->i++;
+  return SQLITE_OK;
+}
+
+
+static int vtab_eof(sqlite3_vtab_cursor *cursor)
+{
+  lua_vtab_cursor *cur = (lua_vtab_cursor *)cursor;
+  return cur->i > cur->last;
+}
+
+
+static int vtab_rowid(sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid)
+{
+  lua_vtab_cursor *cur = (lua_vtab_cursor *)cursor;
+  if (cur->rowids == LUA_NOREF)
+    *rowid = cur->i;
+  else
+    {
+      lua_State *L = cur->data->conn->L;
+      lua_rawgeti(L, LUA_REGISTRYINDEX, cur->rowids);
+      lua_rawgeti(L, -1, cur->i);
+      *rowid = (sqlite3_int64)lua_tointeger(L, -1);
+      lua_pop(L, 2);
+    }
+  return SQLITE_OK;
+}
+
+
+static int vtab_column(sqlite3_vtab_cursor *cursor, sqlite3_context *ctx, int column)
+{
+  lua_vtab_cursor *cur = (lua_vtab_cursor *)cursor;
+  lua_State *L = cur->data->conn->L;
+  sqlite3_int64 rowid;
+  vtab_rowid(cursor, &rowid);
+  vtab_push(L, cur->data, rowid, column);
+  set_result(L, ctx, -1);
+  lua_pop(L, 1);
+  return SQLITE_OK;
+}
+
+
+/* no xCreate: the tables are eponymous only */
+static sqlite3_module vtab_module = {
+  .xConnect = vtab_connect,
+  .xBestIndex = vtab_bestindex,
+  .xDisconnect = vtab_disconnect,
+  .xOpen = vtab_open,
+  .xClose = vtab_close,
+  .xFilter = vtab_filter,
+  .xNext = vtab_next,
+  .xEof = vtab_eof,
+  .xColumn = vtab_column,
+  .xRowid = vtab_rowid,
+};
+
+
+/*
+** Release a virtual table when its module is replaced or the connection
+** is closed.
+*/
+static void vtab_destroy(void *aux)
+{
+  vtab_data *data = (vtab_data *)aux;
+  lua_State *L = data->conn->L;
+  luaL_unref(L, LUA_REGISTRYINDEX, data->columns);
+  luaL_unref(L, LUA_REGISTRYINDEX, data->source);
+  free(data->schema);
+  free(data);
+}
+
+
+/*
+** Make a Lua table available to SQL as a read-only table, without copying
+** it. Rows are read from the table when the query runs; their rowid is
+** their position.
+** Lua Input: name, columns, source
+**   columns: list of column names
+**   source: list of rows, each one keyed by column name or by position,
+**     or table of columns, each one a list of values keyed by column name
+** Return true, or nil and an error message.
+*/
+static int conn_createvtab(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *name = luaL_checkstring(L, 2);
+  vtab_data *data;
+  luaL_Buffer b;
+  int ncols, i, res;
+
+  luaL_checktype(L, 3, LUA_TTABLE);
+  luaL_checktype(L, 4, LUA_TTABLE);
+  ncols = (int)lua_rawlen(L, 3);
+  luaL_argcheck(L, ncols > 0, 3, LUASQL_PREFIX"list of column names expected");
+
+  /* CREATE TABLE x("name", ...), quoting the names */
+  luaL_buffinit(L, &b);
+  luaL_addstring(&b, "CREATE TABLE x(");
+  for (i = 1; i <= ncols; i++)
+    {
+      const char *c;
+      if (lua_rawgeti(L, 3, i) != LUA_TSTRING)
+        return luaL_argerror(L, 3, LUASQL_PREFIX"list of column names expected");
+      c = lua_tostring(L, -1);
+      lua_pop(L, 1);
+      luaL_addstring(&b, i > 1 ? ", \"" : "\"");
+      for (; *c; c++)
+        {
+          if (*c == '"')
+            luaL_addchar(&b, '"');
+          luaL_addchar(&b, *c);
+        }
+      luaL_addchar(&b, '"');
+    }
+  luaL_addchar(&b, ')');
+  luaL_pushresult(&b);
+
+  data = (vtab_data *)malloc(sizeof(vtab_data));
+  if (data != NULL)
+    data->schema = (char *)malloc(lua_rawlen(L, -1) + 1);
+  if (data == NULL || data->schema == NULL)
+    {
+      free(data);
+      return luaL_error(L, LUASQL_PREFIX"not enough memory");
+    }
+  strcpy(data->schema, lua_tostring(L, -1));
+  lua_pop(L, 1);
+  data->conn = conn;
+  data->ncols = ncols;
+  /* a list of rows has entries in its array part, unless it is empty */
+  lua_pushnil(L);
+  data->columnar = lua_rawlen(L, 4) == 0 && lua_next(L, 4) != 0;
+  lua_settop(L, 4);
+  lua_pushvalue(L, 3);
+  data->columns = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_pushvalue(L, 4);
+  data->source = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  /* on failure, SQLite calls vtab_destroy itself */
+  res = sqlite3_create_module_v2(conn->sql_conn, name, &vtab_module, data, vtab_destroy);
+  if (res != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Register the modules the driver provides on a new database connection,
+** whether it belongs to a Connection object, a pool reader or a shard.
+*/
+static void add_modules(sqlite3 *sql_conn)
+{
+#ifdef LUASQL_SQLITE_CARRAY
+  sqlite3_create_module(sql_conn, "carray", &carray_module, NULL);
+#else
+  (void)sql_conn;
+#endif
+}
+
+
+/*
+** Create a new Connection object and push it on top of the stack.
+*/
+static int create_connection(lua_State *L, int env, sqlite3 *sql_conn)
+{
+  conn_data *conn = (conn_data*)lua_newuserdata(L, sizeof(conn_data));
+  luasql_setmeta(L, LUASQL_CONNECTION_SQLITE);
+
+  /* fill in structure */
+  conn->closed = 0;
+  conn->env = LUA_NOREF;
+  conn->auto_commit = 1;
+  conn->sql_conn = sql_conn;
+  conn->L = L;
+  conn->cur_counter = 0;
+  conn->stmt_counter = 0;
+  conn->blob_counter = 0;
+  conn->backup_counter = 0;
+  conn->session_counter = 0;
+  conn->image = LUA_NOREF;
+  conn->mapping = NULL;
+  conn->mapping_size = 0;
+  conn->txn_vm[0] = conn->txn_vm[1] = conn->txn_vm[2] = NULL;
+  conn->begin_mode = 0;
+  conn->cache_head = conn->cache_tail = NULL;
+  conn->cache_count = 0;
+  conn->cache_size = LUASQL_SQLITE_CACHE_SIZE;
+  conn->cache_hits = conn->cache_misses = 0;
+  conn->query_timeout = 0;
+  conn->deadline = conn->call_deadline = 0;
+  conn->timed_out = 0;
+  conn->stepping = 0;
+  conn->yield_due = 0;
+  conn->yield_ops = conn->yield_ms = conn->yield_run = 0;
+  conn->yield_last = 0;
+  conn->progress = 0;
+  memset(&conn->last_stats, 0, sizeof(stmt_stats));
+  conn->onstats = LUA_NOREF;
+  conn->in_onstats = 0;
+  conn->onchange = LUA_NOREF;
+  memset(&conn->changes, 0, sizeof(change_log));
+  conn->ckpt = NULL;
+  add_modules(sql_conn);
+#ifdef SQLITE_LIMIT_WORKER_THREADS
+  /* the sorter must not call the allocator of the state from its threads */
+  if (mem_allocf != NULL)
+    sqlite3_limit(sql_conn, SQLITE_LIMIT_WORKER_THREADS, 0);
+#endif
+  lua_pushvalue (L, env);
+  conn->env = luaL_ref (L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+
+/*
+** Options accepted by env:connect, checked before the database is opened.
+*/
+typedef struct
+{
+  int         flags;              /* flags for sqlite3_open_v2 */
+  short       immutable;          /* open through an URI with immutable=1 */
+  int         timeout;            /* busy timeout in milliseconds, or -1 */
+  int         statement_cache;    /* size of the statement cache, or -1 */
+  int         query_timeout;      /* time limit of each call in ms, 0 for none */
+  int         begin_mode;         /* index in begin_modes */
+  const char  *journal_mode;      /* pragma values, NULL when not given */
+  const char  *synchronous;
+  const char  *temp_store;
+  short       has_mmap_size, has_cache_size;
+  lua_Integer mmap_size, cache_size;
+} conn_options;
+
+
+/*
+** Read the options table of env:connect.
+*/
+static void read_options(lua_State *L, int t, conn_options *opts)
+{
+  static const char *const journal_modes[] =
+    {"DELETE", "TRUNCATE", "PERSIST", "MEMORY", "WAL", "OFF", NULL};
+  static const char *const synchronous[] =
+    {"OFF", "NORMAL", "FULL", "EXTRA", NULL};
+  static const char *const temp_stores[] =
+    {"DEFAULT", "FILE", "MEMORY", NULL};
+  lua_Integer val;
+  const char *mode;
+
+  if (opt_boolean(L, t, "readonly", 0))
+    opts->flags = SQLITE_OPEN_READONLY;
+  else if (opt_boolean(L, t, "create", 1))
+    opts->flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+  else
+    opts->flags = SQLITE_OPEN_READWRITE;
+#if SQLITE_VERSION_NUMBER > 3006013
+  if (opt_boolean(L, t, "uri", 0))
+    opts->flags |= SQLITE_OPEN_URI;
+  if (opt_boolean(L, t, "nomutex", 0))
+    opts->flags |= SQLITE_OPEN_NOMUTEX;
+  if (opt_boolean(L, t, "fullmutex", 0))
+    opts->flags |= SQLITE_OPEN_FULLMUTEX;
+  if (opt_boolean(L, t, "sharedcache", 0))
+    opts->flags |= SQLITE_OPEN_SHAREDCACHE;
+  if (opt_boolean(L, t, "privatecache", 0))
+    opts->flags |= SQLITE_OPEN_PRIVATECACHE;
+#endif
+  opts->immutable = (short)opt_boolean(L, t, "immutable", 0);
+
+  if (opt_integer(L, t, "timeout", &val))
+    opts->timeout = (int)val;
+  if (opt_integer(L, t, "statement_cache", &val))
+    {
+      luaL_argcheck(L, val >= 0, 3,
+                    LUASQL_PREFIX"statement_cache must not be negative");
+      opts->statement_cache = (int)val;
+    }
+  if (opt_integer(L, t, "query_timeout", &val))
+    {
+      luaL_argcheck(L, val >= 0 && val <= INT_MAX, 3,
+                    LUASQL_PREFIX"query_timeout out of range");
+      opts->query_timeout = (int)val;
+    }
+  opts->has_mmap_size = (short)opt_integer(L, t, "mmap_size", &opts->mmap_size);
+  opts->has_cache_size = (short)opt_integer(L, t, "cache_size", &opts->cache_size);
+  mode = opt_choice(L, t, "begin", begin_modes);
+  opts->begin_mode = 0;
+  while (mode != NULL && begin_modes[opts->begin_mode] != mode)
+    opts->begin_mode++;
+  opts->journal_mode = opt_choice(L, t, "journal_mode", journal_modes);
+  opts->synchronous = opt_choice(L, t, "synchronous", synchronous);
+  opts->temp_store = opt_choice(L, t, "temp_store", temp_stores);
+}
+
+
+/*
+** Push the URI that opens a file name as an immutable database.
+** URIs given by the caller are extended with the parameter.
+*/
+static void push_immutable_uri(lua_State *L, const char *sourcename, int isuri)
+{
+  luaL_Buffer b;
+  const char *c;
+
+  luaL_buffinit(L, &b);
+  if (isuri && strncmp(sourcename, "file:", 5) == 0)
+    {
+      luaL_addstring(&b, sourcename);
+      luaL_addstring(&b, strchr(sourcename, '?') ? "&" : "?");
+    }
+  else
+    {
+      luaL_addstring(&b, "file:");
+      for (c = sourcename; *c != '\0'; c++)
+        {
+          /* characters with a meaning in URIs are percent-encoded */
+          if (*c == '?' || *c == '#' || *c == '%')
+            {
+              char hex[4];
+              sprintf(hex, "%%%02X", (unsigned char)*c);
+              luaL_addstring(&b, hex);
+            }
+          else
+            luaL_addchar(&b, *c);
+        }
+      luaL_addchar(&b, '?');
+    }
+  luaL_addstring(&b, "immutable=1");
+  luaL_pushresult(&b);
+}
+
+
+/*
+** Run one PRAGMA on a connection being opened.
+*/
+static int set_pragma(sqlite3 *conn, const char *sql)
+{
+  int res = sqlite3_exec(conn, sql, NULL, NULL, NULL);
+  sqlite3_free((void *)sql);
+  return res;
+}
+
+
+/*
+** Apply the startup pragmas of the options.
+** Return SQLITE_OK or the error code of the failed pragma.
+*/
+static int apply_options(sqlite3 *conn, conn_options *opts)
+{
+  int res = SQLITE_OK;
+
+  if (opts->timeout >= 0)
+    sqlite3_busy_timeout(conn, opts->timeout);
+  if (res == SQLITE_OK && opts->journal_mode != NULL)
+    res = set_pragma(conn, sqlite3_mprintf("PRAGMA journal_mode=%s",
+                                           opts->journal_mode));
+  if (res == SQLITE_OK && opts->synchronous != NULL)
+    res = set_pragma(conn, sqlite3_mprintf("PRAGMA synchronous=%s",
+                                           opts->synchronous));
+  if (res == SQLITE_OK && opts->has_cache_size)
+    res = set_pragma(conn, sqlite3_mprintf("PRAGMA cache_size=%lld",
+                                           (sqlite3_int64)opts->cache_size));
+  if (res == SQLITE_OK && opts->has_mmap_size)
+    res = set_pragma(conn, sqlite3_mprintf("PRAGMA mmap_size=%lld",
+                                           (sqlite3_int64)opts->mmap_size));
+  if (res == SQLITE_OK && opts->temp_store != NULL)
+    res = set_pragma(conn, sqlite3_mprintf("PRAGMA temp_store=%s",
+                                           opts->temp_store));
+  return res;
+}
+
+
+/*
+** Connects to a data source.
+** The third argument is either a table of options or, as in previous
+** versions, the lock timeout followed by the read-only flag.
+*/
+static int env_connect(lua_State *L)
+{
+  const char *sourcename;
+  sqlite3 *conn;
+  const char *errmsg;
+  int res;
+  conn_options opts;
+
+  getenvironment(L);  /* validate environment */
+  sourcename = luaL_checkstring(L, 2);
+  errmsg = mem_check(L, 0);
+  if (errmsg != NULL)
+    return luasql_faildirect(L, errmsg);
+
+  memset(&opts, 0, sizeof(opts));
+  opts.timeout = -1;
+  opts.statement_cache = -1;
+  if (lua_istable(L, 3))
+    read_options(L, 3, &opts);
+  else
+    {
+      if (lua_isboolean(L, 4) && lua_toboolean(L, 4))
+        opts.flags = SQLITE_OPEN_READONLY;
+      else
+        opts.flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+      if (lua_isnumber(L, 3))
+        opts.timeout = (int)lua_tonumber(L, 3);
+    }
+
+#if SQLITE_VERSION_NUMBER > 3006013
+  if (opts.immutable)
+    {
+      push_immutable_uri(L, sourcename, opts.flags & SQLITE_OPEN_URI);
+      sourcename = lua_tostring(L, -1);
+      opts.flags |= SQLITE_OPEN_URI;
+    }
+  else if (strstr(sourcename, ":memory:"))
+    opts.flags |= SQLITE_OPEN_MEMORY;
+  res = sqlite3_open_v2(sourcename, &conn, opts.flags, NULL);
+#else
+  res = sqlite3_open(sourcename, &conn);
+#endif
+  if (res == SQLITE_OK)
+    res = apply_options(conn, &opts);
+  if (res != SQLITE_OK)
+    {
+      errmsg = sqlite3_errmsg(conn);
+      luasql_faildirect(L, errmsg);
+      sqlite3_close(conn);
+      return 2;
+    }
+
+  create_connection(L, 1, conn);
+  if (opts.statement_cache >= 0)
+    ((conn_data *)lua_touserdata(L, -1))->cache_size = opts.statement_cache;
+  ((conn_data *)lua_touserdata(L, -1))->query_timeout = opts.query_timeout;
+  ((conn_data *)lua_touserdata(L, -1))->begin_mode = opts.begin_mode;
+  return 1;
+}
+
+
+/*
+** Serialize a database of the connection.
+** Lua Input: [name]
+**   name: name of the database, "main" by default
+** Return a string with the content of the database, or nil and an error
+** message.
+*/
+static int conn_serialize(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *name = luaL_optstring(L, 2, "main");
+#ifdef LUASQL_SQLITE_SERIALIZE
+  sqlite3_int64 size = 0;
+  unsigned char *data;
+
+  /* in-memory databases can be read in place */
+  data = sqlite3_serialize(conn->sql_conn, name, &size, SQLITE_SERIALIZE_NOCOPY);
+  if (data != NULL || size == 0)
+    {
+      lua_pushlstring(L, (const char *)data, (size_t)size);
+      return 1;
+    }
+  data = sqlite3_serialize(conn->sql_conn, name, &size, 0);
+  if (data == NULL)
+    return luasql_faildirect(L, "could not serialize database");
+  lua_pushlstring(L, (const char *)data, (size_t)size);
+  sqlite3_free(data);
+  return 1;
+#else
+  (void)conn; (void)name;
+  return luasql_faildirect(L, "serialization is not supported by this SQLite");
+#endif
+}
+
+
+#ifdef LUASQL_SQLITE_SERIALIZE
+/*
+** Serialized databases start with the header of a database file.
+*/
+static int is_image(const char *data, size_t len)
+{
+  return len == 0 || (len >= 100 && memcmp(data, "SQLite format 3", 16) == 0);
+}
+
+
+/*
+** Images of databases in WAL mode can't be opened from memory until
+** their header is switched back to the rollback journal.
+*/
+static int is_wal_image(const unsigned char *data, sqlite3_int64 size)
+{
+  return size >= 100 && data[18] == 2 && data[19] == 2;
+}
+
+
+static void unset_wal(unsigned char *data, sqlite3_int64 size)
+{
+  if (is_wal_image(data, size))
+    data[18] = data[19] = 1;
+}
+
+
+/*
+** Read a whole file into memory allocated by SQLite.
+** On failure, push nil and an error message.
+*/
+static unsigned char *read_image(lua_State *L, const char *path, sqlite3_int64 *size)
+{
+  FILE *f = fopen(path, "rb");
+  unsigned char *data = NULL;
+  long len = -1;
+
+  if (f != NULL && fseek(f, 0, SEEK_END) == 0)
+    len = ftell(f);
+  if (len >= 0 && fseek(f, 0, SEEK_SET) == 0)
+    {
+      data = (unsigned char *)sqlite3_malloc64(len > 0 ? len : 1);
+      if (data != NULL && fread(data, 1, len, f) != (size_t)len)
+        {
+          sqlite3_free(data);
+          data = NULL;
+        }
+    }
+  if (data == NULL)
+    luasql_failmsg(L, "could not read file: ", strerror(errno));
+  if (f != NULL)
+    fclose(f);
+  *size = len;
+  return data;
+}
+
+
+#ifdef LUASQL_SQLITE_MMAP
+/*
+** Map a whole file into memory. The mapping is private, so the database
+** header can be fixed without changing the file.
+** On failure, push nil and an error message.
+*/
+static unsigned char *map_image(lua_State *L, const char *path, sqlite3_int64 *size)
+{
+  struct stat st;
+  void *data = MAP_FAILED;
+  int fd = open(path, O_RDONLY);
+
+  if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0)
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  else if (fd >= 0)
+    errno = EINVAL;
+  if (data == MAP_FAILED)
+    luasql_failmsg(L, "could not map file: ", strerror(errno));
+  if (fd >= 0)
+    close(fd);
+  if (data == MAP_FAILED)
+    return NULL;
+  *size = (sqlite3_int64)st.st_size;
+  return (unsigned char *)data;
+}
+#endif
+#endif
+
+
+/*
+** Open an in-memory database from a serialized image.
+** Lua Input: source [, options]
+**   source: a string returned by conn:serialize, or the path of a
+**     database file read into memory
+**   options: table with the booleans
+**     readonly: the database can't be changed, so an image given as a
+**       string is used in place instead of being copied
+**     mmap: the file is mapped instead of being read (read-only)
+** Return a connection object, or nil and an error message.
+*/
+static int env_deserialize(lua_State *L)
+{
+  size_t len;
+  const char *source;
+  int readonly = 0, map = 0;
+  const char *errmsg;
+
+  getenvironment(L);  /* validate environment */
+  source = luaL_checklstring(L, 2, &len);
+  errmsg = mem_check(L, 0);
+  if (errmsg != NULL)
+    return luasql_faildirect(L, errmsg);
+  if (lua_istable(L, 3))
+    {
+      readonly = opt_boolean(L, 3, "readonly", 0);
+      map = opt_boolean(L, 3, "mmap", 0);
+    }
+  else
+    luaL_argcheck(L, lua_isnoneornil(L, 3), 3, LUASQL_PREFIX"table of options expected");
+#ifdef LUASQL_SQLITE_SERIALIZE
+  {
+  unsigned char *data;
+  sqlite3_int64 size;
+  unsigned int flags = SQLITE_DESERIALIZE_FREEONCLOSE | SQLITE_DESERIALIZE_RESIZEABLE;
+  int image = LUA_NOREF;
+  sqlite3 *db;
+  conn_data *conn;
+  int res;
+
+  if (is_image(source, len))
+    {
+      luaL_argcheck(L, !map, 3, LUASQL_PREFIX"mmap needs the path of a file");
+      size = (sqlite3_int64)len;
+      if (readonly && !is_wal_image((const unsigned char *)source, size))
+        {
+          /* kept alive by the connection */
+          data = (unsigned char *)source;
+          flags = 0;
+          lua_pushvalue(L, 2);
+          image = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+      else
+        {
+          data = (unsigned char *)sqlite3_malloc64(len > 0 ? len : 1);
+          if (data == NULL)
+            return luaL_error(L, LUASQL_PREFIX"not enough memory");
+          memcpy(data, source, len);
+        }
+    }
+  else if (map)
+    {
+#ifdef LUASQL_SQLITE_MMAP
+      data = map_image(L, source, &size);
+      if (data == NULL)
+        return 2;
+      flags = 0;
+      readonly = 1;
+#else
+      return luasql_faildirect(L, "mmap is not supported on this platform");
+#endif
+    }
+  else
+    {
+      data = read_image(L, source, &size);
+      if (data == NULL)
+        return 2;
+    }
+  if (flags != 0 || map)
+    unset_wal(data, size);
+  if (readonly)
+    flags |= SQLITE_DESERIALIZE_READONLY;
+
+  /* with SQLITE_DESERIALIZE_FREEONCLOSE, SQLite frees the data even on failure */
+  res = sqlite3_open_v2(":memory:", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+  if (res == SQLITE_OK)
+    res = sqlite3_deserialize(db, "main", data, size, size, flags);
+  else if (flags & SQLITE_DESERIALIZE_FREEONCLOSE)
+    sqlite3_free(data);
+  if (res != SQLITE_OK)
+    {
+      luasql_faildirect(L, sqlite3_errmsg(db));
+      sqlite3_close(db);
+      luaL_unref(L, LUA_REGISTRYINDEX, image);
+#ifdef LUASQL_SQLITE_MMAP
+      if (map)
+        munmap(data, (size_t)size);
+#endif
+      return 2;
+    }
+
+  create_connection(L, 1, db);
+  conn = (conn_data *)lua_touserdata(L, -1);
+  conn->image = image;
+  if (map)
+    {
+      conn->mapping = data;
+      conn->mapping_size = (size_t)size;
+    }
+  return 1;
+  }
+#else
+  (void)len; (void)readonly; (void)map;
+  return luasql_faildirect(L, "serialization is not supported by this SQLite");
+#endif
+}
+
+
+#ifdef LUASQL_SQLITE_SESSION
+/*
+** Check for valid session.
+*/
+static session_data *getsession(lua_State *L) {
+  session_data *se = (session_data *)luaL_checkudata (L, 1, LUASQL_SESSION_SQLITE);
+  luaL_argcheck(L, se != NULL, 1, LUASQL_PREFIX"session expected");
+  luaL_argcheck(L, !se->closed, 1, LUASQL_PREFIX"session is closed");
+  return se;
+}
+
+
+/*
+** Attach the tables in a list, or all of them when it is nil, to a
+** session.
+*/
+static int session_attach(lua_State *L, sqlite3_session *session, int arg)
+{
+  int rc = SQLITE_OK;
+  lua_Integer i, n;
+  if (lua_isnoneornil(L, arg))
+    return sqlite3session_attach(session, NULL);
+  if (lua_type(L, arg) == LUA_TSTRING)
+    return sqlite3session_attach(session, lua_tostring(L, arg));
+  luaL_checktype(L, arg, LUA_TTABLE);
+  n = (lua_Integer)lua_rawlen(L, arg);
+  for (i = 1; i <= n && rc == SQLITE_OK; i++)
+    {
+      lua_rawgeti(L, arg, i);
+      luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, arg,
+                    LUASQL_PREFIX"table names expected");
+      rc = sqlite3session_attach(session, lua_tostring(L, -1));
+      lua_pop(L, 1);
+    }
+  return rc;
+}
+
+
+/*
+** Start recording the changes of the connection to some tables.
+** Lua Input: [tables [, name]]
+**   tables: list of table names or a single name, all tables by default
+**   name: name of the database, "main" by default
+** Return a Session object, or nil and an error message.
+*/
+static int conn_session(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *name = luaL_optstring(L, 3, "main");
+  sqlite3_session *session;
+  session_data *se;
+  int rc;
+
+  rc = sqlite3session_create(conn->sql_conn, name, &session);
+  if (rc != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errstr(rc));
+  rc = session_attach(L, session, 2);
+  if (rc != SQLITE_OK)
+    {
+      sqlite3session_delete(session);
+      return luasql_faildirect(L, sqlite3_errstr(rc));
+    }
+
+  se = (session_data *)lua_newuserdata(L, sizeof(session_data));
+  luasql_setmeta(L, LUASQL_SESSION_SQLITE);
+  conn->session_counter++;
+  se->closed = 0;
+  se->conn_data = conn;
+  se->session = session;
+  lua_pushvalue(L, 1);
+  se->conn = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+
+/*
+** Attach more tables to the session.
+*/
+static int session_attachmore(lua_State *L)
+{
+  session_data *se = getsession(L);
+  int rc = session_attach(L, se->session, 2);
+  if (rc != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errstr(rc));
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Return the changes recorded so far as a string, produced by 'fn'.
+*/
+static int session_output(lua_State *L,
+                          int (*fn)(sqlite3_session *, int *, void **))
+{
+  session_data *se = getsession(L);
+  int size = 0;
+  void *buffer = NULL;
+  int rc = fn(se->session, &size, &buffer);
+  if (rc != SQLITE_OK)
+    {
+      sqlite3_free(buffer);
+      return luasql_faildirect(L, sqlite3_errstr(rc));
+    }
+  lua_pushlstring(L, (const char *)buffer, (size_t)size);
+  sqlite3_free(buffer);
+  return 1;
+}
+
+
+/*
+** Return the changeset of the session: the changed rows with their old
+** and new values.
+*/
+static int session_changeset(lua_State *L)
+{
+  return session_output(L, sqlite3session_changeset);
+}
+
+
+/*
+** Return the patchset of the session: a more compact changeset without
+** the old values of the changed rows.
+*/
+static int session_patchset(lua_State *L)
+{
+  return session_output(L, sqlite3session_patchset);
+}
+
+
+/*
+** Return whether the session recorded no changes.
+*/
+static int session_isempty(lua_State *L)
+{
+  session_data *se = getsession(L);
+  lua_pushboolean(L, sqlite3session_isempty(se->session));
+  return 1;
+}
+
+
+/*
+** Pause or resume the recording of changes.
+** Lua Input: [enable]
+** Return whether the session is recording.
+*/
+static int session_enable(lua_State *L)
+{
+  session_data *se = getsession(L);
+  int enable = lua_isnoneornil(L, 2) ? -1 : lua_toboolean(L, 2);
+  lua_pushboolean(L, sqlite3session_enable(se->session, enable));
+  return 1;
+}
+
+
+/*
+** Delete the session.
+*/
+static void session_release(lua_State *L, session_data *se)
+{
+  se->closed = 1;
+  sqlite3session_delete(se->session);
+  se->session = NULL;
+  se->conn_data->session_counter--;
+  luaL_unref(L, LUA_REGISTRYINDEX, se->conn);
+}
+
+
+/*
+** Session object collector function
+*/
+static int session_gc(lua_State *L)
+{
+  session_data *se = (session_data *)luaL_checkudata(L, 1, LUASQL_SESSION_SQLITE);
+  if (se != NULL && !(se->closed))
+    session_release(L, se);
+  return 0;
+}
+
+
+/*
+** Close the session.
+** Return true, or false when it was already closed.
+*/
+static int session_close(lua_State *L)
+{
+  session_data *se = (session_data *)luaL_checkudata(L, 1, LUASQL_SESSION_SQLITE);
+  luaL_argcheck(L, se != NULL, 1, LUASQL_PREFIX"session expected");
+  if (se->closed)
+    {
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+  session_release(L, se);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/* state of sqlite3changeset_apply shared with its callbacks */
+typedef struct
+{
+  lua_State *L;
+  int       conflict, filter;     /* stack indices of the callbacks, or 0 */
+  int       failed;               /* a callback raised an error */
+} apply_data;
+
+
+/*
+** Push the values of a changed row, read by 'fn', as a list, or nil.
+*/
+static void push_change_row(lua_State *L, sqlite3_changeset_iter *iter, int ncols,
+                            int (*fn)(sqlite3_changeset_iter *, int, sqlite3_value **))
+{
+  int i;
+  lua_createtable(L, ncols, 0);
+  for (i = 0; i < ncols; i++)
+    {
+      sqlite3_value *value = NULL;
+      if (fn(iter, i, &value) != SQLITE_OK)
+        {
+          lua_pop(L, 1);
+          lua_pushnil(L);
+          return;
+        }
+      /* columns left out of an update are missing from the list */
+      if (value == NULL)
+        continue;
+      push_value(L, value);
+      lua_rawseti(L, -2, i + 1);
+    }
+}
+
+
+/*
+** Filter of sqlite3changeset_apply: call the Lua filter with the name
+** of the table.
+*/
+static int apply_filter(void *data, const char *table)
+{
+  apply_data *ad = (apply_data *)data;
+  lua_State *L = ad->L;
+  int keep;
+  if (ad->failed)
+    return 0;
+  lua_pushvalue(L, ad->filter);
+  lua_pushstring(L, table);
+  if (lua_pcall(L, 1, 1, 0) != 0)
+    {
+      ad->failed = 1;
+      return 0;
+    }
+  keep = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  return keep;
+}
+
+
+/*
+** Conflict handler of sqlite3changeset_apply: call the Lua handler with
+** a table describing the conflict; it returns "omit" (or nothing),
+** "replace" or "abort".
+** Without a Lua handler, conflicts abort the whole changeset.
+*/
+static int apply_conflict(void *data, int kind, sqlite3_changeset_iter *iter)
+{
+  static const char *const actions[] = {"omit", "replace", "abort", NULL};
+  static const int results[] =
+    {SQLITE_CHANGESET_OMIT, SQLITE_CHANGESET_REPLACE, SQLITE_CHANGESET_ABORT};
+  apply_data *ad = (apply_data *)data;
+  lua_State *L = ad->L;
+  const char *table, *action;
+  int ncols, op, i;
+
+  if (ad->failed || ad->conflict == 0)
+    return SQLITE_CHANGESET_ABORT;
+  sqlite3changeset_op(iter, &table, &ncols, &op, NULL);
+
+  lua_pushvalue(L, ad->conflict);
+  lua_newtable(L);
+  lua_pushstring(L, kind == SQLITE_CHANGESET_DATA ? "data" :
+                    kind == SQLITE_CHANGESET_NOTFOUND ? "notfound" :
+                    kind == SQLITE_CHANGESET_CONFLICT ? "conflict" :
+                    kind == SQLITE_CHANGESET_CONSTRAINT ? "constraint" :
+                    "foreign_key");
+  lua_setfield(L, -2, "kind");
+  lua_pushstring(L, op == SQLITE_INSERT ? "insert" :
+                    op == SQLITE_DELETE ? "delete" : "update");
+  lua_setfield(L, -2, "op");
+  if (kind != SQLITE_CHANGESET_FOREIGN_KEY)
+    {
+      lua_pushstring(L, table);
+      lua_setfield(L, -2, "table");
+      if (op != SQLITE_INSERT)
+        {
+          push_change_row(L, iter, ncols, sqlite3changeset_old);
+          lua_setfield(L, -2, "old");
+        }
+      if (op != SQLITE_DELETE)
+        {
+          push_change_row(L, iter, ncols, sqlite3changeset_new);
+          lua_setfield(L, -2, "new");
+        }
+      if (kind == SQLITE_CHANGESET_DATA || kind == SQLITE_CHANGESET_CONFLICT)
+        {
+          push_change_row(L, iter, ncols, sqlite3changeset_conflict);
+          lua_setfield(L, -2, "conflicting");
+        }
+    }
+  if (lua_pcall(L, 1, 1, 0) != 0)
+    {
+      ad->failed = 1;
+      return SQLITE_CHANGESET_ABORT;
+    }
+  action = lua_tostring(L, -1);
+  for (i = 0; action != NULL && actions[i] != NULL; i++)
+    if (strcmp(action, actions[i]) == 0)
+      break;
+  if (action != NULL && actions[i] == NULL)
+    {
+      lua_pushfstring(L, LUASQL_PREFIX"invalid conflict action '%s'", action);
+      lua_remove(L, -2);
+      ad->failed = 1;
+      return SQLITE_CHANGESET_ABORT;
+    }
+  lua_pop(L, 1);
+  return action == NULL ? SQLITE_CHANGESET_OMIT : results[i];
+}
+
+
+/*
+** Apply a changeset or patchset to the connection, in one transaction.
+** Lua Input: changeset [, conflict [, filter]]
+**   conflict: function deciding what to do with conflicting changes
+**   filter: function telling whether the changes to a table are applied
+** Return true, or nil and an error message.
+*/
+static int conn_applychangeset(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  size_t len;
+  const char *changeset = luaL_checklstring(L, 2, &len);
+  apply_data ad;
+  size_t start;
+  int rc;
+
+  if (!lua_isnoneornil(L, 3))
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+  if (!lua_isnoneornil(L, 4))
+    luaL_checktype(L, 4, LUA_TFUNCTION);
+  lua_settop(L, 4);
+  ad.L = L;
+  ad.conflict = lua_isnil(L, 3) ? 0 : 3;
+  ad.filter = lua_isnil(L, 4) ? 0 : 4;
+  ad.failed = 0;
+  start = conn->changes.count;
+  /* errors of the callbacks undo the changes already applied */
+  rc = sqlite3_exec(conn->sql_conn, "SAVEPOINT luasql_apply", NULL, NULL, NULL);
+  if (rc != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  rc = sqlite3changeset_apply(conn->sql_conn, (int)len, (void *)changeset,
+                              ad.filter ? apply_filter : NULL,
+                              apply_conflict, &ad);
+  if (ad.failed)
+    {
+      /* the error of the callback is on top */
+      lua_pushnil(L);
+      lua_insert(L, -2);
+      (void) sqlite3_exec(conn->sql_conn, "ROLLBACK TO luasql_apply", NULL, NULL, NULL);
+    }
+  else if (rc != SQLITE_OK)
+    /* an "abort" leaves no message on the connection */
+    luasql_faildirect(L, sqlite3_errstr(rc));
+  /* the changes undone are not reported by the commit */
+  if ((ad.failed || rc != SQLITE_OK) && conn->changes.count > start)
+    conn->changes.count = start;
+  (void) sqlite3_exec(conn->sql_conn, "RELEASE luasql_apply", NULL, NULL, NULL);
+  deliver_changes(L, conn);
+  if (ad.failed || rc != SQLITE_OK)
+    return 2;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+#endif
+
+
+/*
+** Check for valid pool.
+*/
+static pool_data *getpool(lua_State *L) {
+  pool_data *pool = (pool_data *)luaL_checkudata(L, 1, LUASQL_POOL_SQLITE);
+  luaL_argcheck(L, pool != NULL, 1, LUASQL_PREFIX"pool expected");
+  luaL_argcheck(L, !pool->closed, 1, LUASQL_PREFIX"pool is closed");
+  pool->writer_data->L = L;
+  return pool;
+}
+
+
+/*
+** Check for valid pool cursor.
+*/
+static pool_cursor *getpoolcursor(lua_State *L) {
+  pool_cursor *cur = (pool_cursor *)luaL_checkudata(L, 1, LUASQL_POOLCURSOR_SQLITE);
+  luaL_argcheck(L, cur != NULL, 1, LUASQL_PREFIX"cursor expected");
+  luaL_argcheck(L, !cur->closed, 1, LUASQL_PREFIX"cursor is closed");
+  return cur;
+}
+
+
+/*
+** Record the error of a query run by a reader thread.
+*/
+static void pool_error(pool_cursor *cur, int rc, const char *errmsg)
+{
+  cur->rc = rc;
+  if (cur->errmsg == NULL)
+    {
+      cur->errmsg = (char *)malloc(strlen(errmsg) + 1);
+      if (cur->errmsg != NULL)
+        strcpy(cur->errmsg, errmsg);
+    }
+}
+
+
+/*
+** Copy the current row of a vm to a batch, from the thread running it.
+** Return 0 if there is not enough memory.
+*/
+static int batch_append(row_batch *b, sqlite3_stmt *vm, int numcols)
+{
+  int i;
+
+  if (b->nvalues + numcols > b->maxvalues)
+    {
+      size_t max = b->maxvalues > 0 ? 2 * b->maxvalues : 64 * (size_t)numcols;
+      pool_value *values = (pool_value *)realloc(b->values, max * sizeof(pool_value));
+      if (values == NULL)
+        return 0;
+      b->values = values;
+      b->maxvalues = max;
+    }
+  for (i = 0; i < numcols; i++)
+    {
+      pool_value *v = &b->values[b->nvalues++];
+      v->type = sqlite3_column_type(vm, i);
+      switch (v->type) {
+        case SQLITE_INTEGER:
+          v->v.i = sqlite3_column_int64(vm, i);
+          break;
+        case SQLITE_FLOAT:
+          v->v.d = sqlite3_column_double(vm, i);
+          break;
+        case SQLITE_TEXT:
+        case SQLITE_BLOB: {
+          const void *data = v->type == SQLITE_TEXT ?
+            (const void *)sqlite3_column_text(vm, i) : sqlite3_column_blob(vm, i);
+          v->len = sqlite3_column_bytes(vm, i);
+          if (b->textlen + v->len > b->maxtext)
+            {
+              size_t max = 2 * b->maxtext + v->len + 256;
+              char *text = (char *)realloc(b->text, max);
+              if (text == NULL)
+                return 0;
+              b->text = text;
+              b->maxtext = max;
+            }
+          memcpy(b->text + b->textlen, data, v->len);
+          v->v.offset = b->textlen;
+          b->textlen += v->len;
+          break;
+        }
+      }
+    }
+  return 1;
+}
+
+
+/*
+** Free the rows of a batch.
+*/
+static void batch_free(row_batch *b)
+{
+  free(b->values);
+  b->values = NULL;
+  free(b->text);
+  b->text = NULL;
+  b->nvalues = b->maxvalues = b->textlen = b->maxtext = b->next = 0;
+}
+
+
+/*
+** Hand a batch of rows over to the Lua state, from a reader. The reader
+** then waits while the Lua state has enough rows left to read, unless
+** the Lua state itself waits for a free reader: it reads no rows
+** meanwhile, so the queries are run to their end instead.
+** Return true if the rows of the cursor are not wanted anymore.
+*/
+static int pool_handover(pool_reader *r, pool_cursor *cur, row_batch *b)
+{
+  pool_data *pool = r->pool;
+  int cancelled;
+  mutex_lock(&pool->lock);
+  if (cur->tail != NULL)
+    cur->tail->link = b;
+  else
+    cur->head = b;
+  cur->tail = b;
+  cur->queued++;
+  cond_broadcast(&pool->done);
+  while (cur->queued >= LUASQL_SQLITE_POOL_BATCHES && !cur->cancelled &&
+         !pool->starved)
+    cond_wait(&r->wake, &pool->lock);
+  cancelled = cur->cancelled;
+  mutex_unlock(&pool->lock);
+  return cancelled;
+}
+
+
+/*
+** Run a query in a reader thread, handing its rows over in batches as
+** they come. The connection is locked for each step only, so the Lua
+** state can still give back the vms of finished queries meanwhile.
+*/
+static void pool_run(pool_reader *r, pool_cursor *cur)
+{
+  sqlite3 *db = r->conn.sql_conn;
+  sqlite3_mutex *mutex = sqlite3_db_mutex(db);
+  row_batch *b = NULL;
+  int rc = SQLITE_ROW, stop = 0;
+#ifdef SQLITE_ENABLE_SNAPSHOT
+  snapshot_data *snap = (snapshot_data *)cur->snapshot;
+
+  if (snap != NULL)
+    {
+      sqlite3_mutex_enter(mutex);
+      rc = sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+      if (rc == SQLITE_OK)
+        rc = sqlite3_snapshot_open(db, "main", snap->snapshot);
+      if (rc != SQLITE_OK)
+        pool_error(cur, rc, sqlite3_errmsg(db));
+      else
+        rc = SQLITE_ROW;
+      sqlite3_mutex_leave(mutex);
+    }
+#endif
+  while (rc == SQLITE_ROW && !stop)
+    {
+      sqlite3_mutex_enter(mutex);
+      rc = sqlite3_step(cur->sql_vm);
+      if (rc == SQLITE_ROW)
+        {
+          if (b == NULL)
+            b = (row_batch *)calloc(1, sizeof(row_batch));
+          if (b == NULL || !batch_append(b, cur->sql_vm, cur->numcols))
+            rc = SQLITE_NOMEM;
+        }
+      if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+        pool_error(cur, rc, rc == SQLITE_NOMEM ? "not enough memory" : sqlite3_errmsg(db));
+      sqlite3_mutex_leave(mutex);
+      if (b != NULL && rc != SQLITE_ROW && rc != SQLITE_DONE)
+        {
+          /* its last row may be incomplete */
+          batch_free(b);
+          free(b);
+          b = NULL;
+        }
+      if (b != NULL && (rc != SQLITE_ROW ||
+                        b->nvalues >= (size_t)LUASQL_SQLITE_BATCH * cur->numcols))
+        {
+          stop = pool_handover(r, cur, b);
+          b = NULL;
+        }
+    }
+  if (cur->errmsg == NULL)
+    cur->rc = rc;
+#ifdef SQLITE_ENABLE_SNAPSHOT
+  if (snap != NULL)
+    {
+      sqlite3_mutex_enter(mutex);
+      sqlite3_reset(cur->sql_vm);
+      if (!sqlite3_get_autocommit(db))
+        sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+      sqlite3_mutex_leave(mutex);
+    }
+#endif
+}
+
+
+/*
+** Main function of the reader threads.
+*/
+static THREAD_RESULT reader_main(void *arg)
+{
+  pool_reader *r = (pool_reader *)arg;
+  pool_data *pool = r->pool;
+  pool_cursor *cur;
+
+  mutex_lock(&pool->lock);
+  for (;;)
+    {
+      while (r->job == NULL && !pool->stopping)
+        cond_wait(&r->wake, &pool->lock);
+      if (r->job == NULL)
+        break;
+      cur = r->job;
+      mutex_unlock(&pool->lock);
+      pool_run(r, cur);
+      mutex_lock(&pool->lock);
+#ifdef SQLITE_ENABLE_SNAPSHOT
+      if (cur->snapshot != NULL)
+        ((snapshot_data *)cur->snapshot)->running--;
+#endif
+      cur->done = 1;
+      r->job = NULL;
+      r->busy = 0;
+      cond_broadcast(&pool->done);
+    }
+  mutex_unlock(&pool->lock);
+  return 0;
+}
+
+
+/*
+** Stop the reader threads and close their connections.
+*/
+static void pool_shutdown(pool_data *pool)
+{
+  int i;
+
+  mutex_lock(&pool->lock);
+  pool->stopping = 1;
+  for (i = 0; i < pool->nreaders; i++)
+    cond_signal(&pool->readers[i].wake);
+  mutex_unlock(&pool->lock);
+  for (i = 0; i < pool->nreaders; i++)
+    {
+      pool_reader *r = &pool->readers[i];
+      if (r->started)
+        thread_join(r->thread);
+      cache_trim(&r->conn, 0);
+      sqlite3_close(r->conn.sql_conn);
+      cond_destroy(&r->wake);
+    }
+  free(pool->readers);
+  pool->readers = NULL;
+  pool->nreaders = 0;
+  mutex_destroy(&pool->lock);
+  cond_destroy(&pool->done);
+}
+
+
+/*
+** Wait until a reader is free and claim it.
+*/
+static pool_reader *pool_claim(pool_data *pool)
+{
+  pool_reader *r = NULL;
+  int i;
+
+  mutex_lock(&pool->lock);
+  while (r == NULL)
+    {
+      for (i = 0; i < pool->nreaders && r == NULL; i++)
+        if (!pool->readers[i].busy)
+          r = &pool->readers[i];
+      if (r == NULL)
+        {
+          /* readers waiting for their rows to be read must go on */
+          pool->starved = 1;
+          for (i = 0; i < pool->nreaders; i++)
+            cond_signal(&pool->readers[i].wake);
+          cond_wait(&pool->done, &pool->lock);
+        }
+    }
+  pool->starved = 0;
+  r->busy = 1;
+  mutex_unlock(&pool->lock);
+  return r;
+}
+
+
+static void pool_unclaim(pool_data *pool, pool_reader *r)
+{
+  mutex_lock(&pool->lock);
+  r->busy = 0;
+  cond_broadcast(&pool->done);
+  mutex_unlock(&pool->lock);
+}
+
+
+/*
+** Make the next batch of a pool cursor readable, with the lock of the
+** pool held, and let its reader go on.
+** Return true if the cursor has a row to read.
+*/
+static int pcur_take(pool_cursor *cur)
+{
+  row_batch *b = cur->reading;
+  if (b != NULL && b->next < b->nvalues)
+    return 1;
+  if (cur->head == NULL)
+    return 0;
+  if (b != NULL)
+    {
+      batch_free(b);
+      free(b);
+    }
+  cur->reading = cur->head;
+  cur->head = cur->head->link;
+  if (cur->head == NULL)
+    cur->tail = NULL;
+  cur->queued--;
+  cond_signal(&cur->reader->wake);
+  return 1;
+}
+
+
+/*
+** Wait until a pool cursor has a row to read or its query is done.
+** Return true for a row.
+*/
+static int pcur_wait(pool_cursor *cur)
+{
+  pool_data *pool = cur->pool_data;
+  int res;
+
+  if (cur->reading != NULL && cur->reading->next < cur->reading->nvalues)
+    return 1;
+  mutex_lock(&pool->lock);
+  while (!(res = pcur_take(cur)) && !cur->done)
+    cond_wait(&pool->done, &pool->lock);
+  mutex_unlock(&pool->lock);
+  return res;
+}
+
+
+/*
+** Wait for the query of a cursor and give its vm back to the reader.
+*/
+static void pcur_collect(lua_State *L, pool_cursor *cur)
+{
+  if (!cur->done)
+    {
+      mutex_lock(&cur->pool_data->lock);
+      while (!cur->done)
+        cond_wait(&cur->pool_data->done, &cur->pool_data->lock);
+      mutex_unlock(&cur->pool_data->lock);
+    }
+  if (cur->sql_vm != NULL)
+    {
+      release_vm(&cur->reader->conn, cur->sql_vm, NULL, cur->entry);
+      cur->sql_vm = NULL;
+      luaL_unref(L, LUA_REGISTRYINDEX, cur->anchors);
+      cur->anchors = LUA_NOREF;
+    }
+}
+
+
+/*
+** Close a pool cursor, stopping its query if it is still running.
+*/
+static void pcur_release(lua_State *L, pool_cursor *cur)
+{
+  pool_data *pool = cur->pool_data;
+  row_batch *b;
+
+  mutex_lock(&pool->lock);
+  cur->cancelled = 1;
+  if (!cur->done)
+    cond_signal(&cur->reader->wake);
+  mutex_unlock(&pool->lock);
+  pcur_collect(L, cur);
+  cur->closed = 1;
+  while ((b = cur->head) != NULL)
+    {
+      cur->head = b->link;
+      batch_free(b);
+      free(b);
+    }
+  cur->tail = NULL;
+  if (cur->reading != NULL)
+    {
+      batch_free(cur->reading);
+      free(cur->reading);
+      cur->reading = NULL;
+    }
+  free(cur->errmsg);
+  cur->errmsg = NULL;
+  cur->pool_data->cur_counter--;
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->colnames);
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->coltypes);
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->snapref);
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->pool);
+}
+
+
+/*
+** Run a query of a pool. Read-only queries returning rows are sent to a
+** reader, waiting for one to be free; anything else, and everything while
+** the writer is in a transaction, is run by the writer as conn:execute.
+** Lua Input: pool_or_snapshot, sql [, params]
+** Return a pool cursor (with its first rows if 'wait'), or the result of
+** conn:execute, or nil and an error message.
+*/
+static int pool_query(lua_State *L, pool_data *pool, void *snapshot, int wait)
+{
+  size_t len;
+  const char *sql = luaL_checklstring(L, 2, &len);
+  sqlite3_stmt *vm;
+  cache_entry *entry;
+  pool_reader *r;
+  pool_cursor *cur;
+  int res, anchors;
+
+  if (snapshot == NULL)
+    {
+      conn_data *writer = pool->writer_data;
+      int read;
+      res = acquire_vm(writer, sql, len, &vm, &entry);
+      if (res != SQLITE_OK)
+        return luasql_faildirect(L, sqlite3_errmsg(writer->sql_conn));
+      read = sqlite3_stmt_readonly(vm) && sqlite3_column_count(vm) > 0 &&
+             sqlite3_get_autocommit(writer->sql_conn);
+      release_vm(writer, vm, NULL, entry);
+      if (!read)
+        {
+          lua_rawgeti(L, LUA_REGISTRYINDEX, pool->writer);
+          lua_replace(L, 1);
+          return conn_execute(L);
+        }
+    }
+
+  r = pool_claim(pool);
+  res = acquire_vm(&r->conn, sql, len, &vm, &entry);
+  if (res != SQLITE_OK && snapshot == NULL)
+    {
+      /* functions and tables created on the writer only exist there */
+      pool_unclaim(pool, r);
+      lua_rawgeti(L, LUA_REGISTRYINDEX, pool->writer);
+      lua_replace(L, 1);
+      return conn_execute(L);
+    }
+  if (res != SQLITE_OK)
+    {
+      luasql_faildirect(L, sqlite3_errmsg(r->conn.sql_conn));
+      pool_unclaim(pool, r);
+      return 2;
+    }
+  res = raw_readparams(L, vm, 3);
+  if (res != SQLITE_OK)
+    {
+      if (res != LUASQL_BIND_MISUSE)
+        luasql_faildirect(L, sqlite3_errmsg(r->conn.sql_conn));
+      release_vm(&r->conn, vm, NULL, entry);
+      pool_unclaim(pool, r);
+      return bind_failed(L, res);
+    }
+  anchors = anchor_params(L, 3);
+
+  cur = (pool_cursor *)lua_newuserdata(L, sizeof(pool_cursor));
+  luasql_setmeta(L, LUASQL_POOLCURSOR_SQLITE);
+  memset(cur, 0, sizeof(pool_cursor));
+  pool->cur_counter++;
+  cur->pool_data = pool;
+  cur->reader = r;
+  cur->entry = entry;
+  cur->sql_vm = vm;
+  cur->snapshot = snapshot;
+  cur->anchors = anchors;
+  cur->numcols = sqlite3_column_count(vm);
+  cur->colnames = column_info(L, vm, cur->numcols, sqlite3_column_name);
+  cur->coltypes = column_info(L, vm, cur->numcols, sqlite3_column_decltype);
+  cur->snapref = LUA_NOREF;
+#ifdef SQLITE_ENABLE_SNAPSHOT
+  if (snapshot != NULL)
+    {
+      lua_pushvalue(L, 1);
+      cur->snapref = luaL_ref(L, LUA_REGISTRYINDEX);
+      lua_rawgeti(L, LUA_REGISTRYINDEX, ((snapshot_data *)snapshot)->pool);
+    }
+  else
+#endif
+    lua_pushvalue(L, 1);
+  cur->pool = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  mutex_lock(&pool->lock);
+#ifdef SQLITE_ENABLE_SNAPSHOT
+  if (snapshot != NULL)
+    ((snapshot_data *)snapshot)->running++;
+#endif
+  r->job = cur;
+  cond_signal(&r->wake);
+  mutex_unlock(&pool->lock);
+
+  if (wait && !pcur_wait(cur))
+    {
+      pcur_collect(L, cur);
+      if (cur->rc != SQLITE_DONE)
+        {
+          luasql_faildirect(L, cur->errmsg ? cur->errmsg : "not enough memory");
+          pcur_release(L, cur);
+          return 2;
+        }
+    }
+  return 1;
+}
+
+
+/*
+** Execute an SQL statement, waiting for the first rows of a query.
+** Lua Input: sql [, params]
+** Return a pool cursor over the rows of a query, or as conn:execute.
+*/
+static int pool_execute(lua_State *L)
+{
+  return pool_query(L, getpool(L), NULL, 1);
+}
+
+
+/*
+** Start an SQL statement without waiting for the rows of a query, so
+** several of them can run at the same time.
+** Lua Input: sql [, params]
+** Return a pool cursor, which waits for the rows when they are fetched,
+** or as conn:execute.
+*/
+static int pool_submit(lua_State *L)
+{
+  return pool_query(L, getpool(L), NULL, 0);
+}
+
+
+/*
+** Return the writer connection of a pool, e.g. to run transactions.
+*/
+static int pool_writer(lua_State *L)
+{
+  pool_data *pool = getpool(L);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, pool->writer);
+  return 1;
+}
+
+
+/*
+** Pool object collector function
+*/
+static int pool_gc(lua_State *L)
+{
+  pool_data *pool = (pool_data *)luaL_checkudata(L, 1, LUASQL_POOL_SQLITE);
+  if (pool != NULL && !(pool->closed))
+    {
+      if (pool->cur_counter > 0)
+        return luaL_error(L, LUASQL_PREFIX"there are open cursors");
+
+      /* Nullify structure fields. */
+      pool->closed = 1;
+      pool_shutdown(pool);
+      /* a writer with open objects is left to its own collector */
+      lua_pushcfunction(L, conn_close);
+      lua_rawgeti(L, LUA_REGISTRYINDEX, pool->writer);
+      if (lua_pcall(L, 1, 0, 0) != 0)
+        lua_pop(L, 1);
+      luaL_unref(L, LUA_REGISTRYINDEX, pool->writer);
+      luaL_unref(L, LUA_REGISTRYINDEX, pool->env);
+    }
+  return 0;
+}
+
+
+/*
+** Close a pool, its writer and its readers.
+** Return true on success or false if the pool was already closed.
+*/
+static int pool_close(lua_State *L)
+{
+  pool_data *pool = (pool_data *)luaL_checkudata(L, 1, LUASQL_POOL_SQLITE);
+  luaL_argcheck(L, pool != NULL, 1, LUASQL_PREFIX"pool expected");
+  if (pool->closed)
+    {
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+  pool_gc(L);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Push one value of a row of a batch.
+*/
+static void push_pool_value(lua_State *L, row_batch *b, pool_value *v)
+{
+  switch (v->type) {
+  case SQLITE_INTEGER:
+#if LUA_VERSION_NUM >= 503
+    lua_pushinteger(L, v->v.i);
+#else
+    lua_pushnumber(L, v->v.i);
+#endif
+    break;
+  case SQLITE_FLOAT:
+    lua_pushnumber(L, v->v.d);
+    break;
+  case SQLITE_TEXT:
+  case SQLITE_BLOB:
+    lua_pushlstring(L, b->text + v->v.offset, (size_t)v->len);
+    break;
+  default:
+    lua_pushnil(L);
+  }
+}
+
+
+/*
+** Return a row of a batch as cur:fetch does: as values, or copied into the
+** table at stack index 2 with the options at index 3.
+*/
+static int push_row(lua_State *L, row_batch *b, pool_value *row, int numcols,
+                    int colnames)
+{
+  int i;
+
+  if (lua_istable (L, 2))
+    {
+      const char *opts = luaL_optstring(L, 3, "n");
+      if (strchr(opts, 'n') != NULL)
+        {
+          /* Copy values to numerical indices */
+          for (i = 0; i < numcols;)
+            {
+              push_pool_value(L, b, &row[i]);
               lua_rawseti(L, 2, ++i);
             }
         }
       if (strchr(opts, 'a') != NULL)
         {
           /* Copy values to alphanumerical indices */
-          lua_rawgeti(L, LUA_REGISTRYINDEX, cur->colnames);
-
-          for (i = 0; i < cur->numcols; i++)
+          lua_rawgeti(L, LUA_REGISTRYINDEX, colnames);
+          for (i = 0; i < numcols; i++)
             {
               lua_rawgeti(L, -1, i+1);
-              push_column(L, vm, i);
+              push_pool_value(L, b, &row[i]);
               lua_rawset (L, 2);
             }
         }
       lua_pushvalue(L, 2);
       return 1; /* return table */
     }
+  luaL_checkstack (L, numcols, LUASQL_PREFIX"too many columns");
+  for (i = 0; i < numcols; i++)
+    push_pool_value(L, b, &row[i]);
+  return numcols;
+}
+
+
+/*
+** Get the next row of a pool cursor, waiting for its query if needed.
+** Same interface as cur:fetch.
+*/
+static int pcur_fetch(lua_State *L)
+{
+  pool_cursor *cur = getpoolcursor(L);
+  row_batch *b;
+  pool_value *row;
+
+  if (!pcur_wait(cur))
+    {
+      pcur_collect(L, cur);
+      if (cur->rc != SQLITE_DONE)
+        {
+          luasql_faildirect(L, cur->errmsg ? cur->errmsg : "not enough memory");
+          pcur_release(L, cur);
+          return 2;
+        }
+      pcur_release(L, cur);
+      lua_pushnil(L);
+      return 1;
+    }
+  b = cur->reading;
+  row = &b->values[b->next];
+  b->next += cur->numcols;
+  return push_row(L, b, row, cur->numcols, cur->colnames);
+}
+
+
+/*
+** Return true if the next fetch of a pool cursor would not wait: it has
+** rows to read or its query is finished.
+*/
+static int pcur_ready(lua_State *L)
+{
+  pool_cursor *cur = getpoolcursor(L);
+  int ready;
+  mutex_lock(&cur->pool_data->lock);
+  ready = cur->done || cur->head != NULL ||
+          (cur->reading != NULL && cur->reading->next < cur->reading->nvalues);
+  mutex_unlock(&cur->pool_data->lock);
+  lua_pushboolean(L, ready);
+  return 1;
+}
+
+
+static int pcur_getcolnames(lua_State *L)
+{
+  pool_cursor *cur = getpoolcursor(L);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, cur->colnames);
+  return 1;
+}
+
+
+static int pcur_getcoltypes(lua_State *L)
+{
+  pool_cursor *cur = getpoolcursor(L);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, cur->coltypes);
+  return 1;
+}
+
+
+/*
+** Pool cursor object collector function
+*/
+static int pcur_gc(lua_State *L)
+{
+  pool_cursor *cur = (pool_cursor *)luaL_checkudata(L, 1, LUASQL_POOLCURSOR_SQLITE);
+  if (cur != NULL && !(cur->closed))
+    pcur_release(L, cur);
+  return 0;
+}
+
+
+/*
+** Close a pool cursor, stopping its query if it is still running.
+** Return true on success or false if it was already closed.
+*/
+static int pcur_close(lua_State *L)
+{
+  pool_cursor *cur = (pool_cursor *)luaL_checkudata(L, 1, LUASQL_POOLCURSOR_SQLITE);
+  luaL_argcheck(L, cur != NULL, 1, LUASQL_PREFIX"cursor expected");
+  if (cur->closed)
+    {
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+  pcur_release(L, cur);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+#ifdef SQLITE_ENABLE_SNAPSHOT
+/*
+** Check for valid snapshot, whose pool must be open.
+*/
+static snapshot_data *getsnapshot(lua_State *L) {
+  snapshot_data *snap = (snapshot_data *)luaL_checkudata(L, 1, LUASQL_SNAPSHOT_SQLITE);
+  luaL_argcheck(L, snap != NULL, 1, LUASQL_PREFIX"snapshot expected");
+  luaL_argcheck(L, !snap->closed, 1, LUASQL_PREFIX"snapshot is closed");
+  luaL_argcheck(L, !snap->pool_data->closed, 1, LUASQL_PREFIX"pool is closed");
+  return snap;
+}
+
+
+/*
+** Record the current state of the database, so several queries can read
+** the same data even if it is written meanwhile.
+** Return a Snapshot object, or nil and an error message.
+*/
+static int pool_snapshot(lua_State *L)
+{
+  pool_data *pool = getpool(L);
+  sqlite3 *db = pool->writer_data->sql_conn;
+  sqlite3_snapshot *snapshot = NULL;
+  snapshot_data *snap;
+  int res;
+
+  if (!sqlite3_get_autocommit(db))
+    return luasql_faildirect(L, "the writer is in a transaction");
+  /* a snapshot is taken inside a read transaction */
+  res = sqlite3_exec(db, "BEGIN; SELECT count(*) FROM sqlite_master", NULL, NULL, NULL);
+  if (res == SQLITE_OK)
+    res = sqlite3_snapshot_get(db, "main", &snapshot);
+  if (res != SQLITE_OK)
+    luasql_faildirect(L, sqlite3_errmsg(db));
+  sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+  if (res != SQLITE_OK)
+    return 2;
+
+  snap = (snapshot_data *)lua_newuserdata(L, sizeof(snapshot_data));
+  luasql_setmeta(L, LUASQL_SNAPSHOT_SQLITE);
+  snap->closed = 0;
+  snap->pool_data = pool;
+  snap->snapshot = snapshot;
+  snap->running = 0;
+  lua_pushvalue(L, 1);
+  snap->pool = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+
+/*
+** Run a query on the snapshot, as pool:execute and pool:submit.
+*/
+static int snap_execute(lua_State *L)
+{
+  snapshot_data *snap = getsnapshot(L);
+  return pool_query(L, snap->pool_data, snap, 1);
+}
+
+
+static int snap_submit(lua_State *L)
+{
+  snapshot_data *snap = getsnapshot(L);
+  return pool_query(L, snap->pool_data, snap, 0);
+}
+
+
+/*
+** Snapshot object collector function
+*/
+static int snap_gc(lua_State *L)
+{
+  snapshot_data *snap = (snapshot_data *)luaL_checkudata(L, 1, LUASQL_SNAPSHOT_SQLITE);
+  if (snap != NULL && !(snap->closed))
+    {
+      pool_data *pool = snap->pool_data;
+      /* queries still running use the snapshot */
+      if (!pool->closed)
+        {
+          mutex_lock(&pool->lock);
+          while (snap->running > 0)
+            cond_wait(&pool->done, &pool->lock);
+          mutex_unlock(&pool->lock);
+        }
+      snap->closed = 1;
+      sqlite3_snapshot_free(snap->snapshot);
+      snap->snapshot = NULL;
+      luaL_unref(L, LUA_REGISTRYINDEX, snap->pool);
+    }
+  return 0;
+}
+
+
+static int snap_close(lua_State *L)
+{
+  snapshot_data *snap = (snapshot_data *)luaL_checkudata(L, 1, LUASQL_SNAPSHOT_SQLITE);
+  luaL_argcheck(L, snap != NULL, 1, LUASQL_PREFIX"snapshot expected");
+  if (snap->closed)
+    {
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+  snap_gc(L);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+#endif
+
+
+/*
+** Open a pool of connections to a database file: one writer and several
+** read-only connections, each one run by its own thread, so queries can
+** run in parallel. The database is put in WAL mode unless told otherwise.
+** Lua Input: path [, options]
+**   options: the options of env:connect, plus 'readers', the number of
+**     read-only connections
+** Return a Pool object, or nil and an error message.
+*/
+static int env_pool(lua_State *L)
+{
+  const char *path;
+  conn_options opts, ropts;
+  lua_Integer nreaders = LUASQL_SQLITE_POOL_READERS;
+  pool_data *pool;
+  sqlite3 *db;
+  int res, i, cache_size;
+  const char *errmsg;
+
+  getenvironment(L);  /* validate environment */
+  path = luaL_checkstring(L, 2);
+  errmsg = mem_check(L, 1);
+  if (errmsg != NULL)
+    return luasql_faildirect(L, errmsg);
+  memset(&opts, 0, sizeof(opts));
+  opts.flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+  opts.timeout = -1;
+  opts.statement_cache = -1;
+  if (lua_istable(L, 3))
+    {
+      read_options(L, 3, &opts);
+      opt_integer(L, 3, "readers", &nreaders);
+      luaL_argcheck(L, nreaders > 0 && nreaders <= LUASQL_SQLITE_POOL_MAX_READERS,
+                    3, LUASQL_PREFIX"invalid number of readers");
+    }
   else
+    luaL_argcheck(L, lua_isnoneornil(L, 3), 3, LUASQL_PREFIX"table of options expected");
+  luaL_argcheck(L, strstr(path, ":memory:") == NULL && !opts.immutable, 2,
+                LUASQL_PREFIX"pools need a database file");
+  luaL_argcheck(L, !(opts.flags & SQLITE_OPEN_READONLY), 3,
+                LUASQL_PREFIX"pools need a writable database");
+  if (!sqlite3_threadsafe())
+    return luasql_faildirect(L, "pools need a thread-safe SQLite");
+  if (opts.journal_mode == NULL)
+    opts.journal_mode = "WAL";
+  cache_size = opts.statement_cache >= 0 ? opts.statement_cache : LUASQL_SQLITE_CACHE_SIZE;
+  lua_settop(L, 3);
+
+  /* the writer is an ordinary connection */
+  res = sqlite3_open_v2(path, &db, opts.flags, NULL);
+  if (res == SQLITE_OK)
+    res = apply_options(db, &opts);
+  if (res != SQLITE_OK)
     {
-      int i;
-      luaL_checkstack (L, cur->numcols, LUASQL_PREFIX"too many columns");
-      for (i = 0; i < cur->numcols; ++i)
-        push_column(L, vm, i);
-      return cur->numcols; /* return #numcols values */
+      luasql_faildirect(L, sqlite3_errmsg(db));
+      sqlite3_close(db);
+      return 2;
+    }
+  create_connection(L, 1, db);
+  ((conn_data *)lua_touserdata(L, 4))->cache_size = cache_size;
+  ((conn_data *)lua_touserdata(L, 4))->query_timeout = opts.query_timeout;
+  ((conn_data *)lua_touserdata(L, 4))->begin_mode = opts.begin_mode;
+
+  pool = (pool_data *)lua_newuserdata(L, sizeof(pool_data));
+  memset(pool, 0, sizeof(pool_data));
+  pool->readers = (pool_reader *)calloc((size_t)nreaders, sizeof(pool_reader));
+  if (pool->readers == NULL)
+    return luaL_error(L, LUASQL_PREFIX"not enough memory");
+  luasql_setmeta(L, LUASQL_POOL_SQLITE);
+  mutex_init(&pool->lock);
+  cond_init(&pool->done);
+  pool->nreaders = (int)nreaders;
+  pool->writer_data = (conn_data *)lua_touserdata(L, 4);
+  lua_pushvalue(L, 4);
+  pool->writer = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_pushvalue(L, 1);
+  pool->env = luaL_ref(L, LUA_REGISTRYINDEX);
+  for (i = 0; i < pool->nreaders; i++)
+    cond_init(&pool->readers[i].wake);
+
+  /* the readers share their connections with the Lua state */
+  ropts = opts;
+  ropts.flags = SQLITE_OPEN_READONLY | SQLITE_OPEN_FULLMUTEX |
+                (opts.flags & (SQLITE_OPEN_URI | SQLITE_OPEN_SHAREDCACHE |
+                               SQLITE_OPEN_PRIVATECACHE));
+  ropts.journal_mode = NULL;
+  ropts.synchronous = NULL;
+  for (i = 0; i < pool->nreaders && res == SQLITE_OK; i++)
+    {
+      pool_reader *r = &pool->readers[i];
+      r->pool = pool;
+      r->conn.cache_size = cache_size;
+      r->conn.onstats = LUA_NOREF;
+      r->conn.onchange = LUA_NOREF;
+      res = sqlite3_open_v2(path, &r->conn.sql_conn, ropts.flags, NULL);
+      if (res == SQLITE_OK)
+        res = apply_options(r->conn.sql_conn, &ropts);
+      if (res == SQLITE_OK)
+        add_modules(r->conn.sql_conn);
+      if (res != SQLITE_OK)
+        luasql_faildirect(L, sqlite3_errmsg(r->conn.sql_conn));
+      else if (!thread_start(&r->thread, reader_main, r))
+        {
+          res = SQLITE_ERROR;
+          luasql_faildirect(L, "could not start reader thread");
+        }
+      else
+        r->started = 1;
     }
+  if (res != SQLITE_OK)
+    {
+      lua_pushcfunction(L, pool_close);
+      lua_pushvalue(L, 5);
+      lua_call(L, 1, 0);
+      return 2;
+    }
+  return 1;
+}
+
+
+/*
+** Check for valid shards.
+*/
+static shards_data *getshards(lua_State *L) {
+  shards_data *shards = (shards_data *)luaL_checkudata(L, 1, LUASQL_SHARDS_SQLITE);
+  luaL_argcheck(L, shards != NULL, 1, LUASQL_PREFIX"shards expected");
+  luaL_argcheck(L, !shards->closed, 1, LUASQL_PREFIX"shards are closed");
+  return shards;
+}
+
+
+/*
+** Check for valid shard cursor.
+*/
+static shard_cursor *getshardcursor(lua_State *L) {
+  shard_cursor *cur = (shard_cursor *)luaL_checkudata(L, 1, LUASQL_SHARDCURSOR_SQLITE);
+  luaL_argcheck(L, cur != NULL, 1, LUASQL_PREFIX"cursor expected");
+  luaL_argcheck(L, !cur->closed, 1, LUASQL_PREFIX"cursor is closed");
+  return cur;
+}
+
+
+/*
+** Hand a batch of rows over to the Lua state, from a worker.
+** Return true if the rows of the cursor are not wanted anymore.
+*/
+static int shard_handover(shards_data *shards, shard_task *t, row_batch *b)
+{
+  int cancelled;
+  mutex_lock(&shards->lock);
+  if (t->tail != NULL)
+    t->tail->link = b;
+  else
+    t->head = b;
+  t->tail = b;
+  t->queued++;
+  cond_broadcast(&shards->changed);
+  while (t->queued >= LUASQL_SQLITE_POOL_BATCHES && !t->cur->cancelled &&
+         !shards->starved)
+    cond_wait(&shards->room, &shards->lock);
+  cancelled = t->cur->cancelled;
+  mutex_unlock(&shards->lock);
+  return cancelled;
 }
 
 
 /*
-** Cursor object collector function
+** Run the query of a task in a worker, handing its rows over in batches
+** as they come. The connection is locked for each step only, as the
+** queries of other cursors may run on the same shard.
 */
-static int cur_gc(lua_State *L)
+static void shard_run(shards_data *shards, shard_task *t)
 {
-  cur_data *cur = (cur_data *)luaL_checkudata(L, 1, LUASQL_CURSOR_SQLITE);
-  if (cur != NULL && !(cur->closed))
+  sqlite3 *db = t->conn->sql_conn;
+  sqlite3_mutex *mutex = sqlite3_db_mutex(db);
+  int numcols = t->cur->numcols;
+  row_batch *b = NULL;
+  int rc = SQLITE_ROW, stop = 0;
+
+  while (rc == SQLITE_ROW && !stop)
     {
-      sqlite3_finalize(cur->sql_vm);
-      cur_nullify(L, cur);
+      sqlite3_mutex_enter(mutex);
+      rc = sqlite3_step(t->sql_vm);
+      if (rc == SQLITE_ROW)
+        {
+          if (b == NULL)
+            b = (row_batch *)calloc(1, sizeof(row_batch));
+          if (b == NULL || !batch_append(b, t->sql_vm, numcols))
+            rc = SQLITE_NOMEM;
+        }
+      else if (rc == SQLITE_DONE && numcols == 0)
+        t->changes = sqlite3_changes(db);
+      if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+        {
+          const char *errmsg = rc == SQLITE_NOMEM ? "not enough memory" : sqlite3_errmsg(db);
+          t->errmsg = (char *)malloc(strlen(errmsg) + 1);
+          if (t->errmsg != NULL)
+            strcpy(t->errmsg, errmsg);
+        }
+      sqlite3_mutex_leave(mutex);
+      if (b != NULL && (rc != SQLITE_ROW ||
+                        b->nvalues >= (size_t)LUASQL_SQLITE_BATCH * numcols))
+        {
+          stop = shard_handover(shards, t, b);
+          b = NULL;
+        }
     }
-  return 0;
+  t->rc = rc;
 }
 
 
 /*
-** Close the cursor on top of the stack.
-** Return 1
+** Main function of the worker threads of shards.
 */
-static int cur_close(lua_State *L)
+static THREAD_RESULT shard_worker(void *arg)
 {
-  cur_data *cur = (cur_data *)luaL_checkudata(L, 1, LUASQL_CURSOR_SQLITE);
-  luaL_argcheck(L, cur != NULL, 1, LUASQL_PREFIX"cursor expected");
-  if (cur->closed) {
-    lua_pushboolean(L, 0);
-    return 1;
-  }
-  sqlite3_finalize(cur->sql_vm);
-  cur_nullify(L, cur);
-  lua_pushboolean(L, 1);
-  return 1;
+  shards_data *shards = (shards_data *)arg;
+  shard_task *t;
+
+  mutex_lock(&shards->lock);
+  for (;;)
+    {
+      while (shards->queue == NULL && !shards->stopping)
+        cond_wait(&shards->work, &shards->lock);
+      t = shards->queue;
+      if (t == NULL)
+        break;
+      shards->queue = t->link;
+      if (shards->queue == NULL)
+        shards->queue_tail = NULL;
+      if (!t->cur->cancelled)
+        {
+          mutex_unlock(&shards->lock);
+          shard_run(shards, t);
+          mutex_lock(&shards->lock);
+          if (t->rc != SQLITE_DONE && !t->cur->cancelled && t->cur->failed == 0)
+            t->cur->failed = (int)(t - t->cur->tasks) + 1;
+        }
+      t->done = 1;
+      t->cur->running--;
+      cond_broadcast(&shards->changed);
+    }
+  mutex_unlock(&shards->lock);
+  return 0;
 }
 
 
 /*
-** Return the list of field names.
+** Wait for the workers of shards, with their lock held. The workers
+** waiting for their rows to be read go on meanwhile, as the task waited
+** for may be queued behind them; the caller clears 'starved' once done.
 */
-static int cur_getcolnames(lua_State *L)
+static void shards_wait(shards_data *shards)
 {
-  cur_data *cur = getcursor(L);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, cur->colnames);
-  return 1;
+  shards->starved = 1;
+  cond_broadcast(&shards->room);
+  cond_wait(&shards->changed, &shards->lock);
 }
 
 
 /*
-** Return the list of field types.
+** Make the next batch of a task readable by the Lua state, with the lock
+** of the shards held.
+** Return true if the task has a row to read.
 */
-static int cur_getcoltypes(lua_State *L)
+static int task_take(shards_data *shards, shard_task *t)
 {
-  cur_data *cur = getcursor(L);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, cur->coltypes);
+  row_batch *b = t->reading;
+  if (b != NULL && b->next < b->nvalues)
+    return 1;
+  if (t->head == NULL)
+    return 0;
+  if (b != NULL)
+    {
+      batch_free(b);
+      free(b);
+    }
+  t->reading = t->head;
+  t->head = t->head->link;
+  if (t->head == NULL)
+    t->tail = NULL;
+  t->queued--;
+  cond_broadcast(&shards->room);
   return 1;
 }
 
 
 /*
-** Create a new Cursor object and push it on top of the stack.
+** Wait until a task has a row to read or is done.
+** Return 1 for a row, 0 at the end of its rows or -1 if a task failed.
 */
-/* static int create_cursor(lua_State *L, int conn, sqlite3_stmt *sql_vm,
-   int numcols, const char **row, const char **col_info)*/
-static int create_cursor(lua_State *L, int o, conn_data *conn,
-			 sqlite3_stmt *sql_vm, int numcols)
+static int task_wait(shard_cursor *cur, shard_task *t)
 {
-  int i;
-  cur_data *cur = (cur_data*)lua_newuserdata(L, sizeof(cur_data));
-  luasql_setmeta (L, LUASQL_CURSOR_SQLITE);
+  shards_data *shards = cur->shards_data;
+  int res;
 
-  /* increment cursor count for the connection creating this cursor */
-  conn->cur_counter++;
+  if (t->reading != NULL && t->reading->next < t->reading->nvalues)
+    return 1;
+  mutex_lock(&shards->lock);
+  for (;;)
+    {
+      if (cur->failed)
+        res = -1;
+      else if (task_take(shards, t))
+        res = 1;
+      else if (t->done)
+        res = 0;
+      else
+        {
+          shards_wait(shards);
+          continue;
+        }
+      break;
+    }
+  shards->starved = 0;
+  mutex_unlock(&shards->lock);
+  return res;
+}
 
-  /* fill in structure */
-  cur->closed = 0;
-  cur->conn = LUA_NOREF;
-  cur->numcols = numcols;
-  cur->colnames = LUA_NOREF;
-  cur->coltypes = LUA_NOREF;
-  cur->sql_vm = sql_vm;
-  cur->conn_data = conn;
 
-  lua_pushvalue(L, o);
-  cur->conn = luaL_ref(L, LUA_REGISTRYINDEX);
+/*
+** Find the task with the next row in arrival order, going round the
+** shards so none of them is starved.
+** Return 1 and the task, 0 at the end of the rows or -1 if a task failed.
+*/
+static int scur_arrival(shard_cursor *cur, shard_task **task)
+{
+  shards_data *shards = cur->shards_data;
+  shard_task *t = &cur->tasks[cur->last];
+  int i, res = 0;
 
-  /* create table with column names */
-  lua_newtable(L);
-  for (i = 0; i < numcols;)
+  if (t->reading != NULL && t->reading->next < t->reading->nvalues)
     {
-      lua_pushstring(L, sqlite3_column_name(sql_vm, i));
-      lua_rawseti(L, -2, ++i);
+      *task = t;
+      return 1;
     }
-  cur->colnames = luaL_ref(L, LUA_REGISTRYINDEX);
-
-  /* create table with column types */
-  lua_newtable(L);
-  for (i = 0; i < numcols;)
+  mutex_lock(&shards->lock);
+  for (;;)
     {
-      lua_pushstring(L, sqlite3_column_decltype(sql_vm, i));
-      lua_rawseti(L, -2, ++i);
+      if (cur->failed)
+        {
+          res = -1;
+          break;
+        }
+      for (i = 0; i < cur->ntasks && res == 0; i++)
+        {
+          cur->last = (cur->last + 1) % cur->ntasks;
+          if (task_take(shards, &cur->tasks[cur->last]))
+            res = 1;
+        }
+      if (res != 0 || cur->running == 0)
+        break;
+      shards_wait(shards);
     }
-  cur->coltypes = luaL_ref(L, LUA_REGISTRYINDEX);
+  shards->starved = 0;
+  mutex_unlock(&shards->lock);
+  *task = &cur->tasks[cur->last];
+  return res;
+}
 
-  return 1;
+
+/*
+** Rank of the storage class of a value in the ORDER BY of SQLite.
+*/
+static int value_class(int type)
+{
+  switch (type) {
+  case SQLITE_INTEGER:
+  case SQLITE_FLOAT:
+    return 1;
+  case SQLITE_TEXT:
+    return 2;
+  case SQLITE_BLOB:
+    return 3;
+  default:
+    return 0;
+  }
 }
 
 
 /*
-** Connection object collector function
+** Compare two values as the ORDER BY of SQLite does, with the binary
+** collation for text.
 */
-static int conn_gc(lua_State *L)
+static int compare_values(row_batch *ba, pool_value *a, row_batch *bb, pool_value *b)
 {
-  conn_data *conn = (conn_data *)luaL_checkudata(L, 1, LUASQL_CONNECTION_SQLITE);
-  if (conn != NULL && !(conn->closed))
-    {
-      if (conn->cur_counter > 0)
-        return luaL_error (L, LUASQL_PREFIX"there are open cursors");
+  int ca = value_class(a->type), cb = value_class(b->type);
+  int res;
 
-      /* Nullify structure fields. */
-      conn->closed = 1;
-      luaL_unref(L, LUA_REGISTRYINDEX, conn->env);
-      sqlite3_close(conn->sql_conn);
-    }
-  return 0;
+  if (ca != cb)
+    return ca < cb ? -1 : 1;
+  switch (ca) {
+  case 0:
+    return 0;
+  case 1:
+    if (a->type == SQLITE_INTEGER && b->type == SQLITE_INTEGER)
+      return a->v.i < b->v.i ? -1 : a->v.i > b->v.i;
+    else
+      {
+        double da = a->type == SQLITE_INTEGER ? (double)a->v.i : a->v.d;
+        double db = b->type == SQLITE_INTEGER ? (double)b->v.i : b->v.d;
+        return da < db ? -1 : da > db;
+      }
+  default:
+    res = memcmp(ba->text + a->v.offset, bb->text + b->v.offset,
+                 (size_t)(a->len < b->len ? a->len : b->len));
+    if (res != 0)
+      return res;
+    return a->len < b->len ? -1 : a->len > b->len;
+  }
 }
 
 
 /*
-** Close a Connection object.
+** Check whether the next row of task 'a' comes before the one of task
+** 'b' in the merge; ties keep the order of the shards.
 */
-static int conn_close(lua_State *L)
+static int task_before(shard_cursor *cur, int a, int b)
 {
-  conn_data *conn = (conn_data *)luaL_checkudata(L, 1, LUASQL_CONNECTION_SQLITE);
-  luaL_argcheck (L, conn != NULL, 1, LUASQL_PREFIX"connection expected");
-  if (conn->closed)
+  row_batch *ba = cur->tasks[a].reading, *bb = cur->tasks[b].reading;
+  pool_value *ra = &ba->values[ba->next], *rb = &bb->values[bb->next];
+  int i;
+
+  for (i = 0; i < cur->nkeys; i++)
     {
-      lua_pushboolean(L, 0);
-      return 1;
+      int col = abs(cur->keys[i]) - 1;
+      int res = compare_values(ba, &ra[col], bb, &rb[col]);
+      if (res != 0)
+        return cur->keys[i] > 0 ? res < 0 : res > 0;
     }
-  conn_gc(L);
-  lua_pushboolean(L, 1);
-  return 1;
+  return a < b;
 }
 
-static int conn_escape(lua_State *L)
+
+/*
+** Move down the task at position 'pos' of the merge heap.
+*/
+static void heap_down(shard_cursor *cur, int pos)
 {
-  const char *from = luaL_checklstring (L, 2, 0);
-  char *escaped = sqlite3_mprintf("%q", from);
-  if (escaped == NULL)
-    {
-      lua_pushnil(L);
-    }
-  else
+  int *heap = cur->heap;
+  for (;;)
     {
-      lua_pushstring(L, escaped);
-      sqlite3_free(escaped);
+      int child = 2 * pos + 1, tmp;
+      if (child >= cur->nheap)
+        break;
+      if (child + 1 < cur->nheap && task_before(cur, heap[child + 1], heap[child]))
+        child++;
+      if (!task_before(cur, heap[child], heap[pos]))
+        break;
+      tmp = heap[pos];
+      heap[pos] = heap[child];
+      heap[child] = tmp;
+      pos = child;
     }
-  return 1;
 }
 
 
 /*
-** Bind one parameter.
-** Supported are the data types nil, string, boolean, number.
+** Find the task with the next row of a k-way merge of the shards, each
+** one already sorted by the keys. The merge waits for the first row of
+** every shard, then for the next row of the shard whose row was fetched.
+** Return 1 and the task, 0 at the end of the rows or -1 if a task failed.
 */
-static int set_param(lua_State *L, sqlite3_stmt *vm, int param_nr, int arg)
+static int scur_merge(shard_cursor *cur, shard_task **task)
 {
-  int tt = lua_type(L, arg);
-  int rc = 0;
-
-  switch (tt) {
-    case LUA_TNIL:
-    rc = sqlite3_bind_null(vm, param_nr);
-    break;
+  int i, res;
 
-    case LUA_TSTRING: {
-    size_t s_len;
-    const char *s = lua_tolstring(L, arg, &s_len);
-    rc = sqlite3_bind_null(vm, param_nr);
-    rc = sqlite3_bind_text(vm, param_nr, s, s_len, SQLITE_TRANSIENT);
-    break;
+  if (cur->nheap < 0)
+    {
+      cur->nheap = 0;
+      for (i = 0; i < cur->ntasks; i++)
+        {
+          res = task_wait(cur, &cur->tasks[i]);
+          if (res < 0)
+            return -1;
+          if (res > 0)
+            cur->heap[cur->nheap++] = i;
+        }
+      for (i = cur->nheap / 2 - 1; i >= 0; i--)
+        heap_down(cur, i);
     }
-
-    case LUA_TBOOLEAN: {
-      int val = lua_tointeger(L, arg);
-      rc = sqlite3_bind_int(vm, param_nr, val);
+  else if (cur->advance && cur->nheap > 0)
+    {
+      res = task_wait(cur, &cur->tasks[cur->heap[0]]);
+      if (res < 0)
+        return -1;
+      if (res == 0)
+        cur->heap[0] = cur->heap[--cur->nheap];
+      heap_down(cur, 0);
     }
-    break;
-
-    case LUA_TNUMBER:
-    if (lua_isinteger(L, arg)) {
-      lua_Integer val = lua_tointeger(L, arg);
-      rc = sqlite3_bind_int64(vm, param_nr, val);
-    } else {
-      double val = lua_tonumber(L, arg);
-      rc = sqlite3_bind_double(vm, param_nr, val);
+  cur->advance = 0;
+  if (cur->nheap == 0)
+    {
+      /* the last rows may have been read before a shard failed */
+      mutex_lock(&cur->shards_data->lock);
+      res = cur->failed ? -1 : 0;
+      mutex_unlock(&cur->shards_data->lock);
+      return res;
     }
-    break;
-
-    default:
-    luaL_error(L, LUASQL_PREFIX"unhandled data type %s in parameter binding",
-      lua_typename(L, tt));
-  }
-
-  return rc;
+  cur->advance = 1;
+  *task = &cur->tasks[cur->heap[0]];
+  return 1;
 }
 
-static int raw_readparams_args(lua_State *L, sqlite3_stmt *vm, int arg, int ltop)
-{
-  int param_count, param_nr, rc = 0;
-
-  param_count = sqlite3_bind_parameter_count(vm);
-  if (ltop - arg + 1 != param_count)
-    luaL_error(L, LUASQL_PREFIX"wrong number of parameters: expected=%d, given=%d",
-      param_count, ltop - arg + 1);
 
-  for (param_nr=1; param_nr <= param_count; param_nr ++, arg ++) {
-    rc = set_param(L, vm, param_nr, arg);
-    if (rc)
-      break;
-  }
+/*
+** Close a shard cursor, stopping its queries and waiting for them.
+*/
+static void scur_release(lua_State *L, shard_cursor *cur)
+{
+  shards_data *shards = cur->shards_data;
+  int i;
 
-  return rc;
+  mutex_lock(&shards->lock);
+  cur->cancelled = 1;
+  while (cur->running > 0)
+    shards_wait(shards);
+  shards->starved = 0;
+  mutex_unlock(&shards->lock);
+  for (i = 0; i < cur->ntasks; i++)
+    {
+      shard_task *t = &cur->tasks[i];
+      if (t->sql_vm != NULL)
+        release_vm(t->conn, t->sql_vm, NULL, t->entry);
+      while (t->head != NULL)
+        {
+          row_batch *b = t->head;
+          t->head = b->link;
+          batch_free(b);
+          free(b);
+        }
+      if (t->reading != NULL)
+        {
+          batch_free(t->reading);
+          free(t->reading);
+        }
+      free(t->errmsg);
+    }
+  free(cur->tasks);
+  cur->tasks = NULL;
+  free(cur->keys);
+  cur->keys = NULL;
+  free(cur->heap);
+  cur->heap = NULL;
+  cur->closed = 1;
+  shards->cur_counter--;
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->anchors);
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->colnames);
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->coltypes);
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->shards);
 }
 
+
 /*
-** Bind all parameters from the given table.
-** The table indices can be integers or strings.
-** Unbound parameters, or duplicate bindings are not detected.
+** Read the merge keys of a query from the list at stack index 'arg':
+** column numbers or names, negative or prefixed by '-' when descending.
 */
-static int raw_readparams_table(lua_State *L, sqlite3_stmt *vm, int arg)
+static void read_merge_keys(lua_State *L, shard_cursor *cur, int arg,
+                            sqlite3_stmt *vm)
 {
-  int param_nr, rc = 0, tt;
-
-  lua_pushnil(L);
+  int i, col;
 
-  while (lua_next(L, arg)) {		// [arg]=table, [-2]=key, [-1]=val
-    tt = lua_type(L, -2);
-    if (tt == LUA_TNUMBER && lua_isinteger(L, -2)) {
-      param_nr = lua_tointeger(L, -2);
-    } else {
-      const char *param_name = lua_tostring(L, -2);
-      param_nr = sqlite3_bind_parameter_index(vm, param_name);
-      if (param_nr == 0)
-        luaL_error(L, LUASQL_PREFIX"binding to invalid parameter name %s\n",
-          param_name);
+  for (i = 0; i < cur->nkeys; i++)
+    {
+      lua_rawgeti(L, arg, i + 1);
+      if (lua_type(L, -1) == LUA_TNUMBER)
+        {
+          col = (int)lua_tointeger(L, -1);
+          if (col == 0 || abs(col) > cur->numcols)
+            col = 0;
+        }
+      else if (lua_type(L, -1) == LUA_TSTRING)
+        {
+          const char *name = lua_tostring(L, -1);
+          int desc = (*name == '-');
+          name += desc;
+          for (col = cur->numcols; col > 0; col--)
+            if (strcmp(sqlite3_column_name(vm, col - 1), name) == 0)
+              break;
+          if (desc)
+            col = -col;
+        }
+      else
+        col = 0;
+      lua_pop(L, 1);
+      if (col == 0)
+        {
+          scur_release(L, cur);
+          luaL_argerror(L, arg, LUASQL_PREFIX"invalid merge key");
+        }
+      cur->keys[i] = col;
     }
-    set_param(L, vm, param_nr, -1);
-    lua_pop(L, 1);
-  }
-
-  return rc;
 }
 
+
 /*
-** Execute an SQL statement.
-** Return a Cursor object if the statement is a query, otherwise
-** return the number of tuples affected by the statement.
+** Run a statement on every shard, each one on a worker.
+** Lua Input: shards, sql [, keys], [params]
+**   keys: at stack index 3 if 'merge', then the parameters follow it
+** Return a shard cursor over the rows of a query, which are fetched while
+** the shards still run it, or the total number of rows changed by other
+** statements, or nil and an error message.
 */
-static int conn_execute(lua_State *L)
+static int shards_query(lua_State *L, shards_data *shards, int merge)
 {
-  conn_data *conn = getconnection(L);
-  const char *statement = luaL_checkstring(L, 2);
-  int res;
-  sqlite3_stmt *vm;
-  const char *errmsg;
-  int numcols;
-  const char *tail;
+  size_t len;
+  const char *sql = luaL_checklstring(L, 2, &len);
+  int params = merge ? 4 : 3;
+  shard_cursor *cur;
+  int i, res = SQLITE_OK;
 
-#if SQLITE_VERSION_NUMBER > 3006013
-  res = sqlite3_prepare_v2(conn->sql_conn, statement, -1, &vm, &tail);
-#else
-  res = sqlite3_prepare(conn->sql_conn, statement, -1, &vm, &tail);
-#endif
+  if (merge)
+    luaL_checktype(L, 3, LUA_TTABLE);
+  if (lua_gettop(L) < params - 1)
+    lua_settop(L, params - 1);
+
+  cur = (shard_cursor *)lua_newuserdata(L, sizeof(shard_cursor));
+  memset(cur, 0, sizeof(shard_cursor));
+  cur->shards = cur->anchors = cur->colnames = cur->coltypes = LUA_NOREF;
+  cur->shards_data = shards;
+  cur->nheap = -1;
+  cur->tasks = (shard_task *)calloc((size_t)shards->nshards, sizeof(shard_task));
+  luasql_setmeta(L, LUASQL_SHARDCURSOR_SQLITE);
+  shards->cur_counter++;
+  lua_pushvalue(L, 1);
+  cur->shards = luaL_ref(L, LUA_REGISTRYINDEX);
+  /* the cursor goes below the parameters */
+  lua_insert(L, params);
+  params++;
+  if (cur->tasks == NULL)
+    {
+      scur_release(L, cur);
+      return luaL_error(L, LUASQL_PREFIX"not enough memory");
+    }
+
+  for (i = 0; i < shards->nshards && res == SQLITE_OK; i++)
+    {
+      shard_task *t = &cur->tasks[i];
+      t->cur = cur;
+      t->conn = &shards->shards[i];
+      t->conn->L = L;
+      t->done = 1;
+      res = acquire_vm(t->conn, sql, len, &t->sql_vm, &t->entry);
+      if (res != SQLITE_OK)
+        {
+          t->sql_vm = NULL;
+          luasql_faildirect(L, sqlite3_errmsg(t->conn->sql_conn));
+          break;
+        }
+      cur->ntasks++;
+      if (i == 0)
+        cur->numcols = sqlite3_column_count(t->sql_vm);
+      else if (sqlite3_column_count(t->sql_vm) != cur->numcols)
+        {
+          res = SQLITE_ERROR;
+          luasql_faildirect(L, "shards return different columns");
+          break;
+        }
+      res = raw_readparams(L, t->sql_vm, params);
+      if (res != SQLITE_OK && res != LUASQL_BIND_MISUSE)
+        luasql_faildirect(L, sqlite3_errmsg(t->conn->sql_conn));
+    }
   if (res != SQLITE_OK)
     {
-      errmsg = sqlite3_errmsg(conn->sql_conn);
-      return luasql_faildirect(L, errmsg);
+      scur_release(L, cur);
+      return res == LUASQL_BIND_MISUSE ? lua_error(L) : 2;
     }
 
-  /* Bind parameters (if any) */
-  int ltop = lua_gettop(L);
-  if (ltop > 2) {
-    if (ltop == 3 && lua_type(L, 3) == LUA_TTABLE) {
-      res = raw_readparams_table(L, vm, 3);
-    } else if (ltop >= 3) {
-      res = raw_readparams_args(L, vm, 3, ltop);
-    } else {
-      luaL_error(L, LUASQL_PREFIX"parameters are either one table or positional");
+  if (merge && cur->numcols > 0)
+    {
+      cur->nkeys = (int)lua_rawlen(L, 3);
+      cur->keys = (int *)malloc((cur->nkeys + 1) * sizeof(int));
+      cur->heap = (int *)malloc(cur->ntasks * sizeof(int));
+      if (cur->keys == NULL || cur->heap == NULL)
+        {
+          scur_release(L, cur);
+          return luaL_error(L, LUASQL_PREFIX"not enough memory");
+        }
+      read_merge_keys(L, cur, 3, cur->tasks[0].sql_vm);
     }
-    if (res)
-      return res;
-  }
-
-  /* process first result to retrieve query information and type */
-  res = sqlite3_step(vm);
-  numcols = sqlite3_column_count(vm);
+  cur->anchors = anchor_params(L, params);
+  cur->colnames = column_info(L, cur->tasks[0].sql_vm, cur->numcols, sqlite3_column_name);
+  cur->coltypes = column_info(L, cur->tasks[0].sql_vm, cur->numcols, sqlite3_column_decltype);
 
-  /* real query? if empty, must have numcols!=0 */
-  if ((res == SQLITE_ROW) || ((res == SQLITE_DONE) && numcols))
+  mutex_lock(&shards->lock);
+  for (i = 0; i < cur->ntasks; i++)
     {
-      sqlite3_reset(vm);
-      return create_cursor(L, 1, conn, vm, numcols);
+      shard_task *t = &cur->tasks[i];
+      t->done = 0;
+      if (shards->queue_tail != NULL)
+        shards->queue_tail->link = t;
+      else
+        shards->queue = t;
+      shards->queue_tail = t;
     }
+  cur->running = cur->ntasks;
+  cond_broadcast(&shards->work);
 
-  if (res == SQLITE_DONE) /* and numcols==0, INSERT,UPDATE,DELETE statement */
+  if (cur->numcols == 0)
     {
-      sqlite3_finalize(vm);
-      /* return number of columns changed */
-      lua_pushnumber(L, sqlite3_changes(conn->sql_conn));
+      /* statements without rows return the changes of all the shards */
+      lua_Number changes = 0;
+      while (cur->running > 0)
+        shards_wait(shards);
+      shards->starved = 0;
+      mutex_unlock(&shards->lock);
+      for (i = 0; i < cur->ntasks; i++)
+        changes += cur->tasks[i].changes;
+      if (cur->failed)
+        {
+          shard_task *t = &cur->tasks[cur->failed - 1];
+          luasql_faildirect(L, t->errmsg ? t->errmsg : "not enough memory");
+          scur_release(L, cur);
+          return 2;
+        }
+      scur_release(L, cur);
+      lua_pushnumber(L, changes);
       return 1;
     }
+  mutex_unlock(&shards->lock);
+  lua_pushvalue(L, params - 1);
+  return 1;
+}
 
-  /* error */
-  errmsg = sqlite3_errmsg(conn->sql_conn);
-  sqlite3_finalize(vm);
-  return luasql_faildirect(L, errmsg);
+
+/*
+** Run a statement on every shard, returning the rows of a query in the
+** order they arrive.
+** Lua Input: sql [, params]
+*/
+static int shards_execute(lua_State *L)
+{
+  return shards_query(L, getshards(L), 0);
 }
 
 
 /*
-** Commit the current transaction.
+** Run a query on every shard, merging the rows of the shards by the given
+** keys. The query must sort the rows of each shard by the same keys.
+** Lua Input: sql, keys [, params]
 */
-static int conn_commit(lua_State *L)
+static int shards_merge(lua_State *L)
 {
-  char *errmsg;
-  conn_data *conn = getconnection(L);
-  int res;
-  const char *sql = "COMMIT";
+  return shards_query(L, getshards(L), 1);
+}
 
-  if (conn->auto_commit == 0) sql = "COMMIT;BEGIN";
 
-  res = sqlite3_exec(conn->sql_conn, sql, NULL, NULL, &errmsg);
+/*
+** Stop the workers of shards and close the connections.
+*/
+static void shards_shutdown(shards_data *shards)
+{
+  int i;
 
-  if (res != SQLITE_OK)
+  mutex_lock(&shards->lock);
+  shards->stopping = 1;
+  cond_broadcast(&shards->work);
+  mutex_unlock(&shards->lock);
+  for (i = 0; i < shards->nworkers; i++)
+    thread_join(shards->workers[i]);
+  for (i = 0; i < shards->nshards; i++)
     {
-      lua_pushnil(L);
-      lua_pushliteral(L, LUASQL_PREFIX);
-      lua_pushstring(L, errmsg);
-      sqlite3_free(errmsg);
-      lua_concat(L, 2);
-      return 2;
+      cache_trim(&shards->shards[i], 0);
+      sqlite3_close(shards->shards[i].sql_conn);
+    }
+  free(shards->workers);
+  shards->workers = NULL;
+  shards->nworkers = 0;
+  free(shards->shards);
+  shards->shards = NULL;
+  shards->nshards = 0;
+  mutex_destroy(&shards->lock);
+  cond_destroy(&shards->work);
+  cond_destroy(&shards->changed);
+  cond_destroy(&shards->room);
+}
+
+
+/*
+** Shards object collector function
+*/
+static int shards_gc(lua_State *L)
+{
+  shards_data *shards = (shards_data *)luaL_checkudata(L, 1, LUASQL_SHARDS_SQLITE);
+  if (shards != NULL && !(shards->closed))
+    {
+      if (shards->cur_counter > 0)
+        return luaL_error(L, LUASQL_PREFIX"there are open cursors");
+      shards->closed = 1;
+      shards_shutdown(shards);
+      luaL_unref(L, LUA_REGISTRYINDEX, shards->env);
+    }
+  return 0;
+}
+
+
+/*
+** Close shards, their workers and their connections.
+** Return true on success or false if they were already closed.
+*/
+static int shards_close(lua_State *L)
+{
+  shards_data *shards = (shards_data *)luaL_checkudata(L, 1, LUASQL_SHARDS_SQLITE);
+  luaL_argcheck(L, shards != NULL, 1, LUASQL_PREFIX"shards expected");
+  if (shards->closed)
+    {
+      lua_pushboolean(L, 0);
+      return 1;
     }
+  shards_gc(L);
   lua_pushboolean(L, 1);
   return 1;
 }
 
 
 /*
-** Rollback the current transaction.
+** Get the next row of a shard cursor, waiting for the shards if needed.
+** Same interface as cur:fetch.
 */
-static int conn_rollback(lua_State *L)
+static int scur_fetch(lua_State *L)
 {
-  char *errmsg;
-  conn_data *conn = getconnection(L);
+  shard_cursor *cur = getshardcursor(L);
+  shard_task *t;
+  pool_value *row;
   int res;
-  const char *sql = "ROLLBACK";
 
-  if (conn->auto_commit == 0) sql = "ROLLBACK;BEGIN";
-
-  res = sqlite3_exec(conn->sql_conn, sql, NULL, NULL, &errmsg);
-  if (res != SQLITE_OK)
+  res = cur->nkeys > 0 ? scur_merge(cur, &t) : scur_arrival(cur, &t);
+  if (res < 0)
     {
-      lua_pushnil(L);
-      lua_pushliteral(L, LUASQL_PREFIX);
-      lua_pushstring(L, errmsg);
-      sqlite3_free(errmsg);
-      lua_concat(L, 2);
+      shard_task *f = &cur->tasks[cur->failed - 1];
+      luasql_faildirect(L, f->errmsg ? f->errmsg : "not enough memory");
+      scur_release(L, cur);
       return 2;
     }
-  lua_pushboolean(L, 1);
+  if (res == 0)
+    {
+      scur_release(L, cur);
+      lua_pushnil(L);
+      return 1;
+    }
+  row = &t->reading->values[t->reading->next];
+  t->reading->next += cur->numcols;
+  return push_row(L, t->reading, row, cur->numcols, cur->colnames);
+}
+
+
+static int scur_getcolnames(lua_State *L)
+{
+  shard_cursor *cur = getshardcursor(L);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, cur->colnames);
   return 1;
 }
 
-static int conn_getlastautoid(lua_State *L)
+
+static int scur_getcoltypes(lua_State *L)
 {
-  conn_data *conn = getconnection(L);
-  lua_pushnumber(L, sqlite3_last_insert_rowid(conn->sql_conn));
+  shard_cursor *cur = getshardcursor(L);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, cur->coltypes);
   return 1;
 }
 
 
 /*
-** Set "auto commit" property of the connection.
-** If 'true', then rollback current transaction.
-** If 'false', then start a new transaction.
+** Shard cursor object collector function
 */
-static int conn_setautocommit(lua_State *L)
+static int scur_gc(lua_State *L)
 {
-  conn_data *conn = getconnection(L);
-  if (lua_toboolean(L, 2))
+  shard_cursor *cur = (shard_cursor *)luaL_checkudata(L, 1, LUASQL_SHARDCURSOR_SQLITE);
+  if (cur != NULL && !(cur->closed))
+    scur_release(L, cur);
+  return 0;
+}
+
+
+/*
+** Close a shard cursor, stopping the queries still running.
+** Return true on success or false if it was already closed.
+*/
+static int scur_close(lua_State *L)
+{
+  shard_cursor *cur = (shard_cursor *)luaL_checkudata(L, 1, LUASQL_SHARDCURSOR_SQLITE);
+  luaL_argcheck(L, cur != NULL, 1, LUASQL_PREFIX"cursor expected");
+  if (cur->closed)
     {
-      conn->auto_commit = 1;
-      /* undo active transaction - ignore errors */
-      (void) sqlite3_exec(conn->sql_conn, "ROLLBACK", NULL, NULL, NULL);
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+  scur_release(L, cur);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Open a set of database files, the shards of the same schema, queried
+** together by a pool of worker threads.
+** Lua Input: paths [, options]
+**   paths: list of database files
+**   options: the options of env:connect, plus 'workers', the number of
+**     threads running the queries
+** Return a Shards object, or nil and an error message.
+*/
+static int env_shards(lua_State *L)
+{
+  conn_options opts;
+  lua_Integer nworkers = LUASQL_SQLITE_POOL_READERS;
+  shards_data *shards;
+  int res = SQLITE_OK, i, n, cache_size;
+  const char *errmsg;
+
+  getenvironment(L);  /* validate environment */
+  luaL_checktype(L, 2, LUA_TTABLE);
+  errmsg = mem_check(L, 1);
+  if (errmsg != NULL)
+    return luasql_faildirect(L, errmsg);
+  n = (int)lua_rawlen(L, 2);
+  luaL_argcheck(L, n > 0, 2, LUASQL_PREFIX"no shards given");
+  for (i = 1; i <= n; i++)
+    {
+      lua_rawgeti(L, 2, i);
+      luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 2,
+                    LUASQL_PREFIX"list of database files expected");
+      lua_pop(L, 1);
+    }
+  memset(&opts, 0, sizeof(opts));
+  opts.flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+  opts.timeout = -1;
+  opts.statement_cache = -1;
+  if (n < nworkers)
+    nworkers = n;
+  if (lua_istable(L, 3))
+    {
+      read_options(L, 3, &opts);
+      opt_integer(L, 3, "workers", &nworkers);
+      luaL_argcheck(L, nworkers > 0 && nworkers <= LUASQL_SQLITE_POOL_MAX_READERS,
+                    3, LUASQL_PREFIX"invalid number of workers");
     }
   else
+    luaL_argcheck(L, lua_isnoneornil(L, 3), 3, LUASQL_PREFIX"table of options expected");
+  if (!sqlite3_threadsafe())
+    return luasql_faildirect(L, "shards need a thread-safe SQLite");
+  /* the connections are shared by the workers and the Lua state */
+  opts.flags = (opts.flags & ~SQLITE_OPEN_NOMUTEX) | SQLITE_OPEN_FULLMUTEX;
+  cache_size = opts.statement_cache >= 0 ? opts.statement_cache : LUASQL_SQLITE_CACHE_SIZE;
+  lua_settop(L, 3);
+
+  shards = (shards_data *)lua_newuserdata(L, sizeof(shards_data));
+  memset(shards, 0, sizeof(shards_data));
+  shards->shards = (conn_data *)calloc((size_t)n, sizeof(conn_data));
+  shards->workers = (luasql_thread *)calloc((size_t)nworkers, sizeof(luasql_thread));
+  if (shards->shards == NULL || shards->workers == NULL)
     {
-      char *errmsg;
-      int res;
-      conn->auto_commit = 0;
-      res = sqlite3_exec(conn->sql_conn, "BEGIN", NULL, NULL, &errmsg);
+      free(shards->shards);
+      free(shards->workers);
+      return luaL_error(L, LUASQL_PREFIX"not enough memory");
+    }
+  luasql_setmeta(L, LUASQL_SHARDS_SQLITE);
+  mutex_init(&shards->lock);
+  cond_init(&shards->work);
+  cond_init(&shards->changed);
+  cond_init(&shards->room);
+  lua_pushvalue(L, 1);
+  shards->env = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  for (i = 0; i < n && res == SQLITE_OK; i++)
+    {
+      conn_data *conn = &shards->shards[i];
+      const char *path;
+      int flags = opts.flags;
+      lua_rawgeti(L, 2, i + 1);
+      path = lua_tostring(L, -1);
+#if SQLITE_VERSION_NUMBER > 3006013
+      if (opts.immutable)
+        {
+          push_immutable_uri(L, path, flags & SQLITE_OPEN_URI);
+          path = lua_tostring(L, -1);
+          flags |= SQLITE_OPEN_URI;
+        }
+#endif
+      conn->cache_size = cache_size;
+      conn->onstats = LUA_NOREF;
+      conn->onchange = LUA_NOREF;
+      res = sqlite3_open_v2(path, &conn->sql_conn, flags, NULL);
+      shards->nshards++;
+      if (res == SQLITE_OK)
+        res = apply_options(conn->sql_conn, &opts);
+      if (res == SQLITE_OK)
+        add_modules(conn->sql_conn);
       if (res != SQLITE_OK)
+        luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+      else
+        lua_settop(L, 4);
+    }
+  for (i = 0; i < nworkers && res == SQLITE_OK; i++)
+    {
+      if (!thread_start(&shards->workers[i], shard_worker, shards))
         {
-	  lua_pushliteral(L, LUASQL_PREFIX);
-	  lua_pushstring(L, errmsg);
-	  sqlite3_free(errmsg);
-	  lua_concat(L, 2);
-	  lua_error(L);
+          res = SQLITE_ERROR;
+          luasql_faildirect(L, "could not start worker thread");
         }
+      else
+        shards->nworkers++;
+    }
+  if (res != SQLITE_OK)
+    {
+      lua_pushcfunction(L, shards_close);
+      lua_pushvalue(L, 4);
+      lua_call(L, 1, 0);
+      return 2;
     }
-  lua_pushboolean(L, 1);
   return 1;
 }
 
 
 /*
-** Create a new Connection object and push it on top of the stack.
+** The memory methods route SQLite's allocations through the allocator
+** of a Lua state, see mem_check, and each block keeps its size in a
+** header. Once the state is closed, allocations fail and the blocks
+** still held by SQLite are left alone.
 */
-static int create_connection(lua_State *L, int env, sqlite3 *sql_conn)
+#define LUASQL_MEM_HEADER 8
+
+static void *mem_malloc(int n)
 {
-  conn_data *conn = (conn_data*)lua_newuserdata(L, sizeof(conn_data));
-  luasql_setmeta(L, LUASQL_CONNECTION_SQLITE);
+  char *p = NULL;
+  mutex_lock(&mem_lock);
+  if (!mem_closed)
+    p = (char *)mem_allocf(mem_ud, NULL, 0, (size_t)n + LUASQL_MEM_HEADER);
+  mutex_unlock(&mem_lock);
+  if (p == NULL)
+    return NULL;
+  *(sqlite3_int64 *)p = n;
+  return p + LUASQL_MEM_HEADER;
+}
 
-  /* fill in structure */
-  conn->closed = 0;
-  conn->env = LUA_NOREF;
-  conn->auto_commit = 1;
-  conn->sql_conn = sql_conn;
-  conn->cur_counter = 0;
-  lua_pushvalue (L, env);
-  conn->env = luaL_ref (L, LUA_REGISTRYINDEX);
-  return 1;
+static void mem_free(void *block)
+{
+  char *p = (char *)block - LUASQL_MEM_HEADER;
+  size_t size = (size_t)*(sqlite3_int64 *)p + LUASQL_MEM_HEADER;
+  mutex_lock(&mem_lock);
+  if (!mem_closed)
+    (void)mem_allocf(mem_ud, p, size, 0);
+  mutex_unlock(&mem_lock);
+}
+
+static void *mem_realloc(void *block, int n)
+{
+  char *p = (char *)block - LUASQL_MEM_HEADER;
+  size_t size = (size_t)*(sqlite3_int64 *)p + LUASQL_MEM_HEADER;
+  mutex_lock(&mem_lock);
+  p = mem_closed ? NULL :
+      (char *)mem_allocf(mem_ud, p, size, (size_t)n + LUASQL_MEM_HEADER);
+  mutex_unlock(&mem_lock);
+  if (p == NULL)
+    return NULL;
+  *(sqlite3_int64 *)p = n;
+  return p + LUASQL_MEM_HEADER;
+}
+
+static int mem_size(void *block)
+{
+  return (int)*(sqlite3_int64 *)((char *)block - LUASQL_MEM_HEADER);
+}
+
+static int mem_roundup(int n)
+{
+  return (n + 7) & ~7;
+}
+
+static int mem_init(void *ud)
+{
+  (void)ud;
+  return SQLITE_OK;
+}
+
+static void mem_shutdown(void *ud)
+{
+  (void)ud;
 }
 
 
 /*
-** Connects to a data source.
+** Collector of the sentinel kept by the state owning the allocator,
+** called when that state is closed, after its connections.
 */
-static int env_connect(lua_State *L)
+static int mem_release(lua_State *L)
 {
-  const char *sourcename;
-  sqlite3 *conn;
-  const char *errmsg;
-  int res;
-  bool readOnlyMode = false;
-  int mode;
+  (void)L;
+  mutex_lock(&mem_lock);
+  mem_closed = 1;
+  mutex_unlock(&mem_lock);
+  return 0;
+}
 
-  getenvironment(L);  /* validate environment */
 
-  if (lua_isboolean(L, 4)) {
-    if (lua_toboolean(L, 4)) {
-      readOnlyMode = true;
-    }
-  }
+/*
+** Set the allocator, page cache and lookaside options, then initialize
+** SQLite so they can not change anymore.
+** Return NULL or an error message.
+*/
+static const char *configure_arena(lua_State *L, const char *allocator,
+                                   lua_Integer pagecache, lua_Integer page,
+                                   lua_Integer lookaside, lua_Integer slot,
+                                   int has_lookaside)
+{
+  int res = SQLITE_OK, sz = 0;
 
-  sourcename = luaL_checkstring(L, 2);
-#if SQLITE_VERSION_NUMBER > 3006013
-  if (strstr(sourcename, ":memory:")) /* TODO: rework this and get/add param 'flag' for sqlite3_open_v2 - see TODO below */
-  {
-    if (readOnlyMode) {
-      mode = SQLITE_OPEN_READONLY | SQLITE_OPEN_MEMORY;
-    } else {
-      mode = SQLITE_OPEN_READWRITE | SQLITE_OPEN_MEMORY;
+  if (mem_configured)
+    return "memory of SQLite already configured";
+
+  /* the arena is allocated first, so a failure leaves SQLite untouched */
+  if (pagecache > 0)
+    {
+      int hdrsz = 256;
+#ifdef SQLITE_CONFIG_PCACHE_HDRSZ
+      sqlite3_config(SQLITE_CONFIG_PCACHE_HDRSZ, &hdrsz);
+#endif
+      sz = ((int)page + hdrsz + 7) & ~7;
+      if ((size_t)pagecache > (size_t)-1 / (size_t)sz)
+        return "pagecache too large";
+      mem_pagecache = malloc((size_t)pagecache * sz);
+      if (mem_pagecache == NULL)
+        return "cannot allocate the page cache";
     }
-  }
-  else
-  {
-    if (readOnlyMode) {
-      mode = SQLITE_OPEN_READONLY;
-    } else {
-      mode = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+
+  if (allocator != NULL && strcmp(allocator, "lua") == 0)
+    {
+      static const sqlite3_mem_methods methods = {
+        mem_malloc, mem_free, mem_realloc, mem_size, mem_roundup,
+        mem_init, mem_shutdown, NULL
+      };
+      if (!mem_lock_ready)
+        mutex_init(&mem_lock);
+      mem_lock_ready = 1;
+      mem_allocf = lua_getallocf(L, &mem_ud);
+      res = sqlite3_config(SQLITE_CONFIG_MALLOC, &methods);
     }
-  }
-  res = sqlite3_open_v2(sourcename, &conn, mode, NULL);
-#else
-  res = sqlite3_open(sourcename, &conn);
-#endif
+  if (res == SQLITE_OK && pagecache > 0)
+    res = sqlite3_config(SQLITE_CONFIG_PAGECACHE, mem_pagecache, sz, (int)pagecache);
+  if (res == SQLITE_OK && has_lookaside)
+    res = sqlite3_config(SQLITE_CONFIG_LOOKASIDE, (int)slot, (int)lookaside);
   if (res != SQLITE_OK)
     {
-      errmsg = sqlite3_errmsg(conn);
-      luasql_faildirect(L, errmsg);
-      sqlite3_close(conn);
-      return 2;
+      /* SQLite is in use: none of the options took effect */
+      free(mem_pagecache);
+      mem_pagecache = NULL;
+      mem_allocf = NULL;
+      return "memory options must be given before SQLite is first used";
+    }
+  if (sqlite3_initialize() != SQLITE_OK)
+    return "cannot initialize SQLite";
+  mem_configured = 1;
+  if (mem_allocf != NULL)
+    {
+      /* marks the owner for mem_check and tells when it is closed */
+      lua_pushlightuserdata(L, (void *)&mem_allocf);
+      lua_newuserdata(L, 1);
+      lua_newtable(L);
+      lua_pushcfunction(L, mem_release);
+      lua_setfield(L, -2, "__gc");
+      lua_setmetatable(L, -2);
+      lua_rawset(L, LUA_REGISTRYINDEX);
     }
+  return NULL;
+}
 
-  if (lua_isnumber(L, 3)) {
-  	sqlite3_busy_timeout(conn, lua_tonumber(L,3)); /* TODO: remove this */
-  }
 
-  return create_connection(L, 1, conn);
+/*
+** Configure the memory of SQLite from the options table at stack index
+** 't', before it is initialized: the allocator ("lua" for the one of the
+** given state), a preallocated page cache arena of 'pagecache' slots of
+** 'pagecache_page' bytes and the lookaside of each connection. Only the
+** heap limit can be changed later.
+** Return NULL or an error message.
+*/
+static const char *configure_memory(lua_State *L, int t)
+{
+  static const char *const allocators[] = {"system", "lua", NULL};
+  const char *allocator = opt_choice(L, t, "allocator", allocators);
+  lua_Integer pagecache = 0, page = 4096, lookaside = -1, slot = 1200, limit;
+  int has_lookaside, has_limit;
+  const char *errmsg;
+
+  has_limit = opt_integer(L, t, "heap_limit", &limit);
+  luaL_argcheck(L, !has_limit || limit >= 0, 1,
+                LUASQL_PREFIX"heap_limit must not be negative");
+  opt_integer(L, t, "pagecache", &pagecache);
+  opt_integer(L, t, "pagecache_page", &page);
+  has_lookaside = opt_integer(L, t, "lookaside", &lookaside);
+  opt_integer(L, t, "lookaside_size", &slot);
+  luaL_argcheck(L, pagecache >= 0 && pagecache <= INT_MAX, 1,
+                LUASQL_PREFIX"pagecache out of range");
+  luaL_argcheck(L, page >= 512 && page <= 65536 && (page & (page - 1)) == 0, 1,
+                LUASQL_PREFIX"pagecache_page must be a page size");
+  luaL_argcheck(L, lookaside >= -1 && lookaside <= INT_MAX, 1,
+                LUASQL_PREFIX"lookaside out of range");
+  luaL_argcheck(L, slot >= 0 && slot <= 65536, 1,
+                LUASQL_PREFIX"lookaside_size out of range");
+  if (allocator != NULL || pagecache > 0 || has_lookaside)
+    {
+      errmsg = configure_arena(L, allocator, pagecache, page, lookaside, slot,
+                               has_lookaside);
+      if (errmsg != NULL)
+        return errmsg;
+    }
+  /* this initializes SQLite, so it comes after the configuration */
+  if (has_limit)
+#if SQLITE_VERSION_NUMBER >= 3031000
+    sqlite3_hard_heap_limit64(limit);
+#else
+    sqlite3_soft_heap_limit64(limit);
+#endif
+  return NULL;
 }
 
 
@@ -732,6 +7733,25 @@ static int env_close (lua_State *L)
 }
 
 
+/*
+** Return the memory and page cache counters of the process.
+** Lua Input: [reset]
+**   reset: reset the highest values
+*/
+static int env_status(lua_State *L)
+{
+  getenvironment(L);
+  push_process_status(L, lua_toboolean(L, 2));
+#if SQLITE_VERSION_NUMBER >= 3031000
+  set_integer(L, "heap_limit", sqlite3_hard_heap_limit64(-1));
+#endif
+  set_integer(L, "soft_heap_limit", sqlite3_soft_heap_limit64(-1));
+  lua_pushstring(L, mem_allocf != NULL ? "lua" : "system");
+  lua_setfield(L, -2, "allocator");
+  return 1;
+}
+
+
 /*
 ** Sets the timeout for a lock in the connection.
 static int opts_settimeout  (lua_State *L)
@@ -752,18 +7772,59 @@ static void create_metatables (lua_State *L)
     {"__gc", env_gc},
     {"close", env_close},
     {"connect", env_connect},
+    {"deserialize", env_deserialize},
+    {"pool", env_pool},
+    {"shards", env_shards},
+    {"status", env_status},
     {NULL, NULL},
   };
   struct luaL_Reg connection_methods[] = {
     {"__gc", conn_gc},
     {"close", conn_close},
     {"escape", conn_escape},
-//    {"prepare", conn_prepare},
+    {"prepare", conn_prepare},
     {"execute", conn_execute},
+    {"executemany", conn_executemany},
+    {"executescript", conn_executescript},
     {"commit", conn_commit},
     {"rollback", conn_rollback},
     {"setautocommit", conn_setautocommit},
+    {"setbeginmode", conn_setbeginmode},
+    {"checkpoint", conn_checkpoint},
+    {"setcheckpointer", conn_setcheckpointer},
+    {"savepoint", conn_savepoint},
+    {"release", conn_release},
+    {"rollbackto", conn_rollbackto},
     {"getlastautoid", conn_getlastautoid},
+    {"setcachesize", conn_setcachesize},
+    {"getcachestats", conn_getcachestats},
+    {"setquerytimeout", conn_setquerytimeout},
+    {"setdeadline", conn_setdeadline},
+    {"interrupt", conn_interrupt},
+    {"setyield", conn_setyield},
+    {"onstats", conn_onstats},
+    {"status", conn_status},
+    {"onchange", conn_onchange},
+#ifdef LUASQL_SQLITE_SESSION
+    {"session", conn_session},
+    {"applychangeset", conn_applychangeset},
+#endif
+    {"openblob", conn_openblob},
+    {"createfunction", conn_createfunction},
+    {"createaggregate", conn_createaggregate},
+#ifdef LUASQL_SQLITE_CARRAY
+    {"array", conn_array},
+#endif
+    {"createvtab", conn_createvtab},
+    {"backup", conn_backup},
+    {"restore", conn_restore},
+    {"serialize", conn_serialize},
+    {NULL, NULL},
+  };
+  struct luaL_Reg statement_methods[] = {
+    {"__gc", stmt_gc},
+    {"close", stmt_close},
+    {"execute", stmt_execute},
     {NULL, NULL},
   };
   struct luaL_Reg cursor_methods[] = {
@@ -772,20 +7833,129 @@ static void create_metatables (lua_State *L)
     {"getcolnames", cur_getcolnames},
     {"getcoltypes", cur_getcoltypes},
     {"fetch", cur_fetch},
+    {"stats", cur_stats},
+    {NULL, NULL},
+  };
+  struct luaL_Reg blob_methods[] = {
+    {"__gc", blob_gc},
+    {"close", blob_close},
+    {"read", blob_read},
+    {"write", blob_write},
+    {"seek", blob_seek},
+    {"size", blob_size},
+    {"reopen", blob_reopen},
+    {NULL, NULL},
+  };
+  struct luaL_Reg backup_methods[] = {
+    {"__gc", backup_gc},
+    {"finish", backup_finish},
+    {"step", backup_step},
+    {"remaining", backup_remaining},
+    {"pagecount", backup_pagecount},
+    {NULL, NULL},
+  };
+  struct luaL_Reg pool_methods[] = {
+    {"__gc", pool_gc},
+    {"close", pool_close},
+    {"execute", pool_execute},
+    {"submit", pool_submit},
+    {"writer", pool_writer},
+#ifdef SQLITE_ENABLE_SNAPSHOT
+    {"snapshot", pool_snapshot},
+#endif
+    {NULL, NULL},
+  };
+  struct luaL_Reg poolcursor_methods[] = {
+    {"__gc", pcur_gc},
+    {"close", pcur_close},
+    {"getcolnames", pcur_getcolnames},
+    {"getcoltypes", pcur_getcoltypes},
+    {"fetch", pcur_fetch},
+    {"ready", pcur_ready},
+    {NULL, NULL},
+  };
+  struct luaL_Reg shards_methods[] = {
+    {"__gc", shards_gc},
+    {"close", shards_close},
+    {"execute", shards_execute},
+    {"merge", shards_merge},
+    {NULL, NULL},
+  };
+  struct luaL_Reg shardcursor_methods[] = {
+    {"__gc", scur_gc},
+    {"close", scur_close},
+    {"getcolnames", scur_getcolnames},
+    {"getcoltypes", scur_getcoltypes},
+    {"fetch", scur_fetch},
+    {NULL, NULL},
+  };
+#ifdef LUASQL_SQLITE_SESSION
+  struct luaL_Reg session_methods[] = {
+    {"__gc", session_gc},
+    {"close", session_close},
+    {"attach", session_attachmore},
+    {"changeset", session_changeset},
+    {"patchset", session_patchset},
+    {"isempty", session_isempty},
+    {"enable", session_enable},
+    {NULL, NULL},
+  };
+#endif
+#ifdef SQLITE_ENABLE_SNAPSHOT
+  struct luaL_Reg snapshot_methods[] = {
+    {"__gc", snap_gc},
+    {"close", snap_close},
+    {"execute", snap_execute},
+    {"submit", snap_submit},
+    {NULL, NULL},
+  };
+#endif
+  struct luaL_Reg array_methods[] = {
+    {"__len", array_len},
     {NULL, NULL},
   };
   luasql_createmeta(L, LUASQL_ENVIRONMENT_SQLITE, environment_methods);
   luasql_createmeta(L, LUASQL_CONNECTION_SQLITE, connection_methods);
+  luasql_createmeta(L, LUASQL_STATEMENT_SQLITE, statement_methods);
   luasql_createmeta(L, LUASQL_CURSOR_SQLITE, cursor_methods);
-  lua_pop (L, 3);
+  luasql_createmeta(L, LUASQL_BLOB_SQLITE, blob_methods);
+  luasql_createmeta(L, LUASQL_ARRAY_SQLITE, array_methods);
+  luasql_createmeta(L, LUASQL_BACKUP_SQLITE, backup_methods);
+  luasql_createmeta(L, LUASQL_POOL_SQLITE, pool_methods);
+  luasql_createmeta(L, LUASQL_POOLCURSOR_SQLITE, poolcursor_methods);
+  luasql_createmeta(L, LUASQL_SHARDS_SQLITE, shards_methods);
+  luasql_createmeta(L, LUASQL_SHARDCURSOR_SQLITE, shardcursor_methods);
+  lua_pop (L, 11);
+#ifdef SQLITE_ENABLE_SNAPSHOT
+  luasql_createmeta(L, LUASQL_SNAPSHOT_SQLITE, snapshot_methods);
+  lua_pop (L, 1);
+#endif
+#ifdef LUASQL_SQLITE_SESSION
+  luasql_createmeta(L, LUASQL_SESSION_SQLITE, session_methods);
+  lua_pop (L, 1);
+#endif
 }
 
 /*
 ** Creates an Environment and returns it.
+** Lua Input: [options]
+**   options: table with the memory configuration of the process
 */
 static int create_environment (lua_State *L)
 {
-  env_data *env = (env_data *)lua_newuserdata(L, sizeof(env_data));
+  env_data *env;
+  const char *errmsg = NULL;
+
+  if (!lua_isnoneornil(L, 1))
+    {
+      luaL_checktype(L, 1, LUA_TTABLE);
+      errmsg = configure_memory(L, 1);
+    }
+  if (errmsg == NULL)
+    errmsg = mem_check(L, 0);
+  if (errmsg != NULL)
+    return luasql_faildirect(L, errmsg);
+  env = (env_data *)lua_newuserdata(L, sizeof(env_data));
   luasql_setmeta(L, LUASQL_ENVIRONMENT_SQLITE);
 
   /* fill in structure */
@@ -21,5 +21,1313 @@ function finalization ()
 	os.execute ("rm -rf "..datasource)
 end
 
+---------------------------------------------------------------------
+-- Prepared statements can be executed many times.
+---------------------------------------------------------------------
+function prepare ()
+	local stmt = CONN:prepare"insert into t (f1, f2) values (?, ?)"
+	assert2 (1, stmt:execute("a", "b"))
+	assert2 (1, stmt:execute{"c", "d"})
+	assert2 (true, stmt:close(), "couldn't close statement")
+	assert2 (false, stmt:close())
+
+	stmt = CONN:prepare"select f2 from t where f1 = :key"
+	local cur = CUR_OK (stmt:execute{[":key"] = "a"})
+	assert2 ('b', cur:fetch())
+	-- the statement can't be executed again while a cursor is reading it
+	assert2 (false, pcall (stmt.execute, stmt, {[":key"] = "c"}))
+	assert2 (true, cur:close(), "couldn't close cursor")
+	cur = CUR_OK (stmt:execute{[":key"] = "c"})
+	assert2 ('d', cur:fetch())
+	assert2 (nil, cur:fetch())
+	assert2 (false, cur:close(), MSG_CURSOR_NOT_CLOSED)
+	assert2 (true, stmt:close(), "couldn't close statement")
+
+	assert2 (1, CONN:execute"delete from t where f1 = 'a'")
+	assert2 (1, CONN:execute"delete from t where f1 = 'c'")
+	io.write (" prepare")
+end
+
+---------------------------------------------------------------------
+-- The first row of a query is computed only once.
+---------------------------------------------------------------------
+function first_row ()
+	local major, minor = string.match (luasql._CLIENTVERSION, "^(%d+)%.(%d+)")
+	if tonumber(major) == 3 and tonumber(minor) < 35 then
+		return -- RETURNING is not supported
+	end
+	local cur = CUR_OK (CONN:execute"insert into t (f1) values ('a') returning f1")
+	assert2 ('a', cur:fetch())
+	assert2 (nil, cur:fetch())
+	cur = CUR_OK (CONN:execute"select count(*) from t")
+	assert2 (1, tonumber(cur:fetch()), "statement executed twice")
+	cur:close()
+	assert2 (1, CONN:execute"delete from t where f1 = 'a'")
+	io.write (" first_row")
+end
+
+---------------------------------------------------------------------
+-- Repeated statements reuse the vm kept by the statement cache.
+---------------------------------------------------------------------
+function statement_cache ()
+	assert2 (true, CONN:setcachesize(2))
+	local hits = CONN:getcachestats().hits
+	for _, v in ipairs{ 'a', 'b', 'c' } do
+		assert2 (1, CONN:execute("insert into t (f1) values (?)", v))
+	end
+	local stats = CONN:getcachestats()
+	assert2 (hits + 2, stats.hits, "statement was not reused")
+	assert2 (2, stats.size)
+	-- each open cursor keeps its own vm
+	local cur1 = CUR_OK (CONN:execute"select f1 from t order by f1")
+	local cur2 = CUR_OK (CONN:execute"select f1 from t order by f1")
+	assert2 ('a', cur1:fetch())
+	assert2 ('a', cur2:fetch())
+	assert2 ('b', cur1:fetch())
+	assert2 (true, cur1:close(), "couldn't close cursor")
+	assert2 (true, cur2:close(), "couldn't close cursor")
+	assert (CONN:getcachestats().count <= 2, "cache exceeds its size")
+	assert2 (true, CONN:setcachesize(0))
+	assert2 (0, CONN:getcachestats().count)
+	assert2 (true, CONN:setcachesize(16))
+	for _, v in ipairs{ 'a', 'b', 'c' } do
+		assert2 (1, CONN:execute("delete from t where f1 = ?", v))
+	end
+	io.write (" statement_cache")
+end
+
+---------------------------------------------------------------------
+-- Many rows can be written with a single call.
+---------------------------------------------------------------------
+function executemany ()
+	assert2 (3, CONN:executemany ("insert into t (f1, f2) values (?, ?)",
+		{ { 'a', 'b' }, { 'c', 'd' }, { 'e', 'f' } }))
+	assert2 (2, CONN:executemany ("update t set f2 = :v where f1 = :k",
+		{ { [":k"] = 'a', [":v"] = 'x' }, { [":k"] = 'e', [":v"] = 'y' } }))
+	local cur = CUR_OK (CONN:execute"select f2 from t order by f1")
+	assert2 ('x', cur:fetch())
+	assert2 ('d', cur:fetch())
+	assert2 ('y', cur:fetch())
+	assert2 (nil, cur:fetch())
+	-- a failing row undoes the whole call
+	assert2 (false, pcall (CONN.executemany, CONN, "insert into t (f1) values (?)",
+		{ { 'g' }, 'h' }))
+	cur = CUR_OK (CONN:execute"select count(*) from t")
+	assert2 (3, tonumber(cur:fetch()), "rows written by a failed call")
+	cur:close()
+	assert2 (3, CONN:executemany ("delete from t where f1 = ?",
+		{ { 'a' }, { 'c' }, { 'e' } }))
+	assert2 (1, CONN:execute"insert into t (f1) values ('a')")
+	assert2 (1, CONN:execute"delete from t where f1 = 'a'")
+	io.write (" executemany")
+end
+
+---------------------------------------------------------------------
+-- Strings bound to an open cursor survive the collection of their
+-- parameter table.
+---------------------------------------------------------------------
+function bound_strings ()
+	assert2 (3, CONN:executemany ("insert into t (f1) values (?)",
+		{ { 'a' }, { 'b' }, { 'c' } }))
+	local params = { string.rep ('z', 64) }
+	local cur = CUR_OK (CONN:execute ("select f1 from t where f1 < ?", params))
+	params[1] = nil
+	params = nil
+	collectgarbage ()
+	for i = 1, 1000 do
+		params = string.rep (tostring(i), 10)
+	end
+	collectgarbage ()
+	assert2 ('a', cur:fetch())
+	assert2 ('b', cur:fetch())
+	assert2 ('c', cur:fetch())
+	assert2 (nil, cur:fetch())
+	assert2 (3, CONN:executemany ("delete from t where f1 = ?",
+		{ { 'a' }, { 'b' }, { 'c' } }))
+	assert2 (1, CONN:execute"insert into t (f1) values ('a')")
+	assert2 (1, CONN:execute"delete from t where f1 = 'a'")
+	io.write (" bound_strings")
+end
+
+---------------------------------------------------------------------
+-- Open flags and startup pragmas given to env:connect.
+---------------------------------------------------------------------
+function connect_options ()
+	local file = datasource.."-options"
+	local function pragma (conn, name)
+		local cur = CUR_OK (conn:execute ("pragma "..name))
+		local value = cur:fetch()
+		cur:close()
+		return value
+	end
+	local conn = CONN_OK (ENV:connect (file, {
+		journal_mode = "wal",
+		synchronous = "normal",
+		cache_size = -4096,
+		mmap_size = 1048576,
+		temp_store = "memory",
+		statement_cache = 4,
+		timeout = 100,
+	}))
+	assert2 ("wal", pragma (conn, "journal_mode"))
+	assert2 (1, tonumber (pragma (conn, "synchronous")))
+	assert2 (-4096, tonumber (pragma (conn, "cache_size")))
+	assert2 (2, tonumber (pragma (conn, "temp_store")))
+	assert2 (4, conn:getcachestats().size)
+	assert2 (0, conn:execute"create table o (v)")
+	assert2 (1, conn:execute"insert into o values (1)")
+	assert2 (0, tonumber (pragma (conn, "wal_checkpoint(truncate)")))
+	assert2 (true, conn:close())
+	-- invalid values are rejected before opening the database
+	assert2 (false, pcall (ENV.connect, ENV, file, { journal_mode = "wal; drop table o" }))
+
+	conn = CONN_OK (ENV:connect (file, { readonly = true, immutable = true }))
+	local cur = CUR_OK (conn:execute"select v from o")
+	assert2 (1, tonumber (cur:fetch()))
+	cur:close()
+	assert2 (nil, conn:execute"insert into o values (2)")
+	assert2 (true, conn:close())
+	assert2 (nil, ENV:connect (file.."-missing", { create = false }))
+	os.remove (file)
+	os.remove (file.."-wal")
+	os.remove (file.."-shm")
+	io.write (" connect_options")
+end
+
+---------------------------------------------------------------------
+-- Incremental BLOB I/O.
+---------------------------------------------------------------------
+function blob ()
+	assert (CONN:execute"create table b (data blob)")
+	assert2 (1, CONN:execute"insert into b (rowid, data) values (1, zeroblob(10))")
+	assert2 (1, CONN:execute ("insert into b (rowid, data) values (2, ?)", "0123456789"))
+	local blob = CONN:openblob ("b", "data", 1, true)
+	assert2 (10, blob:size())
+	assert2 (true, blob:write"abcde")
+	assert2 (true, blob:write"fghij")
+	assert2 (0, blob:seek(0))
+	local chunks = {}
+	for chunk in function () return blob:read(4) end do
+		table.insert (chunks, chunk)
+	end
+	assert2 ("abcd|efgh|ij", table.concat (chunks, "|"))
+	-- blobs can't grow
+	assert2 (nil, blob:write ("x", 10))
+	assert2 (false, pcall (blob.write, blob, "x", 2^40))
+	assert2 (false, pcall (blob.reopen, blob, 1.5))
+	assert2 (true, blob:reopen(2))
+	assert2 ("0123", blob:read(4))
+	assert2 ("456789", blob:read())
+	assert2 (nil, blob:read())
+	assert2 (false, pcall (CONN.close, CONN))
+	assert2 (true, blob:close(), "couldn't close blob")
+	assert2 (false, blob:close())
+	assert2 (nil, CONN:openblob ("b", "data", 3))
+	local cur = CUR_OK (CONN:execute"select data from b where rowid = 1")
+	assert2 ("abcdefghij", cur:fetch())
+	cur:close()
+	assert (CONN:execute"drop table b")
+	io.write (" blob")
+end
+
+---------------------------------------------------------------------
+-- Lua functions called from SQL.
+---------------------------------------------------------------------
+function createfunction ()
+	assert2 (true, CONN:createfunction ("lua_upper", 1, function (s)
+		return s and s:upper()
+	end))
+	assert2 (true, CONN:createfunction ("lua_sum", -1, function (...)
+		local sum = 0
+		for i = 1, select ("#", ...) do sum = sum + select (i, ...) end
+		return sum
+	end))
+	assert2 (true, CONN:createfunction ("lua_fail", 0, function ()
+		error ("failed on purpose", 0)
+	end, { deterministic = false }))
+	local cur = CUR_OK (CONN:execute"select lua_upper('abc'), lua_upper(NULL), lua_sum(1, 2, 3.5), lua_sum()")
+	local upper, null, sum, zero = cur:fetch()
+	assert2 ("ABC", upper)
+	assert2 (nil, null)
+	assert2 (6.5, sum)
+	assert2 (0, zero)
+	cur:close()
+	cur = CUR_OK (CONN:execute"select x from (select 'a' as x union all select 'b') where lua_upper(x) = 'B'")
+	assert2 ("b", cur:fetch())
+	assert2 (nil, cur:fetch())
+	local res, err = CONN:execute"select lua_fail()"
+	assert2 (nil, res)
+	assert (err:find"failed on purpose", err)
+	-- removed functions are no longer callable
+	assert2 (true, CONN:createfunction ("lua_upper", 1, nil))
+	assert2 (nil, CONN:execute"select lua_upper('abc')")
+	io.write (" createfunction")
+end
+
+---------------------------------------------------------------------
+-- Lua aggregate and window functions.
+---------------------------------------------------------------------
+function createaggregate ()
+	local function add (state, v) return (state or 0) + v end
+	local function sub (state, v) return state - v end
+	local function result (state) return state or 0 end
+	assert2 (true, CONN:createaggregate ("lua_total", 1, add, result))
+	assert2 (true, CONN:createaggregate ("lua_concat", 1,
+		function (state, v)
+			state = state or {}
+			state[#state+1] = v
+			return state
+		end,
+		function (state) return state and table.concat (state, ",") end))
+	local groups = "select 'a' as g, 1 as v union all select 'b', 10 union all select 'a', 2 union all select 'b', 20 union all select 'a', 3"
+	local cur = CUR_OK (CONN:execute ("select g, lua_total(v), lua_concat(v) from ("..groups..") group by g order by g"))
+	local g, total, list = cur:fetch()
+	assert2 ("a", g)
+	assert2 (6, total)
+	assert2 ("1,2,3", list)
+	g, total, list = cur:fetch()
+	assert2 ("b", g)
+	assert2 (30, total)
+	assert2 ("10,20", list)
+	assert2 (nil, cur:fetch())
+	cur:close()
+	-- empty groups call final with a nil state
+	cur = CUR_OK (CONN:execute ("select lua_total(v), lua_concat(v) from ("..groups..") where v > 100"))
+	total, list = cur:fetch()
+	assert2 (0, total)
+	assert2 (nil, list)
+	cur:close()
+	-- errors in step abort the statement
+	assert2 (nil, CONN:execute ("select lua_total(g) from ("..groups..")"))
+	-- window functions
+	assert2 (true, CONN:createaggregate ("lua_window", 1, add, result, sub, result))
+	cur = CUR_OK (CONN:execute ("select lua_window(v) over (order by rowid rows between 1 preceding and current row) from (select column1 as v, rowid from (values (1), (2), (3), (4)))"))
+	local sums = {}
+	for s in function () return cur:fetch() end do
+		sums[#sums+1] = s
+	end
+	assert2 ("1,3,5,7", table.concat (sums, ","))
+	assert2 (true, CONN:createaggregate ("lua_window", 1, nil))
+	assert2 (nil, CONN:execute"select lua_window(1)")
+	io.write (" createaggregate")
+end
+
+---------------------------------------------------------------------
+-- Lua arrays bound as one parameter and read through carray().
+---------------------------------------------------------------------
+function array ()
+	if not CONN.array then
+		io.write (" (carray not available)")
+		return
+	end
+	local function values (sql, ...)
+		local cur = CUR_OK (CONN:execute (sql, ...))
+		local list = {}
+		for v in function () return cur:fetch() end do
+			list[#list+1] = v
+		end
+		return table.concat (list, ",")
+	end
+	local ids = {}
+	for i = 1, 1000 do ids[i] = i * 2 end
+	local arr = CONN:array (ids)
+	assert2 (1000, #arr)
+	assert2 ("2,4,6", values ("select value from carray(?) limit 3", arr))
+	local numbers = "select column1 from (values (1), (2), (3), (4), (1999), (2000))"
+	local sql = numbers.." where column1 in carray(?) order by 1"
+	assert2 ("2,4,2000", values (sql, arr))
+	-- the same cached statement takes lists of any length
+	local hits = CONN:getcachestats().hits
+	assert2 ("1,3", values (sql, CONN:array { 1, 3, 5 }))
+	assert2 (hits + 1, CONN:getcachestats().hits)
+	assert2 ("", values (sql, CONN:array {}))
+	assert2 ("a,c", values ("select column1 from (values ('a'), ('b'), ('c')) where column1 in carray(:list)",
+		{ [":list"] = CONN:array { "a", "c" } }))
+	assert2 ("0.5,1.5", values ("select value from carray(?)", CONN:array { 0.5, 1.5 }))
+	assert2 ("1,2", values ("select value from carray(?)", CONN:array ({ 1, 2 }, "int32")))
+	-- packed native values
+	if string.pack then
+		assert2 ("7,-8", values ("select value from carray(?)", CONN:array (string.pack ("=i4i4", 7, -8), "int32")))
+		assert2 ("2.5", values ("select value from carray(?)", CONN:array (string.pack ("=d", 2.5), "double")))
+		assert2 (false, pcall (CONN.array, CONN, "abc", "int32"))
+	end
+	-- the array stays alive while a cursor reads it
+	local cur = CUR_OK (CONN:execute ("select value from carray(?)", CONN:array { "x", "y" }))
+	collectgarbage ()
+	assert2 ("x", cur:fetch())
+	assert2 ("y", cur:fetch())
+	cur:close()
+	assert2 (false, pcall (CONN.array, CONN, { 1, "a" }))
+	assert2 (false, pcall (CONN.array, CONN, { 1.5 }, "int64"))
+	assert2 ("", values ("select value from carray"))
+	io.write (" array")
+end
+
+---------------------------------------------------------------------
+-- Lua tables read as virtual tables.
+---------------------------------------------------------------------
+function createvtab ()
+	local function values (sql, ...)
+		local cur = CUR_OK (CONN:execute (sql, ...))
+		local list = {}
+		local row = { cur:fetch() }
+		while row[1] ~= nil do
+			list[#list+1] = table.concat (row, ":")
+			row = { cur:fetch() }
+		end
+		cur:close()
+		return table.concat (list, ",")
+	end
+	local rows = {
+		{ id = 1, name = "one" },
+		{ 2, "two" },
+		{ id = 3, name = "three", extra = true },
+		{ id = 2, name = "deux" },
+	}
+	assert2 (true, CONN:createvtab ("lua_rows", { "id", "name" }, rows))
+	assert2 ("1:one,2:two,3:three,2:deux", values"select id, name from lua_rows")
+	assert2 ("3:three", values"select rowid, name from lua_rows where rowid = 3")
+	assert2 ("", values"select name from lua_rows where rowid = 7")
+	assert2 ("two,deux", values"select name from lua_rows where id = 2")
+	-- the source is read when the query runs
+	rows[5] = { id = 5, name = "five" }
+	assert2 ("five", values"select name from lua_rows where id = 5")
+	assert2 (true, CONN:createvtab ("lua_cols", { "key", "weight" }, {
+		key = { "a", "b", "c" },
+		weight = { 1.5, 2, 3 },
+	}))
+	assert2 ("two:b,two:b,deux:b,deux:b", values ([[
+		select r.name, c.key
+		from (select 2 as id union all select 2 union all select 9) as k
+		join lua_rows as r on r.id = k.id
+		join lua_cols as c on c.weight = r.id
+		order by r.rowid]]))
+	assert2 ("6.5", values"select sum(weight) from lua_cols")
+	assert2 (nil, CONN:execute"insert into lua_cols values ('d', 4)")
+	assert2 (false, pcall (CONN.createvtab, CONN, "lua_bad", {}, {}))
+	io.write (" createvtab")
+end
+
+---------------------------------------------------------------------
+-- Online backup and restore.
+---------------------------------------------------------------------
+function backup ()
+	local file = datasource.."-backup"
+	os.remove (file)
+	local mem = CONN_OK (ENV:connect":memory:")
+	assert (mem:execute"create table k (v)")
+	assert2 (1000, mem:executemany ("insert into k values (?)", (function ()
+		local rows = {}
+		for i = 1, 1000 do rows[i] = { string.rep ("x", 100)..i } end
+		return rows
+	end)()))
+	-- incremental snapshot to a file
+	local bk = assert (mem:backup (file, 5))
+	assert2 (false, bk:step())
+	local total = bk:pagecount()
+	assert (total > 5, "too few pages")
+	assert2 (total - 5, bk:remaining())
+	assert2 (false, pcall (mem.close, mem))
+	-- the source stays usable between steps
+	assert2 (1, mem:execute"insert into k values ('late')")
+	local done
+	repeat
+		done = bk:step()
+		assert (done ~= nil, "backup step failed")
+	until done
+	assert2 (0, bk:remaining())
+	assert2 (true, bk:finish())
+	assert2 (false, bk:finish())
+	-- restore the file into a new in-memory database
+	local copy = CONN_OK (ENV:connect":memory:")
+	assert2 (true, copy:restore (file))
+	local cur = CUR_OK (copy:execute"select count(*) from k")
+	assert2 (1001, tonumber (cur:fetch()))
+	cur:close()
+	-- between connections
+	local other = CONN_OK (ENV:connect":memory:")
+	bk = assert (copy:backup (other))
+	assert2 (true, bk:step())
+	assert2 (false, pcall (other.close, other))
+	assert2 (true, bk:finish())
+	cur = CUR_OK (other:execute"select count(*) from k")
+	assert2 (1001, tonumber (cur:fetch()))
+	cur:close()
+	assert2 (nil, other:restore (file.."-missing"))
+	-- a locked source is reported, not silently skipped
+	local locker = CONN_OK (ENV:connect (file))
+	assert (locker:execute"begin exclusive")
+	assert2 (1, locker:execute"insert into k values ('locked')")
+	assert2 (nil, other:restore (file))
+	assert (locker:execute"rollback")
+	assert2 (true, locker:close())
+	assert2 (true, other:close())
+	assert2 (true, copy:close())
+	assert2 (true, mem:close())
+	os.remove (file)
+	io.write (" backup")
+end
+
+---------------------------------------------------------------------
+-- Databases serialized to strings and deserialized from strings or files.
+---------------------------------------------------------------------
+function serialize ()
+	local file = datasource.."-image"
+	local function count (conn)
+		local cur = CUR_OK (conn:execute"select count(*), max(v) from k")
+		local n, max = cur:fetch()
+		cur:close()
+		return tonumber (n), max
+	end
+	local mem = CONN_OK (ENV:connect":memory:")
+	assert (mem:execute"create table k (v)")
+	assert2 (3, mem:executemany ("insert into k values (?)", { {"a"}, {"b"}, {"c"} }))
+	local image = assert (mem:serialize())
+	assert2 ("SQLite format 3\0", image:sub (1, 16))
+	assert2 (true, mem:close())
+
+	-- a writable copy of the string
+	local copy = CONN_OK (ENV:deserialize (image))
+	assert2 (1, copy:execute"insert into k values ('d')")
+	assert2 (4, count (copy))
+	-- a read-only database using the string in place
+	local ro = CONN_OK (ENV:deserialize (image, { readonly = true }))
+	assert2 (3, count (ro))
+	assert2 (nil, ro:execute"insert into k values ('e')")
+	assert2 (true, ro:close())
+
+	-- files, read or mapped
+	local f = assert (io.open (file, "wb"))
+	f:write (copy:serialize())
+	f:close()
+	assert2 (true, copy:close())
+	local read = CONN_OK (ENV:deserialize (file))
+	assert2 (1, read:execute"insert into k values ('e')")
+	assert2 (5, count (read))
+	assert2 (true, read:close())
+	local mapped = ENV:deserialize (file, { mmap = true })
+	if mapped then
+		local n, max = count (mapped)
+		assert2 (4, n)
+		assert2 ("d", max)
+		assert2 (nil, mapped:execute"insert into k values ('e')")
+		assert2 (true, mapped:close())
+	end
+	assert2 (nil, ENV:deserialize (file.."-missing"))
+	assert2 (false, pcall (ENV.deserialize, ENV, image, { mmap = true }))
+	-- an empty image is an empty database
+	local empty = CONN_OK (ENV:deserialize"")
+	assert2 (0, empty:execute"create table e (v)")
+	assert2 (true, empty:close())
+	os.remove (file)
+	io.write (" serialize")
+end
+
+---------------------------------------------------------------------
+-- Query deadlines and interruption.
+---------------------------------------------------------------------
+function deadlines ()
+	local endless = "with recursive c(x) as (select 1 union all select x+1 from c) "
+	local conn = CONN_OK (ENV:connect (":memory:", { query_timeout = 50 }))
+	-- a runaway statement is stopped with a distinct error
+	local start = os.clock ()
+	local ok, err = conn:execute (endless.."select count(*) from c")
+	assert2 (nil, ok)
+	assert (err:match"deadline exceeded", err)
+	assert (os.clock () - start < 5, "deadline not enforced")
+	assert2 (0, conn:execute"create table d (v)")
+	assert2 (1, conn:execute"insert into d values (1)")
+	assert2 (true, conn:setquerytimeout ())
+	-- a deadline shared by the calls of a cursor closes it
+	assert2 (true, conn:setdeadline (50))
+	local cur = CUR_OK (conn:execute (endless.."select x from c"))
+	local n = 0
+	repeat
+		ok, err = cur:fetch ()
+		n = n + 1
+	until not ok
+	assert (n > 1, "first rows not fetched")
+	assert (err:match"deadline exceeded", err)
+	assert2 (false, cur:close ())
+	-- later calls fail at once until it is removed
+	assert2 (nil, conn:execute"select v from d")
+	assert2 (true, conn:setdeadline ())
+	cur = CUR_OK (conn:execute"select v from d")
+	assert2 (1, tonumber (cur:fetch ()))
+	cur:close ()
+	-- calls made by a function called by SQL keep the time limit
+	assert2 (true, conn:setquerytimeout (50))
+	assert2 (true, conn:createfunction ("poke", 1, function (x)
+		conn:getcachestats ()
+		return x
+	end, { deterministic = false }))
+	ok, err = conn:execute ("with recursive c(x) as (select 1 union all select x+1 from c where x < 1000000) "..
+		"select count(*) from c where poke(x)")
+	assert2 (nil, ok, "deadline moved by a nested call")
+	assert (err:match"deadline exceeded", err)
+	assert2 (true, conn:setquerytimeout ())
+	-- interruption from a function called by SQL
+	assert2 (true, conn:createfunction ("stop", 0, function ()
+		conn:interrupt ()
+		return 0
+	end, { deterministic = false }))
+	ok, err = conn:execute (endless.."select count(*) from c where x = 10 and stop()")
+	assert2 (nil, ok)
+	assert (err:match"interrupted", err)
+	-- and of an open cursor
+	cur = CUR_OK (conn:execute (endless.."select x from c"))
+	assert2 (1, tonumber (cur:fetch ()))
+	assert2 (true, conn:interrupt ())
+	ok, err = cur:fetch ()
+	assert2 (nil, ok)
+	assert (err:match"interrupted", err)
+	assert2 (false, cur:close ())
+	-- the connection stays usable
+	cur = CUR_OK (conn:execute"select v from d")
+	assert2 (1, tonumber (cur:fetch ()))
+	cur:close ()
+	assert2 (false, pcall (conn.setquerytimeout, conn, -1))
+	assert2 (true, conn:close ())
+	io.write (" deadlines")
+end
+
+---------------------------------------------------------------------
+-- Coroutines yielding during long queries.
+---------------------------------------------------------------------
+function yielding ()
+	if not coroutine.isyieldable then
+		io.write (" (yielding needs Lua 5.3)")
+		return
+	end
+	local scan = "with recursive c(x) as (select 1 union all select x+1 from c limit 200000) "
+	local conn = CONN_OK (ENV:connect":memory:")
+	assert2 (true, conn:setyield (10000))
+	-- each fetch scans many rows, so the coroutine yields between them
+	local co = coroutine.wrap (function ()
+		local cur = CUR_OK (conn:execute (scan.."select x from c where x % 50000 = 0"))
+		local list = {}
+		for x in function () return cur:fetch () end do
+			list[#list+1] = x
+		end
+		return "done", table.concat (list, ",")
+	end)
+	local yields = 0
+	local status, rows = co ("ignored")
+	while status ~= "done" do
+		assert2 (nil, status)
+		yields = yields + 1
+		status, rows = co ("ignored")
+	end
+	assert2 ("50000,100000,150000,200000", rows)
+	assert (yields >= 4, "too few yields")
+	-- other coroutines use the connection in between
+	local a = coroutine.wrap (function ()
+		return conn:execute (scan.."select count(*) from c")
+	end)
+	assert2 (nil, a ())
+	local cur = CUR_OK (conn:execute"select 1")
+	assert2 (1, tonumber (cur:fetch ()))
+	cur:close ()
+	cur = a ()
+	assert2 (200000, tonumber (cur:fetch ()))
+	cur:close ()
+	-- the main thread does not yield
+	cur = CUR_OK (conn:execute (scan.."select count(*) from c"))
+	assert2 (200000, tonumber (cur:fetch ()))
+	cur:close ()
+	assert2 (true, conn:setyield ())
+	assert2 (false, pcall (conn.setyield, conn, -1))
+	assert2 (true, conn:close ())
+	io.write (" yielding")
+end
+
+---------------------------------------------------------------------
+-- Statement counters of cursors and of the stats callback.
+---------------------------------------------------------------------
+function stats ()
+	local conn = CONN_OK (ENV:connect":memory:")
+	assert2 (0, conn:execute"create table s (v)")
+	assert2 (100, conn:executemany ("insert into s values (?)", (function ()
+		local rows = {}
+		for i = 1, 100 do rows[i] = { i } end
+		return rows
+	end)()))
+	-- a query without an index scans the whole table
+	local query = "select v from s where v = 50"
+	local cur = CUR_OK (conn:execute (query))
+	assert2 (50, tonumber (cur:fetch ()))
+	assert (cur:stats ().vm_steps > 0, "no steps while open")
+	assert2 (nil, cur:fetch ())
+	local st = cur:stats ()
+	assert2 (99, st.fullscan_steps)
+	assert2 (0, st.sorts)
+	-- the counters are reset between runs of a cached statement
+	cur = CUR_OK (conn:execute (query))
+	cur:close ()
+	assert (cur:stats ().fullscan_steps < 99, "counters not reset")
+	cur = CUR_OK (conn:execute"select v from s order by v desc")
+	assert2 (100, tonumber (cur:fetch ()))
+	cur:close ()
+	assert2 (1, cur:stats ().sorts)
+	cur = CUR_OK (conn:execute"select count(*) from s a, s b where a.v = b.v")
+	assert2 (100, tonumber (cur:fetch ()))
+	cur:close ()
+	assert (cur:stats ().autoindexes > 0, "no automatic index")
+	-- every statement is reported to the callback
+	local seen = {}
+	assert2 (true, conn:onstats (function (t)
+		seen[#seen+1] = t
+		-- statements of the callback are not reported
+		conn:execute"select 1":close ()
+		error"ignored"
+	end))
+	assert2 (1, conn:execute"update s set v = v + 1 where v = 1")
+	assert2 (1, #seen)
+	assert2 ("update s set v = v + 1 where v = 1", seen[1].sql)
+	assert2 (99, seen[1].fullscan_steps)
+	assert2 (2, conn:executemany ("insert into s values (?)", { {1}, {2} }))
+	assert2 (2, #seen)
+	assert2 (2, seen[2].runs)
+	assert2 (true, conn:onstats ())
+	assert2 (1, conn:execute"delete from s where v = 1")
+	assert2 (2, #seen)
+	assert2 (false, pcall (conn.onstats, conn, 1))
+	assert2 (true, conn:close ())
+	io.write (" stats")
+end
+
+---------------------------------------------------------------------
+-- Memory and page cache counters.
+---------------------------------------------------------------------
+function status ()
+	local conn = CONN_OK (ENV:connect":memory:")
+	assert2 (0, conn:execute"create table m (v)")
+	assert2 (200, conn:executemany ("insert into m values (?)", (function ()
+		local rows = {}
+		for i = 1, 200 do rows[i] = { string.rep ("m", 200) } end
+		return rows
+	end)()))
+	local cur = CUR_OK (conn:execute"select count(*) from m")
+	assert2 (200, tonumber (cur:fetch ()))
+	cur:close ()
+	local st = conn:status ()
+	assert (st.cache_used > 0, "no cache used")
+	assert (st.schema_used > 0, "no schema memory")
+	assert (st.stmt_used > 0, "no statement memory")
+	assert (st.cache_hits > 0, "no cache hits")
+	assert (st.lookaside_used_max >= st.lookaside_used, "lookaside")
+	assert (st.process.memory_used > 0, "no memory used")
+	assert (st.process.memory_used_max >= st.process.memory_used, "memory")
+	-- a reset zeroes the cache counters
+	st = conn:status (true)
+	assert (st.cache_hits > 0, "no cache hits")
+	st = conn:status ()
+	assert2 (0, st.cache_hits)
+	assert2 (0, st.cache_misses)
+	assert2 (true, conn:close ())
+	io.write (" status")
+end
+
+---------------------------------------------------------------------
+-- Rows changed by committed transactions.
+---------------------------------------------------------------------
+function onchange ()
+	local conn = CONN_OK (ENV:connect":memory:")
+	assert2 (0, conn:execute"create table c (v)")
+	local batches = {}
+	assert2 (true, conn:onchange (function (changes)
+		batches[#batches+1] = changes
+	end))
+	local function describe (changes)
+		local list = {}
+		for i, c in ipairs (changes) do
+			list[i] = c.op..":"..c.db.."."..c.table..":"..c.rowid
+		end
+		return table.concat (list, ",")
+	end
+	-- each statement in auto commit mode
+	assert2 (1, conn:execute"insert into c values ('a')")
+	assert2 (1, #batches)
+	assert2 ("insert:main.c:1", describe (batches[1]))
+	-- executemany commits all of its rows at once
+	assert2 (2, conn:executemany ("insert into c values (?)", { {"b"}, {"c"} }))
+	assert2 (2, #batches)
+	assert2 ("insert:main.c:2,insert:main.c:3", describe (batches[2]))
+	-- nothing is delivered before the commit
+	conn:setautocommit (false)
+	assert2 (1, conn:execute"update c set v = 'B' where rowid = 2")
+	assert2 (1, conn:execute"delete from c where rowid = 3")
+	assert2 (2, #batches)
+	assert2 (true, conn:commit ())
+	assert2 (3, #batches)
+	assert2 ("update:main.c:2,delete:main.c:3", describe (batches[3]))
+	-- and rolled back changes are dropped
+	assert2 (1, conn:execute"delete from c where rowid = 1")
+	assert2 (true, conn:rollback ())
+	assert2 (3, #batches)
+	conn:setautocommit (true)
+	-- statements returning rows commit when their cursor ends
+	local cur = CUR_OK (conn:execute"insert into c values ('d') returning v")
+	assert2 ("d", cur:fetch ())
+	assert2 (nil, cur:fetch ())
+	assert2 (4, #batches)
+	assert2 ("insert:main.c:3", describe (batches[4]))
+	-- and so are changes undone by savepoints or by failed statements
+	conn:setautocommit (false)
+	assert2 (1, conn:execute"update c set v = 'A' where rowid = 1")
+	assert2 (true, conn:savepoint ())
+	assert2 (1, conn:execute"insert into c values ('e')")
+	assert2 (true, conn:savepoint ("inner"))
+	assert2 (1, conn:execute"delete from c where rowid = 2")
+	assert2 (true, conn:rollbackto ())
+	assert2 (true, conn:release ())
+	assert2 (nil, conn:execute"insert into c (rowid, v) values (10, 'f'), (1, 'g')")
+	assert2 (true, conn:commit ())
+	conn:setautocommit (true)
+	assert2 (5, #batches)
+	assert2 ("update:main.c:1", describe (batches[5]))
+	-- errors of the callback do not fail the call which committed
+	assert2 (true, conn:onchange (function (changes)
+		batches[#batches+1] = changes
+		error"callback failed"
+	end))
+	assert2 (1, conn:execute"update c set v = 'a' where rowid = 1")
+	assert2 (6, #batches)
+	cur = CUR_OK (conn:execute"select v from c where rowid = 1")
+	assert2 ("a", cur:fetch ())
+	cur:close ()
+	assert2 (true, conn:onchange ())
+	assert2 (1, conn:execute"delete from c where rowid = 3")
+	assert2 (6, #batches)
+	assert2 (false, pcall (conn.onchange, conn, 1))
+	assert2 (true, conn:close ())
+	io.write (" onchange")
+end
+
+---------------------------------------------------------------------
+-- Changesets of the session extension.
+---------------------------------------------------------------------
+function session ()
+	local src = CONN_OK (ENV:connect":memory:")
+	if not src.session then
+		assert2 (true, src:close ())
+		io.write (" (session extension not compiled)")
+		return
+	end
+	local dst = CONN_OK (ENV:connect":memory:")
+	for _, conn in ipairs { src, dst } do
+		assert2 (0, conn:execute"create table r (id integer primary key, v)")
+		assert2 (0, conn:execute"create table other (id integer primary key, v)")
+		assert2 (1, conn:execute"insert into r values (1, 'one')")
+	end
+	local function contents (conn)
+		local cur = CUR_OK (conn:execute"select id, v from r order by id")
+		local list = {}
+		for id, v in function () return cur:fetch () end do
+			list[#list+1] = id..":"..v
+		end
+		return table.concat (list, ",")
+	end
+	local se = assert (src:session { "r" })
+	assert2 (true, se:isempty ())
+	assert2 (1, src:execute"insert into r values (2, 'two')")
+	assert2 (1, src:execute"update r set v = 'uno' where id = 1")
+	-- tables not attached are not recorded
+	assert2 (1, src:execute"insert into other values (1, 'x')")
+	assert2 (false, se:isempty ())
+	local changeset, patchset = se:changeset (), se:patchset ()
+	assert (#patchset < #changeset, "patchset not smaller")
+	assert2 (false, pcall (src.close, src))
+	assert2 (true, dst:applychangeset (changeset))
+	assert2 ("1:uno,2:two", contents (dst))
+	-- a new session records all tables
+	assert2 (true, se:close ())
+	se = assert (src:session ())
+	-- conflicting changes abort without a handler
+	assert2 (1, src:execute"update r set v = 'one' where id = 1")
+	assert2 (1, dst:execute"update r set v = 'ein' where id = 1")
+	changeset = se:changeset ()
+	assert2 (nil, dst:applychangeset (changeset))
+	assert2 ("1:ein,2:two", contents (dst))
+	-- the handler sees the conflict and decides
+	local seen
+	assert2 (true, dst:applychangeset (changeset, function (c)
+		seen = c
+		return "replace"
+	end))
+	assert2 ("data", seen.kind)
+	assert2 ("update", seen.op)
+	assert2 ("r", seen.table)
+	assert2 ("ein", seen.conflicting[2])
+	assert2 ("one", seen.new[2])
+	assert2 ("1:one,2:two", contents (dst))
+	-- errors of the callbacks undo the changeset
+	assert2 (2, dst:execute"delete from r")
+	local ok, err = dst:applychangeset (changeset, nil, function (name)
+		error"filter failed"
+	end)
+	assert2 (nil, ok)
+	assert (err:match"filter failed", err)
+	assert2 ("", contents (dst))
+	ok, err = dst:applychangeset (changeset, function () return "skip" end)
+	assert2 (nil, ok)
+	assert (err:match"invalid conflict action", err)
+	-- patchsets apply as well, and the filter selects the tables
+	assert2 (true, dst:applychangeset (patchset, function () return "omit" end,
+		function (name) return name == "r" end))
+	assert2 ("2:two", contents (dst))
+	-- changes undone by a failed apply are not reported
+	local reported = 0
+	assert2 (true, dst:onchange (function (list) reported = reported + #list end))
+	local undone = assert (src:session ())
+	assert2 (1, src:execute"insert into other values (2, 'y')")
+	assert2 (1, src:execute"update r set v = 'deux' where id = 2")
+	changeset = undone:changeset ()
+	assert2 (true, undone:close ())
+	assert2 (1, dst:execute"update r set v = 'zwei' where id = 2")
+	reported = 0
+	ok, err = dst:applychangeset (changeset, function () error"conflict failed" end)
+	assert2 (nil, ok)
+	assert (err:match"conflict failed", err)
+	assert2 (0, reported)
+	ok, err = dst:applychangeset (changeset, function () return "abort" end)
+	assert2 (nil, ok)
+	assert (err:match"abort", err)
+	assert2 (0, reported)
+	assert2 ("2:zwei", contents (dst))
+	assert2 (true, dst:onchange ())
+	assert2 (false, se:enable (false))
+	assert2 (true, se:close ())
+	assert2 (false, se:close ())
+	assert2 (true, dst:close ())
+	assert2 (true, src:close ())
+	io.write (" session")
+end
+
+---------------------------------------------------------------------
+-- Transaction modes and savepoints.
+---------------------------------------------------------------------
+function transactions ()
+	local file = datasource.."-txn"
+	os.remove (file)
+	local a = CONN_OK (ENV:connect (file, { begin = "immediate", timeout = 0 }))
+	local b = CONN_OK (ENV:connect (file, { timeout = 0 }))
+	assert2 (0, a:execute"create table x (v)")
+	-- immediate transactions take the write lock when they begin
+	assert2 (true, a:setautocommit (false))
+	assert2 (nil, b:execute"insert into x values (1)")
+	assert2 (true, a:commit ())
+	assert2 (nil, b:execute"insert into x values (1)")
+	assert2 (true, a:setautocommit (true))
+	assert2 (1, b:execute"insert into x values (1)")
+	-- deferred ones when they first write
+	assert2 (true, a:setbeginmode"DEFERRED")
+	assert2 (true, a:setautocommit (false))
+	assert2 (1, b:execute"insert into x values (2)")
+	assert2 (true, a:rollback ())
+	assert2 (true, a:setautocommit (true))
+	assert2 (false, pcall (a.setbeginmode, a, "LAZY"))
+	assert2 (true, b:close ())
+	-- nested savepoints
+	assert2 (true, a:savepoint ())
+	assert2 (1, a:execute"insert into x values (3)")
+	assert2 (true, a:savepoint"inner")
+	assert2 (1, a:execute"insert into x values (4)")
+	assert2 (true, a:rollbackto"inner")
+	assert2 (1, a:execute"insert into x values (5)")
+	assert2 (true, a:release"inner")
+	assert2 (true, a:release ())
+	local cur = CUR_OK (a:execute"select group_concat(v) from x")
+	assert2 ("1,2,3,5", cur:fetch ())
+	cur:close ()
+	assert2 (nil, a:release"missing")
+	-- a failed commit keeps manual commit mode
+	assert (a:execute"pragma foreign_keys = on")
+	assert (a:execute"create table p (id integer primary key)")
+	assert (a:execute"create table ch (p references p deferrable initially deferred)")
+	assert2 (true, a:setautocommit (false))
+	assert2 (1, a:execute"insert into ch values (1)")
+	local ok, err = a:commit ()
+	assert2 (nil, ok)
+	assert (err:match"FOREIGN KEY", err)
+	assert2 (true, a:rollback ())
+	assert2 (1, a:execute"insert into p values (1)")
+	assert2 (1, a:execute"insert into ch values (1)")
+	assert2 (true, a:commit ())
+	assert2 (true, a:setautocommit (true))
+	cur = CUR_OK (a:execute"select count(*) from ch")
+	assert2 (1, tonumber (cur:fetch ()))
+	cur:close ()
+	assert2 (true, a:close ())
+	os.remove (file)
+	io.write (" transactions")
+end
+
+---------------------------------------------------------------------
+-- Scripts of several statements.
+---------------------------------------------------------------------
+function executescript ()
+	local conn = CONN_OK (ENV:connect ":memory:")
+	local counts = assert (conn:executescript ([[
+		create table s (k, v);  -- a table
+		insert into s values (:k, 'a'), (:k + 1, 'b');
+		/* a comment */ ;;
+		update s set v = upper(v) where k > ?;
+		delete from s where k = :gone;
+	]], { [":k"] = 1, 1, [":gone"] = 9 }))
+	assert2 (4, #counts)
+	assert2 (0, counts[1])
+	assert2 (2, counts[2])
+	assert2 (1, counts[3])
+	assert2 (0, counts[4])
+	-- the last query gives a cursor
+	local cur
+	counts, cur = conn:executescript ("insert into s values (3, 'c'); select v from s order by k")
+	assert2 (2, #counts)
+	assert2 (1, counts[1])
+	assert2 ("a", cur:fetch ())
+	assert2 ("B", cur:fetch ())
+	assert2 ("c", cur:fetch ())
+	assert2 (nil, cur:fetch ())
+	-- earlier statements are kept unless the script runs in a transaction
+	local ok, err, n = conn:executescript ("insert into s values (4, 'd'); insert into nowhere values (1)")
+	assert2 (nil, ok)
+	assert2 ("string", type (err))
+	assert2 (2, n)
+	ok, err, n = conn:executescript ("insert into s values (5, 'e'); select * from; select 1", nil, true)
+	assert2 (nil, ok)
+	assert2 (2, n)
+	cur = CUR_OK (conn:execute"select group_concat(k) from s")
+	assert2 ("1,2,3,4", cur:fetch ())
+	cur:close ()
+	assert2 (0, #assert (conn:executescript (" -- nothing\n")))
+	assert2 (false, pcall (conn.executescript, conn, "select ?", { {} }))
+	assert2 (true, conn:close ())
+	io.write (" executescript")
+end
+
+---------------------------------------------------------------------
+-- Memory configuration and counters of the process.
+---------------------------------------------------------------------
+function memory ()
+	local st = ENV:status ()
+	assert2 ("number", type (st.memory_used))
+	assert2 ("number", type (st.pagecache_used))
+	assert2 ("string", type (st.allocator))
+	-- SQLite is already in use: the allocator can not change anymore
+	local env, err = luasql.sqlite3 { allocator = "lua", pagecache = 16 }
+	assert2 (nil, env)
+	assert2 ("string", type (err))
+	assert2 (false, pcall (luasql.sqlite3, { allocator = "none" }))
+	assert2 (false, pcall (luasql.sqlite3, { pagecache = 16, pagecache_page = 1000 }))
+	-- but the heap limit can
+	env = ENV_OK (luasql.sqlite3 { heap_limit = 64 * 1024 * 1024 })
+	if env:status ().heap_limit then
+		assert2 (64 * 1024 * 1024, env:status ().heap_limit)
+	end
+	ENV_OK (luasql.sqlite3 { heap_limit = 0 })
+	assert2 (true, env:close ())
+	io.write (" memory")
+end
+
+---------------------------------------------------------------------
+-- Queries on several database files at once.
+---------------------------------------------------------------------
+function shards ()
+	local files = {}
+	for i = 1, 3 do
+		files[i] = datasource.."-shard"..i
+		os.remove (files[i])
+		local conn = CONN_OK (ENV:connect (files[i]))
+		assert (conn:execute"create table s (k integer, name text)")
+		-- shard i has the keys i, i+3, i+6, ...
+		assert2 (300, conn:executemany ("insert into s values (?, ?)", (function ()
+			local rows = {}
+			for k = i, 900, 3 do rows[#rows+1] = { k, "n"..k } end
+			return rows
+		end)()))
+		assert2 (true, conn:close ())
+	end
+	local shards = assert (ENV:shards (files, { workers = 2 }))
+	assert2 (false, pcall (ENV.shards, ENV, {}))
+	-- arrival order
+	local cur = assert (shards:execute ("select k from s where k > ?", 450))
+	local seen, n = {}, 0
+	for k in cur.fetch, cur do
+		assert2 (nil, seen[k])
+		seen[k] = true
+		n = n + 1
+	end
+	assert2 (450, n)
+	-- merged by a key
+	cur = assert (shards:merge ("select k, name from s order by k desc", { "-k" }))
+	assert2 ("k", cur:getcolnames ()[1])
+	local prev = math.huge
+	n = 0
+	for k, name in cur.fetch, cur do
+		assert (k < prev, "rows out of order")
+		assert2 ("n"..k, name)
+		prev = k
+		n = n + 1
+	end
+	assert2 (900, n)
+	cur = assert (shards:merge ("select name, k from s where k <= :max order by k", { 2 }, { [":max"] = 5 }))
+	local row = {}
+	for i = 1, 5 do
+		assert2 (row, cur:fetch (row, "a"))
+		assert2 (i, row.k)
+	end
+	assert2 (nil, cur:fetch ())
+	if CONN.array then
+		cur = assert (shards:merge ("select k from s where k in carray(?) order by k", { 1 }, CONN:array { 4, 2, 3 }))
+		assert2 (2, cur:fetch ())
+		assert2 (3, cur:fetch ())
+		assert2 (4, cur:fetch ())
+		assert2 (nil, cur:fetch ())
+	end
+	assert2 (false, pcall (shards.merge, shards, "select k from s", { "nothing" }))
+	-- statements without rows run on every shard
+	assert2 (9, shards:execute ("update s set name = upper(name) where k % 100 = 0"))
+	-- errors
+	local ok, err = shards:execute"select * from nowhere"
+	assert2 (nil, ok)
+	assert2 ("string", type (err))
+	cur = assert (shards:execute"select k, case when k = 900 then json('{') end from s")
+	ok, err = cur:fetch ()
+	while ok do ok, err = cur:fetch () end
+	assert2 ("string", type (err), "failure of a shard")
+	assert2 (false, cur:close ())
+	-- cursors closed before their end stop the queries
+	cur = assert (shards:execute"select a.k from s a, s b")
+	assert (cur:fetch ())
+	assert2 (false, pcall (shards.close, shards))
+	assert2 (true, cur:close ())
+	assert2 (true, shards:close ())
+	assert2 (false, shards:close ())
+	-- the workers run ahead of the rows read by a few batches only, and
+	-- still go on when the Lua state waits for a task queued behind them
+	shards = assert (ENV:shards (files, { workers = 1 }))
+	local other = assert (shards:execute"select a.k from s a, s b")
+	assert (other:fetch ())
+	cur = assert (shards:merge ("select a.k, b.k from s a, s b where b.k <= 30 order by a.k, b.k", { 1, 2 }))
+	local prev_a, prev_b = 0, 0
+	n = 0
+	for a, b in cur.fetch, cur do
+		assert (a > prev_a or (a == prev_a and b >= prev_b), "rows out of order")
+		prev_a, prev_b = a, b
+		n = n + 1
+	end
+	assert2 (9000, n)
+	assert (other:fetch ())
+	assert2 (true, other:close ())
+	assert2 (true, shards:close ())
+	for i = 1, 3 do
+		os.remove (files[i])
+	end
+	io.write (" shards")
+end
+
+---------------------------------------------------------------------
+-- Checkpoints of the WAL, explicit or run by a background thread.
+---------------------------------------------------------------------
+function checkpoints ()
+	local file = datasource.."-wal"
+	local function remove ()
+		os.remove (file)
+		os.remove (file.."-wal")
+		os.remove (file.."-shm")
+	end
+	remove ()
+	local conn = CONN_OK (ENV:connect (file, { journal_mode = "wal" }))
+	assert (conn:execute"create table w (v)")
+	assert2 (1, conn:execute"insert into w values (1)")
+	local log, done = conn:checkpoint ()
+	assert2 ("number", type (log))
+	assert2 (log, done)
+	log, done = conn:checkpoint ("truncate", "main")
+	assert2 (0, log)
+	assert2 (false, pcall (conn.checkpoint, conn, "sometimes"))
+	-- the thread is woken up by large WALs
+	assert2 (true, conn:setcheckpointer (60000, 5))
+	for i = 1, 20 do
+		assert2 (1, conn:execute ("insert into w values ("..i..")"))
+	end
+	local st = conn:status ()
+	assert (st.wal_frames >= 5, "size of the WAL")
+	local limit = os.time () + 10
+	while conn:status ().checkpoints == 0 and os.time () < limit do end
+	assert (conn:status ().checkpoints > 0, "no checkpoint in the background")
+	assert2 (0, conn:status ().checkpoint_failures)
+	-- and reconfigured or stopped
+	assert2 (true, conn:setcheckpointer (10))
+	assert2 (true, conn:setcheckpointer ())
+	assert2 (nil, conn:status ().wal_frames)
+	assert2 (true, conn:setcheckpointer (1000))
+	assert2 (true, conn:close ())
+	remove ()
+	local mem = CONN_OK (ENV:connect ":memory:")
+	assert2 (nil, mem:setcheckpointer (10))
+	assert2 (true, mem:close ())
+	io.write (" checkpoints")
+end
+
+---------------------------------------------------------------------
+-- Pool of a writer and reader threads.
+---------------------------------------------------------------------
+function pool ()
+	local file = datasource.."-pool"
+	local function remove ()
+		os.remove (file)
+		os.remove (file.."-wal")
+		os.remove (file.."-shm")
+	end
+	local function rows (cur)
+		local list = {}
+		for v in function () return cur:fetch() end do
+			list[#list+1] = v
+		end
+		return table.concat (list, ",")
+	end
+	remove ()
+	local pool = assert (ENV:pool (file, { readers = 2, timeout = 1000 }))
+	-- writes go to the writer
+	assert2 (0, pool:execute"create table p (v integer)")
+	local values = {}
+	for i = 1, 100 do values[i] = { i } end
+	assert2 (100, pool:writer():executemany ("insert into p values (?)", values))
+	-- reads go to the readers
+	local cur = assert (pool:execute ("select v from p where v > ? order by v", 97))
+	assert2 ("SQLite3 pool cursor", tostring (cur):match"^[^(]*[^ (]")
+	assert2 (true, cur:ready())
+	assert2 ("v", cur:getcolnames()[1])
+	assert2 ("integer", cur:getcoltypes()[1]:lower())
+	assert2 ("98,99,100", rows (cur))
+	assert2 (false, cur:close())
+	-- more queries than readers run as readers are free
+	local pending = {}
+	for i = 1, 5 do
+		pending[i] = assert (pool:submit ("select sum(v) from p where v <= :n", { [":n"] = i * 10 }))
+	end
+	for i = 1, 5 do
+		local sum = pending[i]:fetch()
+		assert2 (i * 10 * (i * 10 + 1) / 2, sum)
+		assert2 (true, pending[i]:close())
+	end
+	-- rows come in batches, even with more unread queries than readers
+	local big = "select a.v * 1000 + b.v from p a, p b"
+	for i = 1, 3 do
+		pending[i] = assert (pool:submit (big))
+	end
+	for i = 3, 1, -1 do
+		local n = 0
+		for v in pending[i].fetch, pending[i] do n = n + 1 end
+		assert2 (10000, n)
+	end
+	cur = assert (pool:execute (big))
+	assert (cur:fetch())
+	assert2 (true, cur:close())
+	-- errors of the readers
+	assert2 (nil, pool:execute"select nothing from p")
+	assert2 (nil, pool:execute"select abs(-9223372036854775807 - 1)")
+	local failed = assert (pool:submit"select abs(-9223372036854775807 - 1)")
+	local res, err = failed:fetch()
+	assert2 (nil, res)
+	assert (err:find"overflow", err)
+	-- arrays are read by the readers too
+	if CONN.array then
+		cur = assert (pool:execute ("select v from p where v in carray(?) order by v", CONN:array { 3, 5 }))
+		assert2 ("3,5", rows (cur))
+	end
+	-- functions created on the writer only run there
+	assert2 (true, pool:writer():createfunction ("twice", 1, function (v) return 2 * v end))
+	cur = CUR_OK (pool:execute"select twice(v) from p where v = 21")
+	assert2 (42, cur:fetch())
+	cur:close()
+	-- inside a transaction, everything goes to the writer
+	local writer = pool:writer()
+	assert2 (true, writer:setautocommit (false))
+	assert2 (1, pool:execute"insert into p values (101)")
+	cur = CUR_OK (pool:execute"select count(*) from p")
+	assert2 (101, tonumber (cur:fetch()))
+	cur:close()
+	assert2 (true, writer:rollback())
+	assert2 (true, writer:setautocommit (true))
+	cur = assert (pool:execute"select count(*) from p")
+	assert2 (100, cur:fetch())
+	cur:close()
+	-- open cursors keep the pool open
+	cur = assert (pool:submit"select v from p")
+	assert2 (false, pcall (pool.close, pool))
+	cur:close()
+	assert2 (true, pool:close())
+	assert2 (false, pool:close())
+	assert2 (false, pcall (writer.execute, writer, "select 1"))
+	-- a writer with open cursors outlives its pool
+	pool = assert (ENV:pool (file, { readers = 1 }))
+	writer = pool:writer()
+	cur = CUR_OK (writer:execute"select v from p")
+	assert2 (true, pool:close())
+	assert2 (1, cur:fetch())
+	cur:close()
+	assert2 (true, writer:close())
+	remove ()
+	io.write (" pool")
+end
+
 table.insert (CONN_METHODS, "escape")
 table.insert (EXTENSIONS, escape)
+table.insert (CONN_METHODS, "prepare")
+table.insert (EXTENSIONS, prepare)
+table.insert (EXTENSIONS, first_row)
+table.insert (CONN_METHODS, "setcachesize")
+table.insert (CONN_METHODS, "getcachestats")
+table.insert (EXTENSIONS, statement_cache)
+table.insert (CONN_METHODS, "executemany")
+table.insert (EXTENSIONS, executemany)
+table.insert (EXTENSIONS, bound_strings)
+table.insert (EXTENSIONS, connect_options)
+table.insert (CONN_METHODS, "openblob")
+table.insert (EXTENSIONS, blob)
+table.insert (CONN_METHODS, "createfunction")
+table.insert (EXTENSIONS, createfunction)
+table.insert (CONN_METHODS, "createaggregate")
+table.insert (EXTENSIONS, createaggregate)
+-- conn:array is only compiled against SQLite 3.20 or newer
+local major, minor = string.match (require"luasql.sqlite3"._CLIENTVERSION, "^(%d+)%.(%d+)")
+if tonumber (major) * 1000 + tonumber (minor) >= 3020 then
+	table.insert (CONN_METHODS, "array")
+end
+table.insert (EXTENSIONS, array)
+table.insert (CONN_METHODS, "createvtab")
+table.insert (EXTENSIONS, createvtab)
+table.insert (CONN_METHODS, "backup")
+table.insert (CONN_METHODS, "restore")
+table.insert (EXTENSIONS, backup)
+table.insert (CONN_METHODS, "serialize")
+table.insert (EXTENSIONS, serialize)
+table.insert (EXTENSIONS, pool)
+table.insert (CONN_METHODS, "setquerytimeout")
+table.insert (CONN_METHODS, "setdeadline")
+table.insert (CONN_METHODS, "interrupt")
+table.insert (EXTENSIONS, deadlines)
+table.insert (CONN_METHODS, "setyield")
+table.insert (EXTENSIONS, yielding)
+table.insert (CONN_METHODS, "onstats")
+table.insert (EXTENSIONS, stats)
+table.insert (CONN_METHODS, "status")
+table.insert (EXTENSIONS, status)
+table.insert (CONN_METHODS, "onchange")
+table.insert (EXTENSIONS, onchange)
+table.insert (EXTENSIONS, session)
+table.insert (CONN_METHODS, "setbeginmode")
+table.insert (CONN_METHODS, "savepoint")
+table.insert (CONN_METHODS, "release")
+table.insert (CONN_METHODS, "rollbackto")
+table.insert (EXTENSIONS, transactions)
+table.insert (CONN_METHODS, "executescript")
+table.insert (EXTENSIONS, executescript)
+table.insert (EXTENSIONS, memory)
+table.insert (EXTENSIONS, shards)
+table.insert (CONN_METHODS, "checkpoint")
+table.insert (CONN_METHODS, "setcheckpointer")
+table.insert (EXTENSIONS, checkpoints)